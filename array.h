@@ -0,0 +1,426 @@
+#ifndef __ARRAY_H__
+#define __ARRAY_H__
+
+#include <stdio.h>
+#include "libstorm.h"
+#include "asic.h"
+
+using namespace storm;
+
+#define MAX_TRANSDUCERS 6
+#define MAX_AXES 6
+//Both directions of every axis
+#define MAX_PATHS (2*MAX_AXES)
+//Unit vectors are Q14, the solver coefficients Q16
+#define UNIT_Q 14
+
+//Calibration reads every CAL_RESULT and the temperature in one transaction
+static_assert(MAX_TRANSDUCERS + 1 <= I2C_TXN_OPS, "I2C_TXN_OPS too small for MAX_TRANSDUCERS");
+
+/**
+ * The transducers of an anemometer, where they are, and which pairs of them
+ * face each other (the axes). Set up with add() and add_axis(), then
+ * finalize() before anything uses it.
+ *
+ * finalize() works out
+ *  - the shot schedule, an order over both directions of every axis. Each
+ *    shot is followed by one on the axis sharing the fewest transducers
+ *    with it and, among those, the least parallel to it, so the next
+ *    receiver is not picking up the last transmitter ringing down.
+ *  - the least squares solver from the wind along each axis to the wind
+ *    vector. The array is solved in 3D if the axes span it, else in the xy
+ *    plane if they span that, else along the first axis only.
+ *
+ * All ASICs share the gang trigger, so their IRQ lines must all be on PORTB.
+ */
+class TransducerArray
+{
+public:
+  struct Transducer
+  {
+    ChirpASIC *asic;
+    //Operational I2C address
+    uint8_t addr;
+    //Position in mm
+    int16_t pos[3];
+  };
+  struct Axis
+  {
+    //Path direction 0 transmits from ends[0] to ends[1], direction 1 back
+    uint8_t ends[2];
+    //Face to face, in mm
+    uint16_t length;
+    //ends[0] to ends[1], Q14
+    int16_t unit[3];
+  };
+  struct Path
+  {
+    uint8_t axis;
+    uint8_t dir;
+  };
+  TransducerArray() : n(0), naxes_(0), npaths_(0), dims_(0) {}
+  //Returns the index of the transducer, or -1 if it cannot be added
+  int add(ChirpASIC *asic, uint8_t addr, int16_t x, int16_t y, int16_t z)
+  {
+    if (n == MAX_TRANSDUCERS || !asic->gang_capable())
+    {
+      printf("ERR: cannot add transducer %d\n", n);
+      return -1;
+    }
+    ducers[n] = Transducer{asic, addr, {x, y, z}};
+    return n++;
+  }
+  //Returns the index of the axis, or -1 if it cannot be added
+  int add_axis(uint8_t a, uint8_t b)
+  {
+    if (naxes_ == MAX_AXES || a >= n || b >= n || a == b)
+    {
+      printf("ERR: cannot add axis %d-%d\n", a, b);
+      return -1;
+    }
+    axes[naxes_] = Axis{{a, b}, 0, {0, 0, 0}};
+    return naxes_++;
+  }
+  //Acoustic path length of an axis in mm, where it differs from the face to
+  //face distance finalize() takes from the positions. Call after finalize().
+  void set_length(uint8_t axis, uint16_t mm)
+  {
+    axes[axis].length = mm;
+  }
+  //Returns false if an axis has no length
+  bool finalize()
+  {
+    for (int k = 0; k < naxes_; k++)
+    {
+      Axis &ax = axes[k];
+      int32_t d[3];
+      uint32_t sq = 0;
+      for (int i = 0; i < 3; i++)
+      {
+        d[i] = ducers[ax.ends[1]].pos[i] - ducers[ax.ends[0]].pos[i];
+        sq += d[i]*d[i];
+      }
+      ax.length = isqrt(sq);
+      if (ax.length == 0)
+      {
+        printf("ERR: axis %d has no length\n", k);
+        return false;
+      }
+      for (int i = 0; i < 3; i++)
+      {
+        ax.unit[i] = d[i] * (1 << UNIT_Q) / (int32_t)ax.length;
+      }
+    }
+    build_schedule();
+    build_solver();
+    return true;
+  }
+
+  int size() const
+  {
+    return n;
+  }
+  ChirpASIC *asic(int i) const
+  {
+    return ducers[i].asic;
+  }
+  uint8_t addr(int i) const
+  {
+    return ducers[i].addr;
+  }
+  //The mask for ChirpASIC::gang_pulse that triggers every transducer
+  uint32_t gang_all() const
+  {
+    uint32_t mask = 0;
+    for (int i = 0; i < n; i++)
+    {
+      mask |= ducers[i].asic->gang_bit();
+    }
+    return mask;
+  }
+  int naxes() const
+  {
+    return naxes_;
+  }
+  Axis const &axis(int k) const
+  {
+    return axes[k];
+  }
+  int tx(uint8_t axis, uint8_t dir) const
+  {
+    return axes[axis].ends[dir];
+  }
+  int rx(uint8_t axis, uint8_t dir) const
+  {
+    return axes[axis].ends[dir ^ 1];
+  }
+  //Shot order, repeated
+  int npaths() const
+  {
+    return npaths_;
+  }
+  Path const &path(int step) const
+  {
+    return schedule[step];
+  }
+  //2 or 3, or 1 if only the wind along axis 0 is known
+  int dims() const
+  {
+    return dims_;
+  }
+
+  /**
+   * Wind along an axis, from ends[0] towards ends[1], in mm/s from the time
+   * of flight each way in ns: length/2 * (1/fwd - 1/rev).
+   */
+  static int32_t along(uint16_t length, int32_t fwd_ns, int32_t rev_ns)
+  {
+    if (fwd_ns <= 0 || rev_ns <= 0)
+    {
+      return 0;
+    }
+    int64_t num = (int64_t)length * (rev_ns - fwd_ns) * 500000000LL;
+    return (int32_t)(num / ((int64_t)fwd_ns * rev_ns));
+  }
+  //The same with t_rev - t_fwd given separately in ps, as the phase refined
+  //difference is much finer than the TOFs themselves
+  static int32_t along(uint16_t length, int32_t fwd_ns, int32_t rev_ns, int32_t dt_ps)
+  {
+    if (fwd_ns <= 0 || rev_ns <= 0)
+    {
+      return 0;
+    }
+    int64_t num = (int64_t)length * dt_ps * 500000;
+    return (int32_t)(num / ((int64_t)fwd_ns * rev_ns));
+  }
+  //Speed of sound along an axis in mm/s: length/2 * (1/fwd + 1/rev)
+  static int32_t sound_speed(uint16_t length, int32_t fwd_ns, int32_t rev_ns)
+  {
+    if (fwd_ns <= 0 || rev_ns <= 0)
+    {
+      return 0;
+    }
+    int64_t num = (int64_t)length * (fwd_ns + rev_ns) * 500000000LL;
+    return (int32_t)(num / ((int64_t)fwd_ns * rev_ns));
+  }
+  //Least squares wind vector in mm/s from the wind along each axis
+  void solve(const int32_t *along, int32_t wind[3]) const
+  {
+    int64_t s[3] = {0, 0, 0};
+    for (int r = 0; r < dims_; r++)
+    {
+      for (int k = 0; k < naxes_; k++)
+      {
+        s[r] += (int64_t)pinv[r][k] * along[k];
+      }
+      s[r] >>= 16;
+    }
+    if (dims_ == 1)
+    {
+      for (int i = 0; i < 3; i++)
+      {
+        wind[i] = (int32_t)((s[0] * axes[0].unit[i]) >> UNIT_Q);
+      }
+      return;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+      wind[i] = (int32_t)s[i];
+    }
+  }
+private:
+  static uint32_t isqrt(uint32_t v)
+  {
+    uint32_t res = 0;
+    uint32_t one = 1UL << 30;
+    while (one > v)
+    {
+      one >>= 2;
+    }
+    while (one != 0)
+    {
+      if (v >= res + one)
+      {
+        v -= res + one;
+        res = (res >> 1) + one;
+      }
+      else
+      {
+        res >>= 1;
+      }
+      one >>= 2;
+    }
+    return res;
+  }
+  //How badly a shot on axis b interferes with one on axis a just before it
+  int32_t crosstalk(int a, int b) const
+  {
+    int shared = 0;
+    for (int i = 0; i < 2; i++)
+    {
+      for (int j = 0; j < 2; j++)
+      {
+        shared += axes[a].ends[i] == axes[b].ends[j];
+      }
+    }
+    int32_t dot = 0;
+    for (int i = 0; i < 3; i++)
+    {
+      dot += (int32_t)axes[a].unit[i] * axes[b].unit[i];
+    }
+    if (dot < 0)
+    {
+      dot = -dot;
+    }
+    return (shared << 16) + (dot >> UNIT_Q);
+  }
+  //Every axis one way, then every axis back in the same order, so
+  //consecutive shots are on different axes where there is more than one and
+  //the two halves of each pair are evenly spaced. The axis order is greedy
+  //on crosstalk, including from the last axis round to the first.
+  void build_schedule()
+  {
+    uint8_t order[MAX_AXES];
+    bool used[MAX_AXES] = {};
+    for (int step = 0; step < naxes_; step++)
+    {
+      int best = -1;
+      int32_t best_cost = 0;
+      for (int k = 0; k < naxes_; k++)
+      {
+        if (used[k])
+        {
+          continue;
+        }
+        int32_t cost = 0;
+        if (step > 0)
+        {
+          cost = crosstalk(order[step-1], k);
+        }
+        if (step == naxes_ - 1 && step > 0)
+        {
+          cost += crosstalk(k, order[0]);
+        }
+        if (best < 0 || cost < best_cost)
+        {
+          best = k;
+          best_cost = cost;
+        }
+      }
+      used[best] = true;
+      order[step] = best;
+    }
+    npaths_ = 2*naxes_;
+    for (int step = 0; step < naxes_; step++)
+    {
+      schedule[step] = Path{order[step], 0};
+      schedule[naxes_ + step] = Path{order[step], 1};
+    }
+  }
+  //Divide two values of the same Q format into a Q16 result
+  static int32_t div_q16(int64_t num, int64_t den)
+  {
+    if (den < 0)
+    {
+      num = -num;
+      den = -den;
+    }
+    while (den >= (1LL << 46) || num >= (1LL << 46) || num <= -(1LL << 46))
+    {
+      num >>= 1;
+      den >>= 1;
+    }
+    return (int32_t)((num * 65536) / den);
+  }
+  /**
+   * pinv = (C'C)^-1 C' where row k of C is axis k's unit vector in the
+   * basis being solved for, through the adjugate so it stays in integers.
+   * The Q formats of each numerator and determinant match, and products of
+   * three Q14 terms fit easily in 64 bits.
+   */
+  void build_solver()
+  {
+    int64_t a[3][3] = {};
+    for (int r = 0; r < 3; r++)
+    {
+      for (int c = 0; c < 3; c++)
+      {
+        for (int k = 0; k < naxes_; k++)
+        {
+          a[r][c] += ((int32_t)axes[k].unit[r] * axes[k].unit[c]) >> UNIT_Q;
+        }
+      }
+    }
+    //Cofactors, transposed as the adjugate
+    int64_t adj[3][3];
+    for (int r = 0; r < 3; r++)
+    {
+      for (int c = 0; c < 3; c++)
+      {
+        int r0 = (c+1)%3, r1 = (c+2)%3, c0 = (r+1)%3, c1 = (r+2)%3;
+        adj[r][c] = a[r0][c0]*a[r1][c1] - a[r0][c1]*a[r1][c0];
+      }
+    }
+    int64_t det = a[0][0]*adj[0][0] + a[0][1]*adj[1][0] + a[0][2]*adj[2][0];
+    //Well conditioned enough if det is at least 1/64 of a unit determinant
+    if (naxes_ >= 3 && (det > (1LL << (3*UNIT_Q - 6)) || det < -(1LL << (3*UNIT_Q - 6))))
+    {
+      dims_ = 3;
+      for (int r = 0; r < 3; r++)
+      {
+        for (int k = 0; k < naxes_; k++)
+        {
+          int64_t num = 0;
+          for (int c = 0; c < 3; c++)
+          {
+            num += adj[r][c] * axes[k].unit[c];
+          }
+          pinv[r][k] = div_q16(num, det);
+        }
+      }
+      return;
+    }
+    det = a[0][0]*a[1][1] - a[0][1]*a[1][0];
+    if (naxes_ >= 2 && (det > (1LL << (2*UNIT_Q - 6)) || det < -(1LL << (2*UNIT_Q - 6))))
+    {
+      dims_ = 2;
+      for (int k = 0; k < naxes_; k++)
+      {
+        int32_t ux = axes[k].unit[0];
+        int32_t uy = axes[k].unit[1];
+        pinv[0][k] = div_q16(a[1][1]*ux - a[0][1]*uy, det);
+        pinv[1][k] = div_q16(a[0][0]*uy - a[1][0]*ux, det);
+      }
+      return;
+    }
+    //Along axis 0, from every axis parallel to it
+    dims_ = 1;
+    int64_t sum = 0;
+    int32_t proj[MAX_AXES];
+    for (int k = 0; k < naxes_; k++)
+    {
+      proj[k] = 0;
+      for (int i = 0; i < 3; i++)
+      {
+        proj[k] += ((int32_t)axes[k].unit[i] * axes[0].unit[i]) >> UNIT_Q;
+      }
+      sum += ((int64_t)proj[k] * proj[k]) >> UNIT_Q;
+    }
+    for (int k = 0; k < naxes_; k++)
+    {
+      pinv[0][k] = div_q16(proj[k], sum);
+    }
+  }
+
+  Transducer ducers[MAX_TRANSDUCERS];
+  Axis axes[MAX_AXES];
+  Path schedule[MAX_PATHS];
+  //Solver coefficients, Q16
+  int32_t pinv[3][MAX_AXES];
+  uint8_t n;
+  uint8_t naxes_;
+  uint8_t npaths_;
+  uint8_t dims_;
+};
+
+#endif
@@ -4,6 +4,9 @@
 #include "libstorm.h"
 #include "libfirestorm.h"
 #include "wind_v8.rawbin.h"
+#ifdef STORM_SIM
+#include "storm_sim.h"
+#endif
 
 using namespace storm;
 
@@ -42,6 +45,13 @@ using namespace storm;
 #define INTENSITY 0x1A
 #define INTENSITY_SZ 2
 
+//Time in reset with prog asserted before the firmware upload
+#define RESET_HOLD (200*Timer::MILLISECOND)
+//Length of the gang trigger pulse that starts a shot, in ticks (~10.7 us)
+#define TRIGGER_PULSE 4
+//MAX_RANGE register value set after calibration
+#define DEFAULT_RANGE 0x10
+
 #define MODE_TXRX 0x10
 #define MODE_RX 0x20
 
@@ -49,10 +59,12 @@ class ChirpASIC
 {
 public:
   ChirpASIC(gpio::Pin prog, gpio::Pin irq, gpio::Pin rst)
-    : prog(prog), irq(irq), rst(rst)
+    : prog(prog), irq(irq), rst(rst), addr(DEF_ADDR), held(false), held_at(0)
   {
+    //Not held in reset, so firmware uploaded before a watchdog reset of
+    //ours survives for a warm boot
     gpio::set_mode(rst, gpio::OUT);
-    gpio::set(rst, 0);
+    gpio::set(rst, 1);
     gpio::set_mode(prog, gpio::OUT);
     gpio::set(prog, 0);
     gpio::set_mode(irq, gpio::OUT);
@@ -97,45 +109,62 @@ public:
   //  irq_input();
     gpio::set(irq, 0);
   }
-  void _upload(uint16_t ptr, std::function<void(int)> const & ondone)
-  {
-    //Called with the i2c lock held
-    printf("uploading ptr=%d\n", ptr);
-    auto buf = mkbuf(128);
-    for (int i = 0; i < 128; i++)
-    {
-      (*buf)[i] = wind_v8_rawbin[ptr + i];
-    }
-    auto flag = (ptr+256 > 2048) ? i2c::STOP : i2c::NONE;
-    if (ptr == 0) {
-      flag = i2c::RSTART;
-    }
-    i2c::write(i2c::external(DEF_ADDR), flag, buf, 128, [=](int status, buf_t buf)
-    {
-      printf("complete s=%d\n", status);
-      if (status != 0) {
-        ondone(status);
-      } else if (ptr + 128 >= 2048) {
-        ondone(0);
-      } else {
-        _upload(ptr+128, ondone);
-      }
-    });
-  }
-  void gang_irq_active()
+#ifndef STORM_SIM
+  //Drive the IRQ lines in mask high together, see gang_bit()
+  static void gang_irq_active(uint32_t mask)
   {
     //The address of PORTB OVR SET
     uint32_t addr = 0x400E1000 + 0x200 + 0x054;
-    uint32_t mask = 3 << 4;
     *((volatile uint32_t*)addr) = mask;
   }
-  void gang_irq_idle()
+  static void gang_irq_idle(uint32_t mask)
   {
     //The address of PORTB OVR CLR
     uint32_t addr = 0x400E1000 + 0x200 + 0x058;
-    uint32_t mask = 3 << 4;
     *((volatile uint32_t*)addr) = mask;
   }
+#else
+  //The simulator has no PORTB, it just tells the bench
+  static void gang_irq_active(uint32_t mask)
+  {
+    sim::gang_trigger(mask);
+  }
+  static void gang_irq_idle(uint32_t mask) {}
+#endif
+  //Only ASICs with their IRQ line on PORTB can be gang triggered
+  bool gang_capable() const
+  {
+    return (irq.spec >> 8) == 1;
+  }
+  //This ASIC's IRQ line in a gang mask
+  uint32_t gang_bit() const
+  {
+    return 1UL << (irq.spec & 0xFF);
+  }
+  //Assert the gang IRQ lines and return the tick they went active at
+  static uint32_t gang_pulse_begin(uint32_t mask)
+  {
+    gang_irq_active(mask);
+    return sys::now(sys::SHIFT_0);
+  }
+  //Spin on the tick counter until ticks have passed since rise, release the
+  //gang IRQ lines and return how long they were really asserted. The caller
+  //may have done other work since gang_pulse_begin(), this still ends on
+  //time or, if that is already past, straight away with the true length.
+  static uint32_t gang_pulse_end(uint32_t mask, uint32_t rise, uint32_t ticks)
+  {
+    uint32_t fall;
+    do
+    {
+      fall = sys::now(sys::SHIFT_0);
+    } while (fall - rise < ticks);
+    gang_irq_idle(mask);
+    return fall - rise;
+  }
+  static uint32_t gang_pulse(uint32_t mask, uint32_t ticks)
+  {
+    return gang_pulse_end(mask, gang_pulse_begin(mask), ticks);
+  }
   // void _readready(std::function<void(int, bool)>ondone)
   // {
   //   i2c::lock.acquire([=]
@@ -195,6 +224,16 @@ public:
       });
     });
   }
+  //Queue a single byte register write onto a batch
+  void queue_w_reg(i2c::Transaction &t, uint8_t regaddr, uint8_t value)
+  {
+    t.write(i2c::external(this->addr), {regaddr, 1, value});
+  }
+  //Queue a register read onto a batch, the data is in t.result() afterwards
+  void queue_r_reg(i2c::Transaction &t, uint8_t regaddr, uint8_t sz)
+  {
+    t.write_read(i2c::external(this->addr), {regaddr}, mkbuf(sz), sz);
+  }
   void print_state() {
     i2c::lock.acquire([=]
     {
@@ -282,6 +321,15 @@ public:
     auto ph = std::make_shared<std::function<void()>>(handler);
     gpio::enable_irq(irq, gpio::RISING, ph);
   }
+  //For handlers enabled over and over, which then cost no allocation
+  void enable_irq(std::shared_ptr<std::function<void()>> const &handler)
+  {
+    gpio::enable_irq(irq, gpio::RISING, handler);
+  }
+  gpio::Pin irq_pin() const
+  {
+    return irq;
+  }
   void disable_irq()
   {
     gpio::disable_irq(irq);
@@ -327,115 +375,110 @@ public:
       });
     });
   }
-  //Called from program with the i2c lock held
-  void set_addr(uint8_t new_addr, std::function<void(int)> const & ondone)
+  //Use an ASIC that is already programmed at addr
+  void set_addr(uint8_t addr)
   {
-      addr = new_addr;
-      auto buf = mkbuf({PROG_ADDR, 0xC5, 0x01});
-      i2c::write(i2c::external(DEF_ADDR), i2c::START | i2c::STOP, buf, 3, [this,ondone](int status, buf_t buf)
-      {
-        if (status != 0) {
-          ondone(status);
-          return;
-        }
-        (*buf)[0] = PROG_DATA;
-        (*buf)[1] = this->addr >> 1;
-        (*buf)[2] = 0x00;
-        i2c::write(i2c::external(DEF_ADDR), i2c::START | i2c::STOP, buf, 2, [this,ondone](int status, buf_t buf)
-        {
-          if (status != 0) {
-            ondone(status);
-            return;
-          }
-          (*buf)[0] = PROG_CTL;
-          (*buf)[1] = 0x0B;
-          i2c::write(i2c::external(DEF_ADDR), i2c::START | i2c::STOP, buf, 2, [this,ondone](int status, buf_t buf)
-          {
-            if (status != 0) {
-              ondone(status);
-              return;
-            }
-            (*buf)[0] = PROG_CPU;
-            (*buf)[1] = 0x02;
-            i2c::write(i2c::external(DEF_ADDR), i2c::START | i2c::STOP, buf, 2, [this,ondone](int status, buf_t buf)
-            {
-              if (status != 0) {
-                ondone(status);
-                return;
-              }
-              this->prog_idle();
-              i2c::lock.release();
-              ondone(0);
-            });
-          });
-        });
-      });
+    this->addr = addr;
   }
-  void program(uint8_t addr, std::function<void(int)> const & ondone)
+  uint8_t get_addr() const
+  {
+    return addr;
+  }
+  //Put the ASIC in reset with prog asserted, ready for Program. Holding
+  //several at once overlaps their reset delays.
+  void hold_for_program()
   {
     rst_active();
-    Timer::once(100*Timer::MILLISECOND, [this,ondone,addr](auto)
+    prog_active();
+    held = true;
+    held_at = sys::now();
+  }
+  /**
+   * Resets the ASIC, uploads the firmware over the default address and moves
+   * it to addr. The result is an i2c status.
+   */
+  class Program : public co::Routine
+  {
+  public:
+    Program(ChirpASIC *asic, uint8_t addr)
+      : asic(asic), addr(addr)
     {
-      printf("finished RST v\n");
-      this->prog_active();
-      Timer::once(100*Timer::MILLISECOND, [this,ondone,addr](auto)
+    }
+  protected:
+    bool body() override
+    {
+      CO_BEGIN
+      if (!asic->held)
+      {
+        asic->hold_for_program();
+      }
+      //Only whatever part of the hold has not already gone by
+      wait = asic->held_at + RESET_HOLD - sys::now();
+      if (wait > 0)
       {
-        printf("finished RST ^\n");
-        this->rst_idle();
-        Timer::once(100*Timer::MILLISECOND,[this,ondone,addr](auto)
+        CO_AWAIT(sleep(wait));
+      }
+      asic->rst_idle();
+      asic->held = false;
+      CO_AWAIT(sleep(100*Timer::MILLISECOND));
+      CO_AWAIT(acquire(i2c::lock));
+      CO_AWAIT(i2c_write(i2c::external(DEF_ADDR), i2c::START | i2c::STOP, {PROG_ADDR, 0x00, 0xF8}));
+      if (status != i2c::OK) CO_RETURN(fail());
+      CO_AWAIT(i2c_write(i2c::external(DEF_ADDR), i2c::START | i2c::STOP, {PROG_CNT, 0xFF, 0x07}));
+      if (status != i2c::OK) CO_RETURN(fail());
+      CO_AWAIT(i2c_write(i2c::external(DEF_ADDR), i2c::START, {PROG_CTL, 0x0B}));
+      if (status != i2c::OK) CO_RETURN(fail());
+      for (ptr = 0; ptr < 2048; ptr += 128)
+      {
+        if (!io)
         {
-          i2c::lock.acquire([this,ondone,addr]
-          {
-            printf("i2c acquired\n");
-            auto buf = mkbuf({PROG_ADDR, 0x00, 0xF8});
-            i2c::write(i2c::external(DEF_ADDR), i2c::START | i2c::STOP, buf, 3, [this,ondone,addr](int status, buf_t buf)
-            {
-              printf("i2c1\n");
-              if (status != 0) {
-                ondone(status);
-                return;
-              }
-              (*buf)[0] = PROG_CNT;
-              (*buf)[1] = 0xFF;
-              (*buf)[2] = 0x07;
-              i2c::write(i2c::external(DEF_ADDR), i2c::START | i2c::STOP, buf, 3, [this,ondone,addr](int status, buf_t buf)
-              {
-                if (status != 0) {
-                  ondone(status);
-                  return;
-                }
-                (*buf)[0] = PROG_CTL;
-                (*buf)[1] = 0x0B;
-                i2c::write(i2c::external(DEF_ADDR), i2c::START, buf, 2, [this,ondone,addr](int status, buf_t buf)
-                {
-                  if (status != 0) {
-                    ondone(status);
-                    return;
-                  }
-                  this->_upload(0, [this,ondone,addr](int status)
-                  {
-                    if (status != 0) {
-                      ondone(status);
-                      return;
-                    }
-                    this->set_addr(addr, ondone);
-                    //i2c::lock.release();
-                    //ondone(0);
-                  });
-                });
-              });
-            });
-          });
-        });
-      });
-    });
-
-  }
+          io = mkbuf(128);
+        }
+        std::memcpy(&(*io)[0], &wind_v8_rawbin[ptr], 128);
+        CO_AWAIT(i2c_write(i2c::external(DEF_ADDR), upload_flag(ptr), io, 128));
+        if (status != i2c::OK) CO_RETURN(fail());
+      }
+      //Move it off the default address
+      asic->addr = addr;
+      CO_AWAIT(i2c_write(i2c::external(DEF_ADDR), i2c::START | i2c::STOP, {PROG_ADDR, 0xC5, 0x01}));
+      if (status != i2c::OK) CO_RETURN(fail());
+      CO_AWAIT(i2c_write(i2c::external(DEF_ADDR), i2c::START | i2c::STOP, {PROG_DATA, (uint8_t)(addr >> 1)}));
+      if (status != i2c::OK) CO_RETURN(fail());
+      CO_AWAIT(i2c_write(i2c::external(DEF_ADDR), i2c::START | i2c::STOP, {PROG_CTL, 0x0B}));
+      if (status != i2c::OK) CO_RETURN(fail());
+      CO_AWAIT(i2c_write(i2c::external(DEF_ADDR), i2c::START | i2c::STOP, {PROG_CPU, 0x02}));
+      if (status != i2c::OK) CO_RETURN(fail());
+      asic->prog_idle();
+      i2c::lock.release();
+      CO_END
+    }
+  private:
+    static i2c::I2CFlag upload_flag(uint16_t ptr)
+    {
+      if (ptr == 0)
+      {
+        return i2c::RSTART;
+      }
+      return (ptr+256 > 2048) ? i2c::STOP : i2c::NONE;
+    }
+    int fail()
+    {
+      printf("WRN: program i2c %s\n", i2c::decode(status));
+      i2c::lock.release();
+      return status;
+    }
+    ChirpASIC *asic;
+    uint8_t addr;
+    uint16_t ptr;
+    int32_t wait;
+  };
 private:
   storm::gpio::Pin prog;
   storm::gpio::Pin irq;
   storm::gpio::Pin rst;
   uint8_t addr;
+  bool held;
+  uint32_t held_at;
 };
 
 #endif
@@ -0,0 +1,1182 @@
+/**
+ * Host benchmark for libstorm, run against the simulated kernel.
+ *
+ * make bench && ./bench
+ *
+ * Wall clock figures are for the host and only meaningful relative to each
+ * other. Allocation counts and virtual ticks are exact and reproducible.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <math.h>
+#include <random>
+#include <vector>
+#include "libstorm.h"
+#include "storm_sim.h"
+#include "asic.h"
+#include "array.h"
+#include "measure.h"
+#include "boot.h"
+#include "calibration.h"
+#include "tof.h"
+#include "wind.h"
+#include "stats.h"
+#include "telemetry.h"
+#include "tuning.h"
+
+using namespace storm;
+
+namespace
+{
+  struct Sample
+  {
+    std::chrono::steady_clock::time_point wall;
+    sim::Stats stats;
+    uint64_t ticks;
+  };
+  Sample mark()
+  {
+    return Sample{std::chrono::steady_clock::now(), sim::stats, sim::now()};
+  }
+  double wall_ns(Sample const &a, Sample const &b)
+  {
+    return std::chrono::duration<double, std::nano>(b.wall - a.wall).count();
+  }
+  void report(const char *name, Sample const &a, Sample const &b, uint64_t n, const char *unit)
+  {
+    double ns = wall_ns(a, b);
+    printf("%-24s %9llu %-10s %10.1f ns/op %12.0f op/s %8.2f allocs/op %8.2f syscalls/op",
+      name, (unsigned long long)n, unit, ns/n, n*1e9/ns,
+      (double)(b.stats.allocs - a.stats.allocs)/n,
+      (double)(b.stats.syscalls - a.stats.syscalls)/n);
+    if (b.ticks != a.ticks)
+    {
+      printf(" %8.1f ticks/op", (double)(b.ticks - a.ticks)/n);
+    }
+    printf("\n");
+  }
+
+  void bench_tq()
+  {
+    constexpr int N = 200000;
+    int count = 0;
+    auto a = mark();
+    for (int i = 0; i < N; i++)
+    {
+      tq::add([&count]{ count++; });
+      if ((i & 15) == 15)
+      {
+        while(tq::run_one());
+      }
+    }
+    while(tq::run_one());
+    auto b = mark();
+    report("tq add+run", a, b, count, "tasks");
+  }
+
+  void bench_timer_periodic()
+  {
+    constexpr int NTIMERS = 8;
+    int count = 0;
+    Timer::Handle timers[NTIMERS];
+    for (int i = 0; i < NTIMERS; i++)
+    {
+      timers[i] = Timer::periodic((i+1)*Timer::MILLISECOND, [&count](auto)
+      {
+        count++;
+      });
+    }
+    auto a = mark();
+    sim::run(10*Timer::SECOND);
+    auto b = mark();
+    for (int i = 0; i < NTIMERS; i++)
+    {
+      timers[i].cancel();
+    }
+    report("timer periodic", a, b, count, "callbacks");
+  }
+
+  void bench_timer_once()
+  {
+    constexpr int N = 20000;
+    int count = 0;
+    std::function<void()> next = [&]
+    {
+      if (++count < N)
+      {
+        Timer::once(Timer::MILLISECOND, [&](auto){ next(); });
+      }
+    };
+    auto a = mark();
+    next();
+    sim::run(N*2*Timer::MILLISECOND);
+    auto b = mark();
+    report("timer once chain", a, b, count, "timers");
+  }
+
+  //The register read pattern of ChirpASIC::_r_reg under the i2c lock
+  void bench_i2c_reg_read()
+  {
+    constexpr int N = 20000;
+    constexpr uint16_t ADDR = i2c::external(0x30);
+    static sim::RegisterDevice dev;
+    sim::attach_i2c(ADDR, &dev);
+    int count = 0;
+    std::function<void()> next = [&]
+    {
+      i2c::lock.acquire([&]
+      {
+        i2c::write(ADDR, i2c::START, mkbuf({0x16}), 1, [&](int status, buf_t)
+        {
+          i2c::read(ADDR, i2c::RSTART | i2c::STOP, mkbuf(70), 70, [&](int status, buf_t rv)
+          {
+            i2c::lock.release();
+            if (++count < N)
+            {
+              next();
+            }
+          });
+        });
+      });
+    };
+    auto a = mark();
+    next();
+    sim::run((uint64_t)N*Timer::SECOND);
+    auto b = mark();
+    report("i2c 70B register read", a, b, count, "reads");
+  }
+
+  //The same read as a transaction, optionally with the two opmode writes
+  //that arm the next shot batched behind it as MeasurementEngine does
+  void bench_i2c_txn(const char *name, bool arm)
+  {
+    constexpr int N = 20000;
+    constexpr uint16_t ADDRS[2] = {i2c::external(0x30), i2c::external(0x40)};
+    static sim::RegisterDevice devs[2];
+    static i2c::Transaction txn;
+    sim::attach_i2c(ADDRS[0], &devs[0]);
+    sim::attach_i2c(ADDRS[1], &devs[1]);
+    int count = 0;
+    std::function<void()> next = [&]
+    {
+      txn.clear();
+      txn.write_read(ADDRS[0], {0x16}, mkbuf(70), 70);
+      if (arm)
+      {
+        txn.write(ADDRS[0], {0x01, 0x01, 0x10});
+        txn.write(ADDRS[1], {0x01, 0x01, 0x20});
+      }
+      txn.run([&](i2c::Transaction &t)
+      {
+        if (++count < N)
+        {
+          tq::add([&]{ next(); });
+        }
+      });
+    };
+    auto a = mark();
+    next();
+    sim::run((uint64_t)N*Timer::SECOND);
+    auto b = mark();
+    report(name, a, b, count, "batches");
+  }
+
+  sim::RegisterDevice asic_devs[3];
+  //Never destroyed, like the globals in main.cc
+  ChirpASIC *asicA = new ChirpASIC(gpio::A2, gpio::A0, gpio::D6);
+  ChirpASIC *asicB = new ChirpASIC(gpio::A3, gpio::A1, gpio::D7);
+  //The single axis head of main.cc
+  TransducerArray *axis1 = []
+  {
+    auto a = new TransducerArray();
+    a->add(asicA, 0x30, 0, 0, 0);
+    a->add(asicB, 0x40, 150, 0, 0);
+    a->add_axis(0, 1);
+    a->finalize();
+    return a;
+  }();
+
+  //Raise the IRQ line of every ASIC triggered, 3 ms later
+  void model_irqs(TransducerArray *array)
+  {
+    sim::on_gang_trigger([array](uint32_t mask)
+    {
+      for (int i = 0; i < array->size(); i++)
+      {
+        ChirpASIC *asic = array->asic(i);
+        if (mask & asic->gang_bit())
+        {
+          sim::drive_pin(asic->irq_pin(), 0);
+          sim::drive_pin_after(asic->irq_pin(), 1, 3*Timer::MILLISECOND);
+        }
+      }
+    });
+  }
+
+  //AsicBoot from blank flash, then again as after a watchdog reset
+  void bench_boot()
+  {
+    sim::attach_i2c(i2c::external(DEF_ADDR), &asic_devs[0]);
+    sim::attach_i2c(i2c::external(0x30), &asic_devs[1]);
+    sim::attach_i2c(i2c::external(0x40), &asic_devs[2]);
+    asic_devs[1].regs[READY] = 0x02;
+    asic_devs[2].regs[READY] = 0x02;
+    static AsicBoot boot(axis1);
+    const char *names[2] = {"asic boot cold", "asic boot warm"};
+    for (int i = 0; i < 2; i++)
+    {
+      auto a = mark();
+      boot.start();
+      sim::run(10*Timer::SECOND);
+      auto b = mark();
+      report(names[i], a, b, 1, "boots");
+    }
+  }
+
+  //Calibration::startup from blank flash and reusing the record, then a
+  //die temperature step to trigger a background recalibration
+  void bench_calibration()
+  {
+    constexpr uint32_t RATE = 40;
+    static sim::RegisterDevice tmp006;
+    static MeasurementEngine engine(axis1);
+    static Calibration cal(axis1, &engine);
+    sim::attach_i2c(i2c::TMP006, &tmp006);
+    //25 degrees C, MSB first
+    tmp006.regs[1] = (25*32*4) >> 8;
+    tmp006.regs[2] = (25*32*4) & 0xFF;
+    const char *names[2] = {"cal startup fresh", "cal startup reused"};
+    for (int i = 0; i < 2; i++)
+    {
+      auto a = mark();
+      cal.startup()->start();
+      sim::run(10*Timer::SECOND);
+      auto b = mark();
+      report(names[i], a, b, 1, "startups");
+    }
+    printf("%-24s %u ticks measured, %u asked for\n", "cal pulse", cal.get_pulselen(), (unsigned)CAL_PULSE);
+    engine.start(RATE, [&](Shot const &a2b, Shot const &b2a)
+    {
+      cal.observe(a2b);
+      cal.observe(b2a);
+    });
+    cal.start_monitor();
+    sim::run(2*CAL_CHECK_INTERVAL);
+    auto before = engine.get_stats();
+    tmp006.regs[1] = (28*32*4) >> 8;
+    tmp006.regs[2] = (28*32*4) & 0xFF;
+    sim::run(2*CAL_CHECK_INTERVAL);
+    auto after = engine.get_stats();
+    engine.stop();
+    printf("%-24s %u recalibrations, %u of %u slots skipped\n", "cal temperature step",
+      cal.get_stats().temp_triggers, (unsigned)((2*CAL_CHECK_INTERVAL/(Timer::SECOND/RATE)) - (after.shots - before.shots)),
+      (unsigned)(2*CAL_CHECK_INTERVAL/(Timer::SECOND/RATE)));
+  }
+
+  //Steady state MeasurementEngine shots at MAX_RATE, after bench_boot. The
+  //ASICs are modelled as raising IRQ 3 ms after the trigger.
+  void bench_shots(const char *name, MeasurementEngine::Completion mode)
+  {
+    model_irqs(axis1);
+    MeasurementEngine engine(axis1);
+    engine.set_completion(mode);
+    int pairs = 0;
+    engine.start(MAX_RATE, [&](Shot const &, Shot const &)
+    {
+      pairs++;
+    });
+    sim::run(Timer::SECOND);
+    auto a = mark();
+    uint32_t shots = engine.get_stats().shots;
+    tq::clear_stats();
+    sim::run(10*Timer::SECOND);
+    auto b = mark();
+    tq::Stats sched = tq::stats;
+    shots = engine.get_stats().shots - shots;
+    engine.stop();
+    sim::run(Timer::SECOND);
+    sim::on_gang_trigger(nullptr);
+    report(name, a, b, shots, "shots");
+    auto const &st = engine.get_stats();
+    printf("%-24s trigger pulse max %u ticks, %u asked for\n", "", st.max_pulse, (unsigned)TRIGGER_PULSE);
+    if (st.irqs)
+    {
+      printf("%-24s %u irqs, %u timeouts, latency %.2f/%.2f/%.2f ms min/mean/max\n", "",
+        st.irqs, st.irq_timeouts, (double)st.min_latency/Timer::MILLISECOND,
+        (double)st.total_latency/st.irqs/Timer::MILLISECOND, (double)st.max_latency/Timer::MILLISECOND);
+    }
+    uint32_t under = sched.latency[0] + sched.latency[1] + sched.latency[2];
+    printf("%-24s %.1f tasks/shot, busy %.2f%%, max depth %u, longest task %u ticks, "
+      "dispatch %.0f%% under 4 ticks, max %u\n", "", (double)sched.ran / shots,
+      100.0 * sched.busy / (sched.busy + sched.idle), sched.max_depth, (unsigned)sched.max_run,
+      100.0 * under / sched.ran, (unsigned)sched.max_latency);
+  }
+
+  /**
+   * Retunes a running engine over UDP, after bench_boot, and checks the
+   * changes land without a slot being missed. The ASICs raise IRQ 3 ms
+   * after the trigger, so readout delay here only bounds the timeout.
+   */
+  void bench_tuning()
+  {
+    model_irqs(axis1);
+    MeasurementEngine engine(axis1);
+    engine.set_completion(MeasurementEngine::IRQ);
+    Tuning tuning(&engine);
+    tuning.open(4412);
+    uint32_t pair_rate = 0;
+    tuning.on_rate([&](uint32_t r) { pair_rate = r / axis1->npaths(); });
+    uint8_t reply[TUNE_MAX_REPLY];
+    size_t reply_len = 0;
+    sim::on_udp_send([&](const char *, uint16_t, const uint8_t *payload, size_t length)
+    {
+      if (length > sizeof(reply))
+      {
+        printf("tuning reply of %u bytes is over TUNE_MAX_REPLY\n", (unsigned)length);
+        reply_len = 0;
+        return;
+      }
+      memcpy(reply, payload, length);
+      reply_len = length;
+    });
+    engine.start(20, [](Shot const &, Shot const &) {});
+    sim::run(Timer::SECOND);
+    const uint8_t src[16] = {0xfe, 0x80};
+    uint8_t req[1 + 5*5] = {TUNE_SET};
+    const int32_t want[5][2] = {{TUNE_RATE, 50}, {TUNE_RANGE, 0x20}, {TUNE_READOUT_US, 8000},
+                                {TUNE_COUNT_TX, -3}, {TUNE_PULSE_TICKS, 6}};
+    for (int i = 0; i < 5; i++)
+    {
+      req[1 + 5*i] = want[i][0];
+      memcpy(&req[2 + 5*i], &want[i][1], 4);
+    }
+    auto before = engine.get_stats();
+    auto a = mark();
+    sim::deliver_udp(4412, req, sizeof(req), src, 4000);
+    auto b = mark();
+    report("tuning set", a, b, 1, "requests");
+    sim::run(Timer::SECOND);
+    auto after = engine.get_stats();
+    int32_t count_tx;
+    memcpy(&count_tx, &reply[3 + 5*3], 4);
+    //Register writes are address, length, value
+    printf("%-24s reply %u bytes status %u, range %02x/%02x, pulse max %u, count_tx %d, %u pairs/s\n", "",
+      (unsigned)reply_len, reply[1], asic_devs[1].regs[MAX_RANGE + 1], asic_devs[2].regs[MAX_RANGE + 1],
+      after.max_pulse, (int)count_tx, (unsigned)pair_rate);
+    printf("%-24s %u shots in the second after, overruns %u, bus errors %u\n", "",
+      after.shots - before.shots, after.overruns - before.overruns, after.bus_errors - before.bus_errors);
+    const uint8_t bad[6] = {TUNE_SET, TUNE_RATE, 0xE8, 0x03, 0, 0};
+    sim::deliver_udp(4412, bad, sizeof(bad), src, 4000);
+    printf("%-24s rate 1000 refused with status %u, rate still %u\n", "", reply[1], (unsigned)engine.get_rate());
+    const uint8_t sched[2] = {TUNE_SCHED, 1};
+    sim::deliver_udp(4412, sched, sizeof(sched), src, 4000);
+    int32_t ran, busy, window;
+    memcpy(&ran, &reply[2], 4);
+    memcpy(&busy, &reply[2 + 4*5], 4);
+    memcpy(&window, &reply[2 + 4*6], 4);
+    printf("%-24s sched reply %u bytes: %d tasks, busy %d permil over %d ms, cleared to %u\n", "",
+      (unsigned)reply_len, (int)ran, (int)busy, (int)window, (unsigned)tq::stats.ran);
+    //Overloaded with a readout delay of five slots, then relieved by a
+    //lower rate over the port, which should apply from the next slot
+    engine.set_completion(MeasurementEngine::FIXED_DELAY);
+    engine.set_readout_delay(100*Timer::MILLISECOND);
+    sim::run(Timer::SECOND);
+    uint32_t overloaded = engine.get_stats().overruns;
+    const uint8_t slower[6] = {TUNE_SET, TUNE_RATE, 5, 0, 0, 0};
+    sim::deliver_udp(4412, slower, sizeof(slower), src, 4000);
+    sim::run(Timer::SECOND);
+    uint32_t relieved = engine.get_stats().overruns;
+    sim::run(Timer::SECOND);
+    printf("%-24s overloaded %u overruns/s, rate 5 status %u, then %u and %u overruns/s\n", "",
+      overloaded - after.overruns, reply[1], relieved - overloaded, engine.get_stats().overruns - relieved);
+    engine.stop();
+    sim::run(Timer::SECOND);
+    sim::on_gang_trigger(nullptr);
+    sim::on_udp_send(nullptr);
+    set_count_tx(COUNT_TX);
+  }
+
+#ifdef STORM_TRACE
+  /**
+   * The cost of an event, then the ring read back over the tuning port while
+   * the engine runs, as tracetool -u does. main() dumps the ring at the end
+   * for './bench_trace | ./tracetool'.
+   */
+  void bench_trace()
+  {
+    constexpr int N = 100000;
+    auto a = mark();
+    for (int i = 0; i < N; i++)
+    {
+      TRACE(trace::USER, i, i);
+    }
+    auto b = mark();
+    report("trace emit", a, b, N, "events");
+    model_irqs(axis1);
+    MeasurementEngine engine(axis1);
+    engine.set_completion(MeasurementEngine::IRQ);
+    Tuning tuning(&engine);
+    //bench_tuning's socket stays bound to 4412
+    tuning.open(4413);
+    uint8_t reply[TUNE_MAX_REPLY];
+    size_t reply_len = 0;
+    sim::on_udp_send([&](const char *, uint16_t, const uint8_t *payload, size_t length)
+    {
+      memcpy(reply, payload, length);
+      reply_len = length;
+    });
+    engine.start(MAX_RATE, [](Shot const &, Shot const &) {});
+    const uint8_t src[16] = {0xfe, 0x80};
+    uint32_t from = trace::count();
+    uint32_t fetched = 0, lost = 0, requests = 0, gangs = 0;
+    for (int i = 0; i < 100; i++)
+    {
+      sim::run(Timer::SECOND / 100);
+      while (1)
+      {
+        uint8_t req[5] = {TUNE_TRACE};
+        memcpy(&req[1], &from, 4);
+        sim::deliver_udp(4413, req, sizeof(req), src, 4000);
+        requests++;
+        uint32_t first;
+        memcpy(&first, &reply[2], 4);
+        uint8_t n = reply[6];
+        if (reply_len < 7 || n == 0)
+        {
+          break;
+        }
+        lost += first - from;
+        fetched += n;
+        for (int k = 0; k < n; k++)
+        {
+          gangs += reply[7 + 8*k + 4] == trace::GANG;
+        }
+        from = first + n;
+      }
+    }
+    engine.stop();
+    sim::run(Timer::SECOND);
+    sim::on_gang_trigger(nullptr);
+    sim::on_udp_send(nullptr);
+    printf("%-24s %u events in %u requests, %u lost, %u triggers of %u shots\n", "trace over udp",
+      fetched, requests, lost, gangs, engine.get_stats().shots);
+  }
+#endif
+
+  /**
+   * A 3D head: three axes 120 degrees apart in azimuth at 45 degrees of
+   * elevation, 150 mm face to face, as six ASICs. Checks the solver against
+   * exact times of flight for a known wind, then runs the schedule at
+   * MAX_RATE with IRQ completion.
+   */
+  void bench_array3d()
+  {
+    static const int16_t pos[3][3] = {{53, 0, 53}, {-27, 46, 53}, {-27, -46, 53}};
+    static const gpio::Pin pins[6][3] = {
+      {gpio::D2, gpio::A0, gpio::D6}, {gpio::D3, gpio::A1, gpio::D7},
+      {gpio::D4, gpio::D9, gpio::D8}, {gpio::D5, gpio::D10, gpio::D13},
+      {gpio::A2, gpio::D11, gpio::A4}, {gpio::A3, gpio::D12, gpio::GP0}};
+    static sim::RegisterDevice devs[6];
+    static TransducerArray array;
+    for (int i = 0; i < 6; i++)
+    {
+      uint8_t addr = 0x50 + 2*i;
+      auto asic = new ChirpASIC(pins[i][0], pins[i][1], pins[i][2]);
+      asic->set_addr(addr);
+      sim::attach_i2c(i2c::external(addr), &devs[i]);
+      int16_t sign = (i & 1) ? 1 : -1;
+      array.add(asic, addr, sign*pos[i/2][0], sign*pos[i/2][1], sign*pos[i/2][2]);
+    }
+    for (int k = 0; k < 3; k++)
+    {
+      array.add_axis(2*k, 2*k + 1);
+    }
+    array.finalize();
+    //The same transducers with every axis pointing the other way, so each
+    //unit vector has the opposite signs
+    static TransducerArray reversed;
+    for (int i = 0; i < 6; i++)
+    {
+      int16_t sign = (i & 1) ? 1 : -1;
+      reversed.add(array.asic(i), 0x50 + 2*i, sign*pos[i/2][0], sign*pos[i/2][1], sign*pos[i/2][2]);
+    }
+    for (int k = 0; k < 3; k++)
+    {
+      reversed.add_axis(2*k + 1, 2*k);
+    }
+    reversed.finalize();
+    printf("%-24s %dD, schedule", "array 3d", array.dims());
+    for (int i = 0; i < array.npaths(); i++)
+    {
+      auto const &p = array.path(i);
+      printf(" %d>%d", array.tx(p.axis, p.dir), array.rx(p.axis, p.dir));
+    }
+    printf("\n");
+
+    //Exact times of flight at 343 m/s for this wind, in mm/s
+    const double wind[3] = {3000, -1500, 500};
+    int32_t along[MAX_AXES];
+    auto exact = [&](TransducerArray const &arr)
+    {
+      for (int k = 0; k < arr.naxes(); k++)
+      {
+        auto const &ax = arr.axis(k);
+        double v = 0;
+        for (int i = 0; i < 3; i++)
+        {
+          v += wind[i] * ax.unit[i] / (1 << UNIT_Q);
+        }
+        int32_t fwd = (int32_t)(ax.length / (343000.0 + v) * 1e9);
+        int32_t rev = (int32_t)(ax.length / (343000.0 - v) * 1e9);
+        along[k] = TransducerArray::along(ax.length, fwd, rev);
+      }
+    };
+    exact(array);
+    constexpr int N = 200000;
+    int32_t solved[3];
+    int32_t sink = 0;
+    auto a = mark();
+    for (int i = 0; i < N; i++)
+    {
+      array.solve(along, solved);
+      sink += solved[0];
+    }
+    auto b = mark();
+    report("array 3d solve", a, b, N, "solves");
+    printf("%-24s wind %d %d %d mm/s, want %d %d %d%s\n", "", solved[0], solved[1], solved[2],
+      (int)wind[0], (int)wind[1], (int)wind[2], sink ? "" : " ");
+    exact(reversed);
+    reversed.solve(along, solved);
+    auto const &u = reversed.axis(0).unit;
+    printf("%-24s axis 0 unit %d %d %d, wind %d %d %d mm/s\n", "array 3d reversed", u[0], u[1], u[2],
+      solved[0], solved[1], solved[2]);
+
+    model_irqs(&array);
+    MeasurementEngine engine(&array);
+    engine.set_completion(MeasurementEngine::IRQ);
+    uint32_t per_axis[MAX_AXES] = {};
+    engine.start(MAX_RATE, [&](Shot const &fwd, Shot const &)
+    {
+      per_axis[fwd.axis]++;
+    });
+    sim::run(Timer::SECOND);
+    for (int k = 0; k < MAX_AXES; k++)
+    {
+      per_axis[k] = 0;
+    }
+    a = mark();
+    uint32_t shots = engine.get_stats().shots;
+    sim::run(10*Timer::SECOND);
+    b = mark();
+    shots = engine.get_stats().shots - shots;
+    engine.stop();
+    sim::run(Timer::SECOND);
+    sim::on_gang_trigger(nullptr);
+    report("array 3d shots", a, b, shots, "shots");
+    printf("%-24s pairs/s per axis %.1f %.1f %.1f, %u timeouts\n", "",
+      per_axis[0]/10.0, per_axis[1]/10.0, per_axis[2]/10.0, engine.get_stats().irq_timeouts);
+  }
+
+  //The I/Q magnitude loop a byte at a time and with word loads, which on
+  //the target is the SMUAD kernel, then all of get_tof()
+  void bench_magsqr()
+  {
+    constexpr int N = 200000;
+    constexpr int CAPS = 64;
+    static uint8_t caps[CAPS][70];
+    uint32_t seed = 1;
+    for (int c = 0; c < CAPS; c++)
+    {
+      for (int i = 0; i < 70; i++)
+      {
+        seed = seed * 1103515245 + 12345;
+        caps[c][i] = seed >> 16;
+      }
+    }
+    //Both extremes, where Q*Q + I*I is 2^31
+    memset(&caps[0][6], 0, 64);
+    caps[0][7] = caps[0][9] = 0x80;
+    uint32_t a_sq[TOF_BINS], b_sq[TOF_BINS];
+    int mismatches = 0;
+    for (int c = 0; c < CAPS; c++)
+    {
+      uint32_t a_max = iq_magsqr_bytes(&caps[c][6], a_sq, TOF_BINS);
+      uint32_t b_max = iq_magsqr(&caps[c][6], b_sq, TOF_BINS);
+      mismatches += a_max != b_max || memcmp(a_sq, b_sq, sizeof(a_sq)) != 0;
+    }
+    uint32_t sink = 0;
+    auto a = mark();
+    for (int i = 0; i < N; i++)
+    {
+      sink += iq_magsqr_bytes(&caps[i % CAPS][6], a_sq, TOF_BINS);
+    }
+    auto b = mark();
+    report("magsqr bytes", a, b, N, "captures");
+    a = mark();
+    for (int i = 0; i < N; i++)
+    {
+      sink += iq_magsqr(&caps[i % CAPS][6], b_sq, TOF_BINS);
+    }
+    b = mark();
+    report("magsqr packed", a, b, N, "captures");
+    a = mark();
+    for (int i = 0; i < N; i++)
+    {
+      sink += get_tof(caps[i % CAPS], 1000, 15000).magmax;
+    }
+    b = mark();
+    report("get_tof", a, b, N, "captures");
+    printf("%-24s %d of %d captures differ (%u)\n", "", mismatches, CAPS, sink & 1);
+  }
+
+#ifdef TOF_REFERENCE
+  /**
+   * get_tof() against the double precision get_tof_reference() on random
+   * and extreme captures, over several calres, pulselen and TX offsets.
+   * Prints a FAIL line and returns false if a result is outside the bounds
+   * tof.h states for it.
+   */
+  bool bench_tof_reference()
+  {
+    constexpr int RANDOM = 20000;
+    const uint32_t params[][2] = {{1, 15000}, {1000, 15000}, {7, 37500}, {3, 375}, {65535, 65535}};
+    const int8_t offsets[2] = {COUNT_TX, -1};
+    static uint8_t raw[70];
+    uint32_t seed = 7;
+    int compared = 0, failures = 0;
+    double count_worst = 0, freq_worst = 0, tof_worst = 0;
+    for (int8_t tx : offsets)
+    {
+      set_count_tx(tx);
+      for (auto const &pr : params)
+      {
+        for (int c = 0; c < RANDOM + TOF_BINS*4; c++)
+        {
+          for (int i = 0; i < 70; i++)
+          {
+            seed = seed * 1103515245 + 12345;
+            raw[i] = seed >> 16;
+          }
+          //Carriers above 25 kHz for all the parameters
+          uint16_t sf = 8192 + (seed >> 4) % 57344;
+          raw[0] = sf & 0xFF;
+          raw[1] = sf >> 8;
+          if (c >= RANDOM)
+          {
+            //The extremes: full scale from bin k on, and below it a level
+            //either just under a quarter of the power, tiny or zero
+            int k = (c - RANDOM) / 4;
+            int16_t low[4] = {0x3FFF, 1, 0, -0x4000};
+            for (int i = 0; i < TOF_BINS; i++)
+            {
+              int16_t v = i >= k ? -0x8000 : low[(c - RANDOM) % 4];
+              memcpy(&raw[6 + 4*i], &v, 2);
+              memcpy(&raw[8 + 4*i], &v, 2);
+            }
+          }
+          TOFResult a = get_tof(raw, pr[0], pr[1]);
+          if (!a.valid)
+          {
+            continue;
+          }
+          TOFResult b = get_tof_reference(raw, pr[0], pr[1]);
+          compared++;
+          double freq = sf/2048.0*pr[0]/((double)pr[1]/TICKS_PER_MS);
+          double dcount = fabs((double)a.count_q16 - b.count_q16);
+          double dfreq = fabs((double)a.freq_milli - b.freq_milli);
+          double bound = 1 + (dcount + 1) / 65536 * 8 / freq * 1000;
+          double dtof = fabs((double)a.tof_ns - b.tof_ns);
+          count_worst = dcount > count_worst ? dcount : count_worst;
+          freq_worst = dfreq > freq_worst ? dfreq : freq_worst;
+          tof_worst = dtof / bound > tof_worst ? dtof / bound : tof_worst;
+          if (dcount > 16 || dfreq > 1 || dtof > bound)
+          {
+            if (failures++ < 10)
+            {
+              printf("FAIL tof reference: tof_sf %u calres %u pulselen %u count_tx %d: count_q16 %d vs %d,"
+                " freq_milli %u vs %u, tof_ns %d vs %d\n", sf, pr[0], pr[1], tx, (int)a.count_q16, (int)b.count_q16,
+                a.freq_milli, b.freq_milli, (int)a.tof_ns, (int)b.tof_ns);
+            }
+          }
+        }
+      }
+    }
+    set_count_tx(COUNT_TX);
+    printf("%-24s %d captures: count_q16 within %.0f LSB, freq_milli %.0f, tof_ns %.2f of its bound, %d %s\n",
+      "tof reference", compared, count_worst, freq_worst, tof_worst, failures, failures ? "FAILED" : "failed");
+    return failures == 0;
+  }
+#endif
+
+  /**
+   * A synthetic capture: a carrier at tof_sf/81.92 kHz arriving tof_us
+   * after the burst, with an envelope that peaks three bins later,
+   * demodulated to (Q, I) per bin with Gaussian noise of the given rms.
+   */
+  void synth_capture(uint8_t *raw, double tof_us, double noise, std::mt19937 &rng, uint16_t tof_sf = 7*2048)
+  {
+    //tof_sf/2048*calres/(pulselen/375) MHz with calres 1 and pulselen 15000,
+    //7*1/40 by default
+    const double f = tof_sf / 81920.0;
+    std::normal_distribution<double> n(0, noise);
+    memset(raw, 0, 70);
+    raw[0] = tof_sf & 0xFF;
+    raw[1] = tof_sf >> 8;
+    for (int i = 0; i < TOF_BINS; i++)
+    {
+      double u = (i + COUNT_TX) * 8 / f - tof_us;
+      double bin = 8 / f;
+      double x = u / (3*bin);
+      double a = u < 0 ? 0 : x * x * exp(2 * (1 - x));
+      double phase = -2 * M_PI * f * tof_us;
+      int16_t q = (int16_t)lrint(20000 * a * sin(phase) + n(rng));
+      int16_t in = (int16_t)lrint(20000 * a * cos(phase) + n(rng));
+      memcpy(&raw[6 + 4*i], &q, 2);
+      memcpy(&raw[8 + 4*i], &in, 2);
+    }
+  }
+
+  //t_rev - t_fwd on synthetic pairs from the envelope crossings, the
+  //envelope cross-correlation, and the carrier phase. The second carrier,
+  //175.9 kHz, is not a whole number of kHz.
+  void bench_phase()
+  {
+    constexpr int N = 20000;
+    const double noise[3] = {0, 100, 400};
+    const uint16_t carriers[2] = {7*2048, 14410};
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> tof(200, 280);
+    std::uniform_real_distribution<double> dt(-6, 6);
+    static uint8_t fwd[70], rev[70];
+    for (uint16_t sf : carriers)
+    for (double rms : noise)
+    {
+      double env_sq = 0, xcorr_sq = 0, phase_sq = 0;
+      int invalid = 0;
+      for (int i = 0; i < N; i++)
+      {
+        double t = tof(rng);
+        double d = dt(rng);
+        synth_capture(fwd, t, rms, rng, sf);
+        synth_capture(rev, t + d, rms, rng, sf);
+        TOFResult f = get_tof(fwd, 1, 15000);
+        TOFResult r = get_tof(rev, 1, 15000);
+        PhaseTOF p = get_phase_tof(f, r);
+        XcorrTOF x = get_xcorr_tof(f, r);
+        if (!p.valid || !x.valid)
+        {
+          invalid++;
+          continue;
+        }
+        env_sq += pow(p.dt_env_ps - d*1e6, 2);
+        xcorr_sq += pow(x.dt_ps - d*1e6, 2);
+        phase_sq += pow(p.dt_ps - d*1e6, 2);
+      }
+      //The same with the wind along the axis wandering slowly, through a
+      //PhaseTracker
+      PhaseTracker tracker;
+      double track_sq = 0;
+      double d = 0;
+      for (int i = 0; i < N; i++)
+      {
+        double t = tof(rng);
+        d += dt(rng) / 100;
+        d = d > 6 ? 6 : d < -6 ? -6 : d;
+        synth_capture(fwd, t, rms, rng, sf);
+        synth_capture(rev, t + d, rms, rng, sf);
+        PhaseTOF p = tracker.update(get_tof(fwd, 1, 15000), get_tof(rev, 1, 15000));
+        if (p.valid)
+        {
+          track_sq += pow(p.dt_ps - d*1e6, 2);
+        }
+      }
+      int n = N - invalid;
+      char name[32];
+      snprintf(name, sizeof(name), "pair dt %.1f kHz", sf / 81.92);
+      printf("%-24s noise %3.0f: dt rms error envelope %7.0f ps, xcorr %7.0f ps, phase %7.0f ps, tracked %5.0f ps,"
+        " %d invalid\n", name, rms, sqrt(env_sq/n), sqrt(xcorr_sq/n), sqrt(phase_sq/n), sqrt(track_sq/n), invalid);
+    }
+    //xcorr turns its lag into time with the bin length, which has to be
+    //the exact one, not 8 cycles of the carrier in whole kHz
+    for (uint16_t sf : carriers)
+    {
+      double bin_ps = 8e6 * 81920.0 / sf;
+      double worst = 0;
+      for (int i = 0; i < 1000; i++)
+      {
+        double t = tof(rng);
+        synth_capture(fwd, t, 0, rng, sf);
+        synth_capture(rev, t + dt(rng), 0, rng, sf);
+        XcorrTOF x = get_xcorr_tof(get_tof(fwd, 1, 15000), get_tof(rev, 1, 15000));
+        double err = fabs(x.dt_ps - x.lag_q16 / 65536.0 * bin_ps);
+        worst = err > worst ? err : worst;
+      }
+      char name[32];
+      snprintf(name, sizeof(name), "xcorr %.1f kHz", sf / 81.92);
+      printf("%-24s lag to dt scale error at most %.0f ps\n", name, worst);
+    }
+    uint8_t a_raw[70], b_raw[70];
+    synth_capture(a_raw, 437, 0, rng);
+    synth_capture(b_raw, 438, 0, rng);
+    TOFResult a_tof = get_tof(a_raw, 1, 15000);
+    TOFResult b_tof = get_tof(b_raw, 1, 15000);
+    uint32_t sink = 0;
+    auto a = mark();
+    for (int i = 0; i < N*10; i++)
+    {
+      sink += get_phase_tof(a_tof, b_tof).dt_ps;
+    }
+    auto b = mark();
+    report("phase tof", a, b, N*10, "pairs");
+    a = mark();
+    for (int i = 0; i < N*10; i++)
+    {
+      sink += get_xcorr_tof(a_tof, b_tof).dt_ps;
+    }
+    b = mark();
+    report("xcorr tof", a, b, N*10, "pairs");
+    printf("%-24s %s\n", "", sink ? "" : " ");
+  }
+
+  /**
+   * The wind output stage on synthetic pairs from an 85 mm axis, short
+   * enough for the pulse to arrive inside the capture window. The B->A
+   * direction has a fixed extra delay that zero() should find and take out.
+   */
+  void bench_wind()
+  {
+    constexpr double L = 85;
+    constexpr double C = 343000;
+    constexpr double OFFSET_US = 0.4;
+    static TransducerArray array;
+    array.add(asicA, 0x30, 0, 0, 0);
+    array.add(asicB, 0x40, L, 0, 0);
+    array.add_axis(0, 1);
+    array.finalize();
+    static MeasurementEngine engine(&array);
+    static Calibration cal(&array, &engine);
+    WindOutput out(&array, &cal);
+    std::mt19937 rng(2);
+    std::normal_distribution<double> step(0, 20);
+    static uint8_t fwd[70], rev[70];
+    auto pair = [&](double v, double noise)
+    {
+      synth_capture(fwd, L / (C + v) * 1e6, noise, rng);
+      synth_capture(rev, L / (C - v) * 1e6 + OFFSET_US, noise, rng);
+      return out.process(0, get_tof(fwd, 1, 15000), get_tof(rev, 1, 15000));
+    };
+    const double temp_c = C * C / 1e6 / SONIC_K - KELVIN_MC / 1000.0;
+    out.zero((int32_t)(temp_c * 1000));
+    for (int i = 0; i < ZERO_PAIRS; i++)
+    {
+      pair(0, 100);
+    }
+    printf("%-24s %d ps, want %d ps, delay %d ns\n", "wind zero offset", (int)cal.zero_ps(0),
+      (int)(OFFSET_US * 1e6), (int)cal.delay_ns(0));
+    constexpr int N = 20000;
+    const double noise[2] = {0, 100};
+    for (double rms : noise)
+    {
+      double v = 0, wind_sq = 0, temp_sq = 0;
+      int invalid = 0;
+      for (int i = 0; i < N; i++)
+      {
+        v += step(rng);
+        v = v > 5000 ? 5000 : v < -5000 ? -5000 : v;
+        WindSample w = pair(v, rms);
+        if (!w.valid || !w.phase)
+        {
+          invalid++;
+          continue;
+        }
+        wind_sq += pow(w.wind_mm_s - v, 2);
+        temp_sq += pow(w.temp_mc / 1000.0 - temp_c, 2);
+      }
+      int n = N - invalid;
+      printf("%-24s noise %3.0f: rms error %.1f mm/s, temperature %.3f C, %d not phase refined\n",
+        "wind pair", rms, sqrt(wind_sq/n), sqrt(temp_sq/n), invalid);
+    }
+    TOFResult a_tof = get_tof(fwd, 1, 15000);
+    TOFResult b_tof = get_tof(rev, 1, 15000);
+    int32_t sink = 0;
+    auto a = mark();
+    for (int i = 0; i < N*10; i++)
+    {
+      sink += out.process(0, a_tof, b_tof).wind_mm_s;
+    }
+    auto b = mark();
+    report("wind pair", a, b, N*10, "pairs");
+    printf("%-24s %d bytes per pair, %d as raw captures%s\n", "wind record", (int)frame::WIND_LEN,
+      (int)(2*frame::CAPTURE_LEN), sink ? "" : " ");
+  }
+
+  //Windowed statistics on a gusty synthetic series at 20 samples/s against
+  //the same in double precision
+  void bench_stats()
+  {
+    constexpr uint16_t RATE = 20;
+    constexpr int GUST = 3*RATE;
+    const uint16_t windows[STATS_WINDOWS] = {1, 10, 60};
+    WindStats ws;
+    ws.configure(RATE, windows, GUST);
+    std::mt19937 rng(3);
+    std::normal_distribution<double> turb(0, 800);
+    constexpr int N = 60*RATE;
+    static int32_t series[N];
+    for (int i = 0; i < N; i++)
+    {
+      //4 m/s with a 10 s gust to 9 m/s in the middle
+      double gust = i > N/2 && i < N/2 + 10*RATE ? 5000 : 0;
+      series[i] = (int32_t)lrint(4000 + gust + turb(rng));
+    }
+    WindStats::Summary sums[STATS_WINDOWS];
+    uint32_t closed = 0;
+    for (int i = 0; i < N; i++)
+    {
+      closed = ws.add(series[i], 20000, sums);
+    }
+    double mean = 0, sq = 0, gust = -1e9, run = 0;
+    for (int i = 0; i < N; i++)
+    {
+      mean += series[i];
+      run += series[i] - (i >= GUST ? series[i - GUST] : 0);
+      gust = std::max(gust, run / std::min(i + 1, GUST));
+    }
+    mean /= N;
+    for (int i = 0; i < N; i++)
+    {
+      sq += pow(series[i] - mean, 2);
+    }
+    double sd = sqrt(sq / (N - 1));
+    WindStats::Summary const &m = sums[2];
+    printf("%-24s 1 min: mean %d std %u gust %d mm/s ti %u, want %.0f %.0f %.0f %.0f (%s)\n", "wind stats",
+      (int)m.mean_mm_s, (unsigned)m.std_mm_s, (int)m.gust_mm_s, (unsigned)m.ti_permil, mean, sd, gust,
+      sd / mean * 1000, closed == 7 ? "all closed" : "not closed");
+    int32_t sink = 0;
+    auto a = mark();
+    for (int r = 0; r < 100; r++)
+    {
+      for (int i = 0; i < N; i++)
+      {
+        sink += ws.add(series[i], 20000, sums);
+      }
+    }
+    auto b = mark();
+    report("wind stats add", a, b, 100*N, "samples");
+    printf("%-24s %d bytes per axis-minute, %d as wind records%s\n", "stats records",
+      (int)((60 + 6 + 1) * frame::STATS_LEN), (int)(N * frame::WIND_LEN), sink ? "" : " ");
+  }
+
+  //Wind records at 20 pairs/s through the UDP publisher, then a record a
+  //second so only the deadline sends them. Every packet is decoded back.
+  void bench_telemetry()
+  {
+    static Telemetry tel;
+    frame::Decoder dec;
+    uint32_t bytes = 0, decoded = 0, datagrams = 0;
+    sim::on_udp_send([&](const char *, uint16_t, const uint8_t *payload, size_t length)
+    {
+      datagrams++;
+      bytes += length;
+      for (size_t i = 0; i < length; i++)
+      {
+        decoded += dec.feed(payload[i]);
+      }
+    });
+    tel.open(4411, "ff02::1", 4410);
+    constexpr int N = 2000;
+    auto a = mark();
+    for (int i = 0; i < N; i++)
+    {
+      tel.publish_wind(sim::now(), 0, 1234, 20000);
+      sim::run(Timer::SECOND / 20);
+    }
+    auto b = mark();
+    report("telemetry 20/s", a, b, N, "records");
+    Telemetry::Stats s = tel.get_stats();
+    printf("%-24s %u packets, %.2f records/packet, %u bytes, %u of %d decoded, %u failed\n", "",
+      (unsigned)s.packets, (double)s.records / s.packets, (unsigned)bytes, (unsigned)decoded, N,
+      (unsigned)s.failed);
+    for (int i = 0; i < 20; i++)
+    {
+      tel.publish_wind(sim::now(), 0, 1234, 20000);
+      sim::run(2*Timer::SECOND);
+    }
+    Telemetry::Stats s2 = tel.get_stats();
+    printf("%-24s %u packets for 20 slow records, %u on the deadline, %u datagrams in all\n", "telemetry 0.5/s",
+      (unsigned)(s2.packets - s.packets), (unsigned)(s2.deadline_flushes - s.deadline_flushes), (unsigned)datagrams);
+    sim::on_udp_send(nullptr);
+  }
+
+  /**
+   * The decoder on a damaged stream: text, a header claiming 40 bytes with
+   * two good frames inside it, and a frame cut short at the end. Both good
+   * frames should come out, and every other byte be passed through, the
+   * cut frame only once flush() is called. Returns false, with a FAIL
+   * line, otherwise.
+   */
+  bool bench_decoder()
+  {
+    struct Collect : frame::Decoder
+    {
+      std::vector<uint8_t> passed;
+      void passthrough(const uint8_t *data, size_t length) override
+      {
+        passed.insert(passed.end(), data, data + length);
+      }
+    };
+    uint8_t f1[frame::WIND_LEN], f2[frame::WIND_LEN], f3[frame::WIND_LEN];
+    frame::encode_wind(f1, 1, 1000, 0, 1234, 20000);
+    frame::encode_wind(f2, 2, 2000, 0, -1234, 20000);
+    frame::encode_wind(f3, 3, 3000, 0, 500, 20000);
+    const uint8_t text[] = {'b', 'o', 'o', 't', '\n'};
+    const uint8_t bad[] = {frame::SYNC0, frame::SYNC1, 40, 1, 2};
+    std::vector<uint8_t> in(text, text + sizeof(text));
+    in.insert(in.end(), bad, bad + sizeof(bad));
+    in.insert(in.end(), f1, f1 + sizeof(f1));
+    in.insert(in.end(), f2, f2 + sizeof(f2));
+    in.insert(in.end(), f3, f3 + sizeof(f3) - 3);
+    Collect dec;
+    //The sequence numbers decoded, as digits in order
+    uint32_t seqs = 0;
+    auto take = [&]
+    {
+      frame::Wind w;
+      if (frame::decode_wind(dec.body(), dec.body_length(), w))
+      {
+        seqs = seqs * 10 + w.seq;
+      }
+    };
+    for (uint8_t b : in)
+    {
+      if (dec.feed(b))
+      {
+        take();
+      }
+    }
+    size_t before_flush = dec.passed.size();
+    while (dec.flush())
+    {
+      take();
+    }
+    std::vector<uint8_t> want(text, text + sizeof(text));
+    want.insert(want.end(), bad, bad + sizeof(bad));
+    want.insert(want.end(), f3, f3 + sizeof(f3) - 3);
+    bool ok = seqs == 12 && dec.crc_errors == 1 && dec.passed == want && dec.skipped == want.size() &&
+      dec.passed.size() - before_flush == sizeof(f3) - 3;
+    printf("%s%-24s frames %u, %u CRC errors, %u bytes passed through, %u of them at flush\n",
+      ok ? "" : "FAIL ", "decoder damaged stream", (unsigned)seqs, dec.crc_errors, dec.skipped,
+      (unsigned)(dec.passed.size() - before_flush));
+    return ok;
+  }
+
+  //Receiving datagrams as copied Packets against PacketViews, with and
+  //without keeping a pooled copy of each
+  void bench_udp_recv()
+  {
+    constexpr int N = 100000;
+    const uint8_t src[16] = {0xfe, 0x80};
+    uint8_t payload[40] = {1, 2, 3};
+    uint32_t sink = 0;
+    buf_t kept;
+    auto copied = UDPSocket::open(5001, [&](std::shared_ptr<UDPSocket::Packet> p)
+    {
+      sink += p->payload[0] + p->port;
+    });
+    auto viewed = UDPSocket::open_view(5002, [&](UDPSocket::PacketView const &v)
+    {
+      sink += v.payload[0] + v.port;
+    });
+    auto kept_view = UDPSocket::open_view(5003, [&](UDPSocket::PacketView const &v)
+    {
+      kept = v.copy();
+      sink += kept ? (*kept)[0] : 0;
+    });
+    const char *names[3] = {"udp recv packet", "udp recv view", "udp recv view+copy"};
+    for (int s = 0; s < 3; s++)
+    {
+      auto a = mark();
+      for (int i = 0; i < N; i++)
+      {
+        sim::deliver_udp(5001 + s, payload, sizeof(payload), src, 4000);
+      }
+      auto b = mark();
+      report(names[s], a, b, N, "datagrams");
+    }
+    printf("%-24s %s\n", "", sink ? "" : " ");
+    kept.reset();
+    copied->close();
+    viewed->close();
+    kept_view->close();
+  }
+
+  //Two clients contending for the i2c lock with single register writes
+  void bench_i2c_contention()
+  {
+    constexpr int N = 20000;
+    constexpr uint16_t ADDRS[2] = {i2c::external(0x30), i2c::external(0x40)};
+    static sim::RegisterDevice devs[2];
+    int count = 0;
+    std::function<void(int)> next = [&](int who)
+    {
+      i2c::lock.acquire([&, who]
+      {
+        i2c::write(ADDRS[who], i2c::START | i2c::STOP, mkbuf({0x01, 0x01, 0x10}), 3, [&, who](int status, buf_t)
+        {
+          i2c::lock.release();
+          if (++count < N)
+          {
+            next(who);
+          }
+        });
+      });
+    };
+    sim::attach_i2c(ADDRS[0], &devs[0]);
+    sim::attach_i2c(ADDRS[1], &devs[1]);
+    auto a = mark();
+    next(0);
+    next(1);
+    sim::run((uint64_t)N*Timer::SECOND);
+    auto b = mark();
+    report("i2c contended write", a, b, count, "writes");
+  }
+}
+
+int main()
+{
+  printf("libstorm host benchmark (simulated kernel, %u ticks/ms)\n", Timer::MILLISECOND);
+  bench_tq();
+  bench_timer_periodic();
+  bench_timer_once();
+  bench_i2c_reg_read();
+  bench_i2c_txn("i2c txn 70B read", false);
+  bench_i2c_txn("i2c txn read+arm", true);
+  bench_i2c_contention();
+  bench_magsqr();
+#ifdef TOF_REFERENCE
+  bool ok = bench_tof_reference();
+#else
+  bool ok = true;
+#endif
+  bench_phase();
+  bench_wind();
+  bench_stats();
+  bench_telemetry();
+  ok = bench_decoder() && ok;
+  bench_udp_recv();
+  bench_boot();
+  bench_calibration();
+  bench_shots("shots fixed delay", MeasurementEngine::FIXED_DELAY);
+  bench_shots("shots irq completion", MeasurementEngine::IRQ);
+  bench_tuning();
+  bench_array3d();
+#ifdef STORM_TRACE
+  bench_trace();
+#endif
+  bufpool::report();
+#ifdef STORM_TRACE
+  trace::dump();
+#endif
+  return ok ? 0 : 1;
+}
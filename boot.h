@@ -0,0 +1,161 @@
+#ifndef __BOOT_H__
+#define __BOOT_H__
+
+#include "libstorm.h"
+#include "asic.h"
+#include "array.h"
+#include "frame.h"
+
+using namespace storm;
+
+//Flash location of the boot record
+#define BOOTREC_ADDR 0xF0000
+#define BOOTREC_LEN (7 + MAX_TRANSDUCERS)
+#define BOOTREC_MAGIC 0xB008
+//From the end of programming until READY is valid
+#define READY_DELAY (60*Timer::MILLISECOND)
+
+/**
+ * Brings every ASIC in the array up at its operational address, reusing
+ * firmware that survived a reset of ours where it can.
+ *
+ * The boot record in flash holds the CRC of the firmware image last
+ * uploaded and the addresses it went to. An ASIC counts as warm if the
+ * record matches this build's image and the ASIC reports READY at its
+ * address. Anything else is reprogrammed: the cold ASICs are held in reset
+ * together so their reset delays overlap, then uploaded one at a time, as
+ * they all answer on DEF_ADDR until moved. The result is an i2c status.
+ *
+ * Boot record, little endian:
+ *    0   2  BOOTREC_MAGIC
+ *    2   2  CRC16 of wind_v8_rawbin
+ *    4   1  number of transducers
+ *    5   n  address of each transducer, MAX_TRANSDUCERS of them
+ *  5+n   2  CRC16 of the bytes before it
+ */
+class AsicBoot : public co::Routine
+{
+public:
+  AsicBoot(TransducerArray *array)
+    : array(array), warm{}
+  {
+  }
+  //Whether ASIC i was reused without reprogramming on the last run
+  bool was_warm(int i) const
+  {
+    return warm[i];
+  }
+protected:
+  bool body() override
+  {
+    CO_BEGIN
+    CO_AWAIT(flash_read(BOOTREC_ADDR, mkbuf(BOOTREC_LEN), BOOTREC_LEN));
+    record_ok = status == i2c::OK && record_matches(io);
+    nwarm = 0;
+    for (i = 0; i < array->size(); i++)
+    {
+      warm[i] = false;
+      if (record_ok)
+      {
+        array->asic(i)->set_addr(array->addr(i));
+        CO_AWAIT(probe(i));
+        warm[i] = ready();
+        nwarm += warm[i];
+      }
+    }
+    if (nwarm == array->size())
+    {
+      CO_RETURN(i2c::OK);
+    }
+    for (i = 0; i < array->size(); i++)
+    {
+      if (!warm[i])
+      {
+        array->asic(i)->hold_for_program();
+      }
+    }
+    for (i = 0; i < array->size(); i++)
+    {
+      if (!warm[i])
+      {
+        CO_AWAIT(call(co::make<ChirpASIC::Program>(array->asic(i), array->addr(i))));
+        printf("program ASIC %c: %s\n", 'A' + i, i2c::decode(status));
+        if (status != i2c::OK)
+        {
+          CO_RETURN(status);
+        }
+      }
+    }
+    CO_AWAIT(sleep(READY_DELAY));
+    for (i = 0; i < array->size(); i++)
+    {
+      if (!warm[i])
+      {
+        CO_AWAIT(probe(i));
+        if (!ready())
+        {
+          printf("ASIC %c not ready!\n", 'A' + i);
+          CO_RETURN(i2c::ERR);
+        }
+      }
+    }
+    CO_AWAIT(flash_write(BOOTREC_ADDR, make_record(), BOOTREC_LEN));
+    CO_END
+  }
+private:
+  static uint16_t firmware_crc()
+  {
+    static uint16_t crc = frame::crc16(wind_v8_rawbin, sizeof(wind_v8_rawbin));
+    return crc;
+  }
+  buf_t make_record()
+  {
+    uint16_t fw = firmware_crc();
+    auto rec = mkbuf(BOOTREC_LEN);
+    (*rec)[0] = BOOTREC_MAGIC & 0xFF;
+    (*rec)[1] = BOOTREC_MAGIC >> 8;
+    (*rec)[2] = fw & 0xFF;
+    (*rec)[3] = fw >> 8;
+    (*rec)[4] = array->size();
+    for (int i = 0; i < MAX_TRANSDUCERS; i++)
+    {
+      (*rec)[5 + i] = i < array->size() ? array->addr(i) : 0;
+    }
+    uint16_t crc = frame::crc16(&(*rec)[0], BOOTREC_LEN - 2);
+    (*rec)[BOOTREC_LEN-2] = crc & 0xFF;
+    (*rec)[BOOTREC_LEN-1] = crc >> 8;
+    return rec;
+  }
+  bool record_matches(buf_t const &rec)
+  {
+    buf_t want = make_record();
+    for (int i = 0; i < BOOTREC_LEN; i++)
+    {
+      if ((*rec)[i] != (*want)[i])
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+  //Read READY from ASIC i at its current address
+  void probe(int i)
+  {
+    txn.clear();
+    array->asic(i)->queue_r_reg(txn, READY, READY_SZ);
+    run(txn);
+  }
+  bool ready()
+  {
+    return status == i2c::OK && (*txn.result(0))[0] == 0x02;
+  }
+
+  TransducerArray *array;
+  bool warm[MAX_TRANSDUCERS];
+  bool record_ok;
+  int nwarm;
+  int i;
+  i2c::Transaction txn;
+};
+
+#endif
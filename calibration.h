@@ -0,0 +1,418 @@
+#ifndef __CALIBRATION_H__
+#define __CALIBRATION_H__
+
+#include "libstorm.h"
+#include "libfirestorm.h"
+#include "asic.h"
+#include "array.h"
+#include "frame.h"
+#include "measure.h"
+
+using namespace storm;
+
+//Flash location of the calibration record
+#define CALREC_ADDR 0xF0100
+#define CALREC_ZERO (4 + MAX_TRANSDUCERS + MAX_PATHS)
+#define CALREC_WORDS (CALREC_ZERO + 4*MAX_AXES + 1)
+#define CALREC_LEN (2*CALREC_WORDS)
+#define CALREC_MAGIC 0xCA14
+//Length of the calibration pulse. The length actually driven is measured, so
+//it no longer has to be long enough to swamp the scheduler jitter.
+#define CAL_PULSE (40*Timer::MILLISECOND)
+//The end of the pulse is spun for rather than slept to, from this far out
+#define CAL_PULSE_SPIN (1*Timer::MILLISECOND)
+//Recalibrate once the smoothed tof_sf of any path is this many parts per
+//thousand away from its value just after calibration
+#define CAL_SF_DRIFT_PERMIL 5
+//...or the die temperature has moved this far, in 1/32 degree C
+#define CAL_TEMP_DELTA (2*32)
+//How often the drift checks run
+#define CAL_CHECK_INTERVAL (10*Timer::SECOND)
+//Stands in for the die temperature when the TMP006 could not be read
+#define CAL_NO_TEMP INT16_MIN
+
+/**
+ * Owns the ASIC calibration: CAL_RESULT for each ASIC in the array, the
+ * measured length of the pulse it was taken with, and what tof_sf and the
+ * die temperature were at the time. It also keeps the zero wind offset and
+ * fixed TOF delay of each axis, which are set separately and survive
+ * recalibration.
+ *
+ * At boot startup() reuses the record in flash if its CRC is good and it is
+ * for an array of the same shape, so there is no calibration pulse on the
+ * boot path. After that the monitor checks the drift every
+ * CAL_CHECK_INTERVAL and only when tof_sf or the temperature has moved past
+ * its threshold does it stop the engine, pulse, and resume, which costs a
+ * few slots.
+ *
+ * Calibration record, little endian uint16s:
+ *    0  CALREC_MAGIC
+ *    1  number of transducers, number of axes << 8
+ *    2  calibration pulse length (ticks)
+ *    3  die temperature (1/32 degree C, int16)
+ *    4  CAL_RESULT of each transducer, MAX_TRANSDUCERS of them
+ *       reference tof_sf of each path by Shot::id(), MAX_PATHS of them, 0
+ *       until measured
+ *       zero wind t_rev - t_fwd (ps) and fixed TOF delay (ns) of each
+ *       axis as int32s, low word first, MAX_AXES of them
+ *       CRC16 of the bytes before it
+ */
+class Calibration
+{
+public:
+  struct Stats
+  {
+    //Calibration pulses run
+    uint16_t runs;
+    //Boots that reused the record in flash
+    uint16_t reused;
+    uint16_t sf_triggers;
+    uint16_t temp_triggers;
+    uint16_t record_writes;
+  };
+  Calibration(TransducerArray *array, MeasurementEngine *engine)
+    : array(array), engine(engine), cal{}, pulselen(0), ref_sf{}, temp(CAL_NO_TEMP),
+      zero{}, delay{}, sf_avg{}, drifted(false), dirty(false), stats{},
+      pulse(this), startup_(this), monitor_(this)
+  {
+  }
+  //CAL_RESULT of the ASIC that received s
+  uint16_t calres(Shot const &s) const
+  {
+    return cal[array->rx(s.axis, s.path)];
+  }
+  //In ticks, for get_tof()
+  uint16_t get_pulselen() const
+  {
+    return pulselen;
+  }
+  //Zero wind t_rev - t_fwd of an axis in ps, to take out of every pair
+  int32_t zero_ps(uint8_t axis) const
+  {
+    return zero[axis];
+  }
+  //What the TOFs of an axis read beyond the acoustic path, in ns
+  int32_t delay_ns(uint8_t axis) const
+  {
+    return delay[axis];
+  }
+  //Written to flash with the next drift check
+  void set_zero(uint8_t axis, int32_t ps, int32_t delay_ns)
+  {
+    zero[axis] = ps;
+    delay[axis] = delay_ns;
+    dirty = true;
+  }
+  Stats const &get_stats() const
+  {
+    return stats;
+  }
+  //Load or take the calibration, for the boot sequence to await
+  co::Routine *startup()
+  {
+    return &startup_;
+  }
+  //Begin the background drift checks, once the engine is running
+  void start_monitor()
+  {
+    monitor_.start();
+  }
+  //Feed every shot through here to track tof_sf
+  void observe(Shot const &s)
+  {
+    uint16_t sf = (*s.data)[0] + ((uint16_t)(*s.data)[1] << 8);
+    uint8_t p = s.id();
+    if (ref_sf[p] == 0)
+    {
+      //First shot since calibrating, this is the reference
+      ref_sf[p] = sf;
+      sf_avg[p] = (uint32_t)sf << 4;
+      dirty = true;
+      return;
+    }
+    //Exponential average in Q4, 1/8 weight
+    sf_avg[p] += ((int32_t)((uint32_t)sf << 4) - (int32_t)sf_avg[p]) / 8;
+    int32_t diff = (int32_t)sf_avg[p] - ((int32_t)ref_sf[p] << 4);
+    if (diff < 0)
+    {
+      diff = -diff;
+    }
+    if (!drifted && diff * 1000 > ((int32_t)ref_sf[p] << 4) * CAL_SF_DRIFT_PERMIL)
+    {
+      drifted = true;
+      stats.sf_triggers++;
+    }
+  }
+private:
+  uint16_t shape() const
+  {
+    return array->size() | (array->naxes() << 8);
+  }
+  buf_t encode()
+  {
+    uint16_t v[CALREC_WORDS] = {CALREC_MAGIC, shape(), pulselen, (uint16_t)temp};
+    for (int i = 0; i < MAX_TRANSDUCERS; i++)
+    {
+      v[4 + i] = cal[i];
+    }
+    for (int p = 0; p < MAX_PATHS; p++)
+    {
+      v[4 + MAX_TRANSDUCERS + p] = ref_sf[p];
+    }
+    for (int k = 0; k < MAX_AXES; k++)
+    {
+      v[CALREC_ZERO + 4*k] = (uint32_t)zero[k] & 0xFFFF;
+      v[CALREC_ZERO + 4*k + 1] = (uint32_t)zero[k] >> 16;
+      v[CALREC_ZERO + 4*k + 2] = (uint32_t)delay[k] & 0xFFFF;
+      v[CALREC_ZERO + 4*k + 3] = (uint32_t)delay[k] >> 16;
+    }
+    auto rec = mkbuf(CALREC_LEN);
+    for (int i = 0; i < CALREC_WORDS - 1; i++)
+    {
+      (*rec)[2*i] = v[i] & 0xFF;
+      (*rec)[2*i+1] = v[i] >> 8;
+    }
+    uint16_t crc = frame::crc16(&(*rec)[0], CALREC_LEN - 2);
+    (*rec)[CALREC_LEN-2] = crc & 0xFF;
+    (*rec)[CALREC_LEN-1] = crc >> 8;
+    return rec;
+  }
+  bool decode(buf_t const &rec)
+  {
+    uint16_t v[CALREC_WORDS];
+    for (int i = 0; i < CALREC_WORDS; i++)
+    {
+      v[i] = (*rec)[2*i] + ((uint16_t)(*rec)[2*i+1] << 8);
+    }
+    if (v[0] != CALREC_MAGIC || v[1] != shape() ||
+        v[CALREC_WORDS-1] != frame::crc16(&(*rec)[0], CALREC_LEN - 2))
+    {
+      return false;
+    }
+    pulselen = v[2];
+    temp = (int16_t)v[3];
+    for (int i = 0; i < MAX_TRANSDUCERS; i++)
+    {
+      cal[i] = v[4 + i];
+    }
+    for (int p = 0; p < MAX_PATHS; p++)
+    {
+      ref_sf[p] = v[4 + MAX_TRANSDUCERS + p];
+      sf_avg[p] = (uint32_t)ref_sf[p] << 4;
+    }
+    for (int k = 0; k < MAX_AXES; k++)
+    {
+      zero[k] = (int32_t)(v[CALREC_ZERO + 4*k] | ((uint32_t)v[CALREC_ZERO + 4*k + 1] << 16));
+      delay[k] = (int32_t)(v[CALREC_ZERO + 4*k + 2] | ((uint32_t)v[CALREC_ZERO + 4*k + 3] << 16));
+    }
+    return true;
+  }
+  //MAX_RANGE for every ASIC, it is lost if they were reprogrammed
+  void queue_range(i2c::Transaction &t)
+  {
+    for (int i = 0; i < array->size(); i++)
+    {
+      array->asic(i)->queue_w_reg(t, MAX_RANGE, engine->get_range());
+    }
+  }
+  //Die temperature read goes last so a missing TMP006 fails nothing else
+  static void queue_temp(i2c::Transaction &t)
+  {
+    firestorm::I2CRegister<i2c::TMP006, 1>::queue_read(t, mkbuf(2), 2);
+  }
+  static int16_t read_temp(i2c::Transaction &t, size_t i)
+  {
+    if (t.status(i) != i2c::OK)
+    {
+      return CAL_NO_TEMP;
+    }
+    buf_t const &rv = t.result(i);
+    return ((int16_t)(((uint16_t)(*rv)[0] << 8) | (*rv)[1])) >> 2;
+  }
+
+  //Pulse every ASIC together and record the results. The engine must be
+  //idle.
+  class Pulse : public co::Routine
+  {
+  public:
+    Pulse(Calibration *c) : c(c) {}
+  protected:
+    bool body() override
+    {
+      CO_BEGIN
+      n = c->array->size();
+      txn.clear();
+      for (int i = 0; i < n; i++)
+      {
+        c->array->asic(i)->irq_idle();
+        c->array->asic(i)->irq_output();
+        c->array->asic(i)->queue_w_reg(txn, CAL_TRIG, 1);
+      }
+      CO_AWAIT(run(txn));
+      mask = c->array->gang_all();
+      rise = ChirpASIC::gang_pulse_begin(mask);
+      CO_AWAIT(sleep(CAL_PULSE - CAL_PULSE_SPIN));
+      pulselen = ChirpASIC::gang_pulse_end(mask, rise, CAL_PULSE);
+      txn.clear();
+      for (int i = 0; i < n; i++)
+      {
+        c->array->asic(i)->queue_r_reg(txn, CAL_RESULT, CAL_RESULT_SZ);
+      }
+      queue_temp(txn);
+      CO_AWAIT(run(txn));
+      if (txn.first_error() < (size_t)n)
+      {
+        printf("WRN: calibrate i2c op %d: %s\n", (int)txn.first_error(), i2c::decode(status));
+        CO_RETURN(status);
+      }
+      for (int i = 0; i < n; i++)
+      {
+        c->cal[i] = cal_result(txn.result(i));
+      }
+      c->pulselen = pulselen;
+      c->temp = read_temp(txn, n);
+      txn.clear();
+      c->queue_range(txn);
+      CO_AWAIT(run(txn));
+      if (status != i2c::OK)
+      {
+        printf("WRN: calibrate max range: %s\n", i2c::decode(status));
+        CO_RETURN(status);
+      }
+      for (int p = 0; p < MAX_PATHS; p++)
+      {
+        c->ref_sf[p] = 0;
+      }
+      c->drifted = false;
+      c->stats.runs++;
+      printf("calibrate finished, pulse=%d:", c->pulselen);
+      for (int i = 0; i < n; i++)
+      {
+        printf(" %d", c->cal[i]);
+      }
+      printf("\n");
+      CO_END
+    }
+  private:
+    static uint16_t cal_result(buf_t const &rv)
+    {
+      return (*rv)[0] + (((uint16_t)(*rv)[1]) << 8);
+    }
+    Calibration *c;
+    int n;
+    uint32_t mask;
+    uint32_t rise;
+    uint32_t pulselen;
+    i2c::Transaction txn;
+  };
+
+  //Reuse the flash record, or calibrate if there is no good one
+  class Startup : public co::Routine
+  {
+  public:
+    Startup(Calibration *c) : c(c) {}
+  protected:
+    bool body() override
+    {
+      CO_BEGIN
+      CO_AWAIT(flash_read(CALREC_ADDR, mkbuf(CALREC_LEN), CALREC_LEN));
+      if (status == i2c::OK && c->decode(io))
+      {
+        c->stats.reused++;
+        printf("reusing calibration, pulse=%d\n", c->pulselen);
+        txn.clear();
+        c->queue_range(txn);
+        CO_AWAIT(run(txn));
+        CO_RETURN(status);
+      }
+      CO_AWAIT(call(&c->pulse));
+      if (status != i2c::OK)
+      {
+        CO_RETURN(status);
+      }
+      c->dirty = false;
+      c->stats.record_writes++;
+      CO_AWAIT(flash_write(CALREC_ADDR, c->encode(), CALREC_LEN));
+      CO_END
+    }
+  private:
+    Calibration *c;
+    i2c::Transaction txn;
+  };
+
+  //Periodic drift checks, recalibrating between shots when needed
+  class Monitor : public co::Routine
+  {
+  public:
+    Monitor(Calibration *c) : c(c) {}
+  protected:
+    bool body() override
+    {
+      CO_BEGIN
+      while (true)
+      {
+        CO_AWAIT(sleep(CAL_CHECK_INTERVAL));
+        if (c->dirty)
+        {
+          //The tof_sf references came in since the last write
+          c->dirty = false;
+          c->stats.record_writes++;
+          CO_AWAIT(flash_write(CALREC_ADDR, c->encode(), CALREC_LEN));
+        }
+        txn.clear();
+        queue_temp(txn);
+        CO_AWAIT(run(txn));
+        now_temp = read_temp(txn, 0);
+        if (!c->drifted && now_temp != CAL_NO_TEMP && c->temp != CAL_NO_TEMP &&
+            (now_temp - c->temp > CAL_TEMP_DELTA || c->temp - now_temp > CAL_TEMP_DELTA))
+        {
+          c->drifted = true;
+          c->stats.temp_triggers++;
+        }
+        if (!c->drifted)
+        {
+          continue;
+        }
+        c->engine->stop();
+        while (!c->engine->idle())
+        {
+          CO_AWAIT(sleep(Timer::MILLISECOND));
+        }
+        CO_AWAIT(call(&c->pulse));
+        c->engine->resume();
+        if (status == i2c::OK)
+        {
+          //Written again once the new tof_sf references are in
+          c->stats.record_writes++;
+          CO_AWAIT(flash_write(CALREC_ADDR, c->encode(), CALREC_LEN));
+        }
+      }
+      CO_END
+    }
+  private:
+    Calibration *c;
+    int16_t now_temp;
+    i2c::Transaction txn;
+  };
+
+  TransducerArray *array;
+  MeasurementEngine *engine;
+  //CAL_RESULT per transducer
+  uint16_t cal[MAX_TRANSDUCERS];
+  uint16_t pulselen;
+  //tof_sf per path just after calibrating, and its running average in Q4
+  uint16_t ref_sf[MAX_PATHS];
+  int16_t temp;
+  int32_t zero[MAX_AXES];
+  int32_t delay[MAX_AXES];
+  uint32_t sf_avg[MAX_PATHS];
+  bool drifted;
+  //ref_sf, zero or delay has changed since the record was written
+  bool dirty;
+  Stats stats;
+  Pulse pulse;
+  Startup startup_;
+  Monitor monitor_;
+};
+
+#endif
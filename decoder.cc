@@ -0,0 +1,121 @@
+/**
+ * Host side decoder for the binary measurement frames in frame.h.
+ *
+ * sload tail | ./decoder        prints each capture as the old text format,
+ *                               and the cross-correlation dt and phase
+ *                               refined TOFs of each pair
+ * sload tail | ./decoder -s     prints one line per capture
+ *
+ * Statistics records, which the firmware writes by default, and wind
+ * records print as one line each either way.
+ *
+ * Anything on the stream that is not a valid frame (boot messages, other
+ * printf output) is passed through unchanged.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "frame.h"
+#include "tof.h"
+
+namespace
+{
+  class StdoutDecoder : public frame::Decoder
+  {
+  public:
+    void passthrough(const uint8_t *data, size_t length) override
+    {
+      fwrite(data, 1, length, stdout);
+    }
+  };
+
+  //The last A->B capture of each axis, to pair with its B->A
+  TOFResult fwd[128];
+  bool have_fwd[128];
+  PhaseTracker phase[128];
+
+  void print_capture(frame::Capture const &c, bool summary)
+  {
+    TOFResult r = get_tof(c.raw, c.calres, c.pulselen);
+    uint8_t axis = c.path >> 1;
+    //Axis 0 keeps the names of the single axis unit, others are prefixed
+    char path[16];
+    const char *dir = (c.path & 1) == frame::PATH_A2B ? "A->B" : "B->A";
+    if (c.path >> 1)
+    {
+      snprintf(path, sizeof(path), "%u:%s", c.path >> 1, dir);
+    }
+    else
+    {
+      snprintf(path, sizeof(path), "%s", dir);
+    }
+    if (summary)
+    {
+      printf("%u %llu %s %d %d\n", c.seq, (unsigned long long)c.timestamp, path,
+        r.valid ? 1 : 0, (int)r.tof_ns);
+      return;
+    }
+    printf("capture seq=%u ts=%llu %s cal=%u pulse=%u\n", c.seq,
+      (unsigned long long)c.timestamp, path, c.calres, c.pulselen);
+    print_tof(r);
+    if ((c.path & 1) == frame::PATH_A2B)
+    {
+      fwd[axis] = r;
+      have_fwd[axis] = true;
+    }
+    else if (have_fwd[axis])
+    {
+      //Pair results, next to the envelope TOFs above
+      print_xcorr_tof(get_xcorr_tof(fwd[axis], r));
+      print_phase_tof(phase[axis].update(fwd[axis], r));
+      have_fwd[axis] = false;
+    }
+  }
+
+  void print_frame(frame::Decoder const &dec, bool summary)
+  {
+    frame::Capture c;
+    frame::Wind w;
+    frame::Stats s;
+    if (dec.type() == frame::TYPE_CAPTURE && frame::decode_capture(dec.body(), dec.body_length(), c))
+    {
+      print_capture(c, summary);
+    }
+    else if (dec.type() == frame::TYPE_WIND && frame::decode_wind(dec.body(), dec.body_length(), w))
+    {
+      printf("%u %u axis %u wind %.2f m/s temp %.2f C\n", w.seq, w.time_ms, w.axis,
+        w.wind_cm_s / 100.0, w.temp_cc / 100.0);
+    }
+    else if (dec.type() == frame::TYPE_STATS && frame::decode_stats(dec.body(), dec.body_length(), s))
+    {
+      printf("%u %u axis %u %us n=%u mean %.2f m/s std %.2f m/s gust %.2f m/s ti %.3f temp %.2f C\n",
+        s.seq, s.time_ms, s.axis, s.window_s, s.n, s.mean_cm_s / 100.0, s.std_cm_s / 100.0,
+        s.gust_cm_s / 100.0, s.ti_permil / 1000.0, s.temp_cc / 100.0);
+    }
+    else
+    {
+      fprintf(stderr, "decoder: unknown record type 0x%02x\n", dec.type());
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  bool summary = argc > 1 && strcmp(argv[1], "-s") == 0;
+  StdoutDecoder dec;
+  int ch;
+  while ((ch = getchar()) != EOF)
+  {
+    if (dec.feed((uint8_t)ch))
+    {
+      print_frame(dec, summary);
+    }
+  }
+  //A frame cut short at the end is passed through like any other text
+  while (dec.flush())
+  {
+    print_frame(dec, summary);
+  }
+  fprintf(stderr, "decoder: %u frames, %u CRC errors, %u bytes passed through\n",
+    dec.frames, dec.crc_errors, dec.skipped);
+  return 0;
+}
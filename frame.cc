@@ -0,0 +1,261 @@
+#include "frame.h"
+#include <stdio.h>
+#include <cstring>
+
+namespace frame
+{
+  namespace
+  {
+    //Nibble table for CRC16-CCITT, poly 0x1021
+    const uint16_t crc_nibble[16] = {
+      0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+      0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    };
+    void put16(uint8_t *dst, uint16_t v)
+    {
+      dst[0] = v & 0xFF;
+      dst[1] = v >> 8;
+    }
+    uint16_t get16(const uint8_t *src)
+    {
+      return src[0] + (((uint16_t)src[1]) << 8);
+    }
+    int16_t clamp16(int32_t v)
+    {
+      return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+    }
+    uint16_t clampu16(uint32_t v)
+    {
+      return v > UINT16_MAX ? UINT16_MAX : v;
+    }
+    uint16_t next_seq = 0;
+    uint8_t txbuf[CAPTURE_LEN];
+  }
+
+  uint16_t crc16(const uint8_t *data, size_t length, uint16_t crc)
+  {
+    for (size_t i = 0; i < length; i++)
+    {
+      crc = (crc << 4) ^ crc_nibble[(crc >> 12) ^ (data[i] >> 4)];
+      crc = (crc << 4) ^ crc_nibble[(crc >> 12) ^ (data[i] & 0x0F)];
+    }
+    return crc;
+  }
+
+  uint16_t take_seq()
+  {
+    return next_seq++;
+  }
+
+  size_t seal(uint8_t *dst, uint8_t type, size_t bodylen)
+  {
+    dst[0] = SYNC0;
+    dst[1] = SYNC1;
+    dst[2] = bodylen + 1;
+    dst[3] = type;
+    put16(&dst[HEADER_LEN + bodylen], crc16(&dst[2], bodylen + 2));
+    return HEADER_LEN + bodylen + CRC_LEN;
+  }
+
+  size_t encode_capture(uint8_t *dst, uint16_t seq, uint64_t timestamp, uint8_t path,
+                        const uint8_t *raw, uint16_t calres, uint16_t pulselen)
+  {
+    uint8_t *b = &dst[HEADER_LEN];
+    put16(&b[0], seq);
+    for (int i = 0; i < 6; i++)
+    {
+      b[2+i] = (timestamp >> (8*i)) & 0xFF;
+    }
+    b[8] = path;
+    b[9] = raw[0];
+    b[10] = raw[1];
+    put16(&b[11], calres);
+    put16(&b[13], pulselen);
+    std::memcpy(&b[15], &raw[6], 64);
+    return seal(dst, TYPE_CAPTURE, CAPTURE_BODY);
+  }
+
+  void emit_capture(uint64_t timestamp, uint8_t path, const uint8_t *raw, uint16_t calres, uint16_t pulselen)
+  {
+    size_t len = encode_capture(txbuf, take_seq(), timestamp, path, raw, calres, pulselen);
+    fwrite(txbuf, 1, len, stdout);
+    fflush(stdout);
+  }
+
+  bool decode_capture(const uint8_t *body, size_t length, Capture &out)
+  {
+    if (length != CAPTURE_BODY)
+    {
+      return false;
+    }
+    out.seq = get16(&body[0]);
+    out.timestamp = 0;
+    for (int i = 0; i < 6; i++)
+    {
+      out.timestamp |= ((uint64_t)body[2+i]) << (8*i);
+    }
+    out.path = body[8];
+    out.calres = get16(&body[11]);
+    out.pulselen = get16(&body[13]);
+    //The TOF and INTENSITY registers (bytes 2-5) are not carried
+    std::memset(out.raw, 0, sizeof(out.raw));
+    out.raw[0] = body[9];
+    out.raw[1] = body[10];
+    std::memcpy(&out.raw[6], &body[15], 64);
+    return true;
+  }
+
+  size_t encode_wind(uint8_t *dst, uint16_t seq, uint64_t timestamp, uint8_t axis,
+                     int32_t wind_mm_s, int32_t temp_mc)
+  {
+    uint8_t *b = &dst[HEADER_LEN];
+    put16(&b[0], seq);
+    put16(&b[2], timestamp / Timer::MILLISECOND);
+    b[4] = axis;
+    put16(&b[5], clamp16(wind_mm_s / 10));
+    put16(&b[7], clamp16(temp_mc / 10));
+    return seal(dst, TYPE_WIND, WIND_BODY);
+  }
+
+  void emit_wind(uint64_t timestamp, uint8_t axis, int32_t wind_mm_s, int32_t temp_mc)
+  {
+    size_t len = encode_wind(txbuf, take_seq(), timestamp, axis, wind_mm_s, temp_mc);
+    fwrite(txbuf, 1, len, stdout);
+    fflush(stdout);
+  }
+
+  bool decode_wind(const uint8_t *body, size_t length, Wind &out)
+  {
+    if (length != WIND_BODY)
+    {
+      return false;
+    }
+    out.seq = get16(&body[0]);
+    out.time_ms = get16(&body[2]);
+    out.axis = body[4];
+    out.wind_cm_s = (int16_t)get16(&body[5]);
+    out.temp_cc = (int16_t)get16(&body[7]);
+    return true;
+  }
+
+  size_t encode_stats(uint8_t *dst, uint16_t seq, uint64_t timestamp, uint8_t axis,
+                      WindStats::Summary const &s)
+  {
+    uint8_t *b = &dst[HEADER_LEN];
+    put16(&b[0], seq);
+    put16(&b[2], timestamp / Timer::MILLISECOND);
+    b[4] = axis;
+    put16(&b[5], s.window_s);
+    put16(&b[7], s.n);
+    put16(&b[9], clamp16(s.mean_mm_s / 10));
+    put16(&b[11], clampu16(s.std_mm_s / 10));
+    put16(&b[13], clamp16(s.gust_mm_s / 10));
+    put16(&b[15], clampu16(s.ti_permil));
+    put16(&b[17], clamp16(s.temp_mc / 10));
+    return seal(dst, TYPE_STATS, STATS_BODY);
+  }
+
+  void emit_stats(uint64_t timestamp, uint8_t axis, WindStats::Summary const &s)
+  {
+    size_t len = encode_stats(txbuf, take_seq(), timestamp, axis, s);
+    fwrite(txbuf, 1, len, stdout);
+    fflush(stdout);
+  }
+
+  bool decode_stats(const uint8_t *body, size_t length, Stats &out)
+  {
+    if (length != STATS_BODY)
+    {
+      return false;
+    }
+    out.seq = get16(&body[0]);
+    out.time_ms = get16(&body[2]);
+    out.axis = body[4];
+    out.window_s = get16(&body[5]);
+    out.n = get16(&body[7]);
+    out.mean_cm_s = (int16_t)get16(&body[9]);
+    out.std_cm_s = get16(&body[11]);
+    out.gust_cm_s = (int16_t)get16(&body[13]);
+    out.ti_permil = get16(&body[15]);
+    out.temp_cc = (int16_t)get16(&body[17]);
+    return true;
+  }
+
+  Decoder::Decoder()
+    : frames(0), crc_errors(0), skipped(0), len(0), done(0)
+  {
+  }
+  bool Decoder::feed(uint8_t byte)
+  {
+    drop();
+    buf[len++] = byte;
+    return scan();
+  }
+  bool Decoder::flush()
+  {
+    drop();
+    while (len > 0)
+    {
+      if (scan())
+      {
+        return true;
+      }
+      //A candidate that will not be finished now, which fails like any other
+      if (len > 0)
+      {
+        skip();
+      }
+    }
+    return false;
+  }
+  //Forget the frame last returned, keeping any bytes after it
+  void Decoder::drop()
+  {
+    if (done)
+    {
+      len -= done;
+      memmove(buf, &buf[done], len);
+      done = 0;
+    }
+  }
+  //Look for a frame at the start of buf. A candidate that fails hands back
+  //only up to the next sync byte inside it, so a frame that starts within
+  //a corrupt one is still found.
+  bool Decoder::scan()
+  {
+    while (len > 0)
+    {
+      bool ok = buf[0] == SYNC0 && (len < 2 || buf[1] == SYNC1) && (len < 3 || buf[2] != 0);
+      if (ok && (len < 3 || len < (size_t)buf[2] + 5))
+      {
+        return false;
+      }
+      if (ok)
+      {
+        size_t end = buf[2] + 5;
+        if (crc16(&buf[2], buf[2] + 1) == get16(&buf[end - CRC_LEN]))
+        {
+          frames++;
+          done = end;
+          return true;
+        }
+        crc_errors++;
+      }
+      skip();
+    }
+    return false;
+  }
+  //Hand back the first byte of buf and any after it up to the next sync
+  void Decoder::skip()
+  {
+    size_t n = 1;
+    while (n < len && buf[n] != SYNC0)
+    {
+      n++;
+    }
+    passthrough(buf, n);
+    skipped += n;
+    len -= n;
+    memmove(buf, &buf[n], len);
+  }
+}
@@ -0,0 +1,188 @@
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "libstorm.h"
+#include "stats.h"
+
+using namespace storm;
+
+/**
+ * Binary framing for measurement records on stdout. All multi-byte fields are
+ * little endian.
+ *
+ *  off len
+ *    0   2  sync, 0xA5 0x5A
+ *    2   1  body length, from the type byte up to (not including) the CRC
+ *    3   1  record type
+ *    4   n  body
+ *  4+n   2  CRC16-CCITT (poly 0x1021, init 0xFFFF) over the length, type and
+ *           body bytes
+ *
+ * A capture record (TYPE_CAPTURE) body is
+ *
+ *    0   2  sequence number
+ *    2   6  trigger timestamp in kernel ticks (48 bit)
+ *    8   1  path, the axis in bits 7-1 and the direction in bit 0, with 0
+ *           transmitting from the first end of the axis (A->B on a single
+ *           axis unit) and 1 back
+ *    9   2  tof_sf
+ *   11   2  CAL_RESULT of the receiving ASIC
+ *   13   2  calibration pulse length (ticks)
+ *   15  64  16 x (Q int16, I int16)
+ *
+ * A wind record (TYPE_WIND) body, one per pair, is
+ *
+ *    0   2  sequence number, shared with capture records
+ *    2   2  trigger timestamp of the A->B shot in ms, wrapping
+ *    4   1  axis
+ *    5   2  wind along the axis from its first end to its second, in cm/s
+ *           (int16)
+ *    7   2  sonic temperature in 1/100 degree C (int16)
+ *
+ * A statistics record (TYPE_STATS) body, one per axis each time one of its
+ * windows closes, is
+ *
+ *    0   2  sequence number, shared with the other records
+ *    2   2  timestamp of the pair that closed the window in ms, wrapping
+ *    4   1  axis
+ *    5   2  window length in seconds
+ *    7   2  samples in the window
+ *    9   2  mean wind along the axis in cm/s (int16)
+ *   11   2  standard deviation in cm/s
+ *   13   2  gust, the running mean of largest magnitude, in cm/s (int16)
+ *   15   2  turbulence intensity, parts per thousand, 0xFFFF if the mean is
+ *           zero or it is larger
+ *   17   2  mean sonic temperature in 1/100 degree C (int16)
+ */
+namespace frame
+{
+  constexpr uint8_t SYNC0 = 0xA5;
+  constexpr uint8_t SYNC1 = 0x5A;
+  constexpr size_t HEADER_LEN = 4;
+  constexpr size_t CRC_LEN = 2;
+  constexpr size_t MAX_BODY = 255;
+
+  constexpr uint8_t TYPE_CAPTURE = 0x01;
+  constexpr size_t CAPTURE_BODY = 79;
+  constexpr size_t CAPTURE_LEN = HEADER_LEN + CAPTURE_BODY + CRC_LEN;
+
+  constexpr uint8_t TYPE_WIND = 0x02;
+  constexpr size_t WIND_BODY = 9;
+  constexpr size_t WIND_LEN = HEADER_LEN + WIND_BODY + CRC_LEN;
+
+  constexpr uint8_t TYPE_STATS = 0x03;
+  constexpr size_t STATS_BODY = 19;
+  constexpr size_t STATS_LEN = HEADER_LEN + STATS_BODY + CRC_LEN;
+
+  constexpr uint8_t PATH_A2B = 0;
+  constexpr uint8_t PATH_B2A = 1;
+  constexpr uint8_t path_id(uint8_t axis, uint8_t dir)
+  {
+    return (axis << 1) | dir;
+  }
+
+  uint16_t crc16(const uint8_t *data, size_t length, uint16_t crc = 0xFFFF);
+
+  //The next sequence number, for records encoded somewhere other than stdout
+  uint16_t take_seq();
+
+  /**
+   * Wrap an already encoded body (which starts at dst+HEADER_LEN) with sync,
+   * length, type and CRC. Returns the total frame length.
+   */
+  size_t seal(uint8_t *dst, uint8_t type, size_t bodylen);
+
+  //Encode the raw 70 byte sample capture into dst, which must hold CAPTURE_LEN
+  size_t encode_capture(uint8_t *dst, uint16_t seq, uint64_t timestamp, uint8_t path,
+                        const uint8_t *raw, uint16_t calres, uint16_t pulselen);
+
+  //Encode and write a capture record to stdout with the next sequence number
+  void emit_capture(uint64_t timestamp, uint8_t path, const uint8_t *raw, uint16_t calres, uint16_t pulselen);
+  inline void emit_capture(uint64_t timestamp, uint8_t path, buf_t const &raw, uint16_t calres, uint16_t pulselen)
+  {
+    emit_capture(timestamp, path, &(*raw)[0], calres, pulselen);
+  }
+
+  struct Capture
+  {
+    uint16_t seq;
+    uint64_t timestamp;
+    uint8_t path;
+    uint16_t calres;
+    uint16_t pulselen;
+    //The sample capture in the layout the ASIC returns it, for get_tof()
+    uint8_t raw[70];
+  };
+  bool decode_capture(const uint8_t *body, size_t length, Capture &out);
+
+  struct Wind
+  {
+    uint16_t seq;
+    uint16_t time_ms;
+    uint8_t axis;
+    int16_t wind_cm_s;
+    int16_t temp_cc;
+  };
+  //Encode a wind record into dst, which must hold WIND_LEN. The wind and
+  //temperature are clamped to the int16 range.
+  size_t encode_wind(uint8_t *dst, uint16_t seq, uint64_t timestamp, uint8_t axis,
+                     int32_t wind_mm_s, int32_t temp_mc);
+  void emit_wind(uint64_t timestamp, uint8_t axis, int32_t wind_mm_s, int32_t temp_mc);
+  bool decode_wind(const uint8_t *body, size_t length, Wind &out);
+
+  struct Stats
+  {
+    uint16_t seq;
+    uint16_t time_ms;
+    uint8_t axis;
+    uint16_t window_s;
+    uint16_t n;
+    int16_t mean_cm_s;
+    uint16_t std_cm_s;
+    int16_t gust_cm_s;
+    uint16_t ti_permil;
+    int16_t temp_cc;
+  };
+  //Encode a statistics record into dst, which must hold STATS_LEN
+  size_t encode_stats(uint8_t *dst, uint16_t seq, uint64_t timestamp, uint8_t axis,
+                      WindStats::Summary const &s);
+  void emit_stats(uint64_t timestamp, uint8_t axis, WindStats::Summary const &s);
+  bool decode_stats(const uint8_t *body, size_t length, Stats &out);
+
+  /**
+   * Incremental frame parser for the host side. Feed it bytes as they arrive.
+   * Bytes that are not part of a valid frame are handed back through
+   * passthrough() so interleaved printf text is not lost.
+   */
+  class Decoder
+  {
+  public:
+    Decoder();
+    //Returns true when a complete frame with a good CRC has been received
+    bool feed(uint8_t byte);
+    //At the end of the input. Returns true, like feed(), for each frame
+    //still held, then passes the remaining bytes through and returns false.
+    bool flush();
+    uint8_t type() const { return buf[3]; }
+    const uint8_t *body() const { return &buf[HEADER_LEN]; }
+    size_t body_length() const { return buf[2] - 1; }
+    virtual void passthrough(const uint8_t *data, size_t length) {}
+    virtual ~Decoder() {}
+    uint32_t frames;
+    uint32_t crc_errors;
+    uint32_t skipped;
+  private:
+    void drop();
+    bool scan();
+    void skip();
+    uint8_t buf[HEADER_LEN + MAX_BODY + CRC_LEN];
+    size_t len;
+    //Length of the frame feed() last returned, dropped from buf on the next
+    //call. Bytes after it are ones a failed candidate held.
+    size_t done;
+  };
+}
+
+#endif
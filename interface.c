@@ -5,6 +5,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <malloc.h>
+#include <new>
 
 extern "C" {
 //------------------------------
@@ -12,6 +15,10 @@ extern "C" {
 //------------------------------
 
 extern void* __ram_end__;
+extern uint32_t _sstack;
+extern uint32_t _estack;
+static struct mem_stats mem = {0};
+#define STACK_PAINT 0xC5C5C5C5
 void* _sbrk(uint32_t increment)
 {
     extern uint8_t *end;
@@ -20,11 +27,32 @@ void* _sbrk(uint32_t increment)
     if (heap_end == 0)
     {
         heap_end =(uint8_t*) &end;
+        mem.arena_limit = (uint8_t*) &_sstack - heap_end;
+    }
+    //Never into the stack's reservation
+    if (increment > (uint32_t)((uint8_t*) &_sstack - heap_end))
+    {
+        mem.sbrk_failures++;
+        errno = ENOMEM;
+        return (void*) -1;
     }
     prev_heap_end = heap_end;
     heap_end += increment;
+    mem.arena += increment;
     return prev_heap_end;
 }
+void mem_get_stats(struct mem_stats *out)
+{
+    //The first word from the bottom that is no longer paint
+    uint32_t *p = &_sstack;
+    while (p < &_estack && *p == STACK_PAINT)
+    {
+        p++;
+    }
+    mem.stack_size = (uint8_t*) &_estack - (uint8_t*) &_sstack;
+    mem.stack_used = (uint8_t*) &_estack - (uint8_t*) p;
+    *out = mem;
+}
 int _isatty(int fd)
 {
     return 1;
@@ -90,8 +118,6 @@ extern uint32_t _srelocate;
 extern uint32_t _erelocate;
 extern uint32_t _szero;
 extern uint32_t _ezero;
-extern uint32_t _sstack;
-extern uint32_t _estack;
 void *__dso_handle = 0;
 extern void __libc_init_array();
 extern int main();
@@ -115,6 +141,9 @@ void __attribute__((used)) _start2()
     //asm volatile(" LDR sp, =_estack");
     uint32_t *pSrc, *pDest;
 
+    /* Paint the stack below this frame, for mem_get_stats */
+    for (pDest = &_sstack; pDest < (uint32_t*) __builtin_frame_address(0) - 16;) *pDest++ = STACK_PAINT;
+
     /* Move the relocate segment */
 	pSrc = &_etext;
 	pDest = &_srelocate;
@@ -231,3 +260,37 @@ void __attribute__((naked)) k_wait_callback()
 }
 
 }
+
+//Every heap allocation libstorm and the application make goes through these,
+//so they keep the live and peak counts. libc's own mallocs (stdio buffers)
+//only show in the arena.
+void* operator new(size_t size)
+{
+    void *rv = malloc(size ? size : 1);
+    if (rv == 0)
+    {
+        printf("out of memory, %u bytes wanted\n", (unsigned) size);
+        while(1);
+    }
+    mem.allocs++;
+    mem.live += malloc_usable_size(rv);
+    if (mem.live > mem.peak)
+    {
+        mem.peak = mem.live;
+    }
+    return rv;
+}
+void operator delete(void *ptr) noexcept
+{
+    if (ptr != 0)
+    {
+        mem.frees++;
+        mem.live -= malloc_usable_size(ptr);
+    }
+    free(ptr);
+}
+void operator delete(void *ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+
@@ -134,5 +134,33 @@ void k_wait_callback();
 void k_syscall_ex(uint32_t number, uint32_t arg0, uint32_t arg1, uint32_t arg2);
 #define ABI_ID_SYSCALL_EX 8
 
+/**
+ * Heap and stack use, kept by the libc stubs in interface.c. The heap grows
+ * up from the end of .bss and _sbrk refuses, with ENOMEM, to hand out the
+ * __stack_size__ bytes below _estack that the stack grows down into. That
+ * region is painted at _start2 so the deepest the stack has been can be
+ * found later.
+ */
+struct mem_stats
+{
+  //Bytes _sbrk has handed out, and the most it may
+  uint32_t arena;
+  uint32_t arena_limit;
+  //_sbrk calls refused
+  uint32_t sbrk_failures;
+  //Bytes in blocks from operator new still allocated, and the most there
+  //have been
+  uint32_t live;
+  uint32_t peak;
+  //operator new and delete calls since boot
+  uint32_t allocs;
+  uint32_t frees;
+  //Deepest the stack has been, of the bytes reserved for it. Equal means it
+  //has probably run past them.
+  uint32_t stack_used;
+  uint32_t stack_size;
+};
+void mem_get_stats(struct mem_stats *out);
+
 }
 #endif
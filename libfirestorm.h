@@ -88,6 +88,19 @@ namespace firestorm
     {
       write_offset(0, msg, length, callback);
     }
+
+    //Queue a read onto a batch, to share one lock acquisition with others
+    static void queue_read(i2c::Transaction &t, buf_t target, uint16_t length, uint8_t offset = 0)
+    {
+      t.write_read(devaddress, {(uint8_t)(regaddr+offset)}, move(target), length);
+    }
+    static void queue_write(i2c::Transaction &t, buf_t msg, uint16_t length, uint8_t offset = 0)
+    {
+      auto msgbuf = mkbuf(length+1);
+      std::memcpy(&(*msgbuf)[1], &(*msg)[0], length);
+      (*msgbuf)[0] = regaddr + offset;
+      t.write(devaddress, move(msgbuf), length+1);
+    }
   };
 
   class TMP006
@@ -8,19 +8,118 @@
 
 namespace storm
 {
-  std::shared_ptr<std::vector<uint8_t>> mkbuf(size_t size)
+  namespace bufpool
   {
-    return std::make_shared<std::vector<uint8_t>>(size);
+    namespace
+    {
+      constexpr uint8_t HEAP = 0xFF;
+      //Blocks per class. Each class is tracked with a 32 bit free mask.
+      constexpr uint16_t SIZE0 = 4,   COUNT0 = 16;
+      constexpr uint16_t SIZE1 = 16,  COUNT1 = 8;
+      //Sample reads: the one in flight, the last one a transaction still
+      //holds, and on a 3D head one per axis waiting for its other direction
+      //plus the pair being handed over
+      constexpr uint16_t SIZE2 = 80,  COUNT2 = 10;
+      constexpr uint16_t SIZE3 = 136, COUNT3 = 2;
+      alignas(4) uint8_t mem0[COUNT0][sizeof(Buffer) + SIZE0];
+      alignas(4) uint8_t mem1[COUNT1][sizeof(Buffer) + SIZE1];
+      alignas(4) uint8_t mem2[COUNT2][sizeof(Buffer) + SIZE2];
+      alignas(4) uint8_t mem3[COUNT3][sizeof(Buffer) + SIZE3];
+      struct Pool
+      {
+        uint8_t *mem;
+        uint32_t free;
+        Stats stats;
+      };
+      Pool pools[CLASSES] = {
+        {&mem0[0][0], (1ULL << COUNT0) - 1, {SIZE0, COUNT0, 0, 0, 0}},
+        {&mem1[0][0], (1ULL << COUNT1) - 1, {SIZE1, COUNT1, 0, 0, 0}},
+        {&mem2[0][0], (1ULL << COUNT2) - 1, {SIZE2, COUNT2, 0, 0, 0}},
+        {&mem3[0][0], (1ULL << COUNT3) - 1, {SIZE3, COUNT3, 0, 0, 0}},
+      };
+      Buffer *alloc(size_t size, bool heap = true)
+      {
+        for (uint8_t c = 0; c < CLASSES; c++)
+        {
+          Pool &p = pools[c];
+          if (size > p.stats.size)
+          {
+            continue;
+          }
+          if (p.free == 0)
+          {
+            p.stats.exhausted++;
+            break;
+          }
+          int idx = __builtin_ctz(p.free);
+          p.free &= ~(1UL << idx);
+          if (++p.stats.in_use > p.stats.high_water)
+          {
+            p.stats.high_water = p.stats.in_use;
+          }
+          void *block = p.mem + idx * (sizeof(Buffer) + p.stats.size);
+          return new (block) Buffer(size, c);
+        }
+        if (!heap)
+        {
+          return nullptr;
+        }
+        heap_allocs++;
+        void *block = ::operator new(sizeof(Buffer) + size);
+        return new (block) Buffer(size, HEAP);
+      }
+    }
+    uint32_t heap_allocs = 0;
+    Stats const &stats(int cls)
+    {
+      return pools[cls].stats;
+    }
+    void report()
+    {
+      for (int c = 0; c < CLASSES; c++)
+      {
+        Stats const &s = pools[c].stats;
+        printf("bufpool %3u: %u/%u in use, high water %u, exhausted %u\n",
+          s.size, s.in_use, s.count, s.high_water, (unsigned)s.exhausted);
+      }
+      printf("bufpool heap: %u\n", (unsigned)heap_allocs);
+    }
+  }
+  namespace _priv
+  {
+    void buf_free(Buffer *b)
+    {
+      if (b->pool == bufpool::HEAP)
+      {
+        b->~Buffer();
+        ::operator delete(b);
+        return;
+      }
+      bufpool::Pool &p = bufpool::pools[b->pool];
+      int idx = (reinterpret_cast<uint8_t*>(b) - p.mem) / (sizeof(Buffer) + p.stats.size);
+      b->~Buffer();
+      p.free |= 1UL << idx;
+      p.stats.in_use--;
+    }
+  }
+  buf_t mkbuf(size_t size)
+  {
+    return buf_t(bufpool::alloc(size));
+  }
+  buf_t mkbuf_pooled(size_t size)
+  {
+    return buf_t(bufpool::alloc(size, false));
   }
-  std::shared_ptr<std::vector<uint8_t>> mkbuf(std::initializer_list<uint8_t> contents)
+  buf_t mkbuf(std::initializer_list<uint8_t> contents)
   {
-    auto rv = std::make_shared<std::vector<uint8_t>>(contents.size());
+    buf_t rv = mkbuf(contents.size());
     int idx = 0;
     for (auto v : contents) (*rv)[idx++] = v;
     return rv;
   }
   namespace _priv
   {
+#ifndef STORM_SIM
     uint32_t __attribute__((naked)) syscall_ex(...)
     {
       asm volatile (\
@@ -29,68 +128,209 @@ namespace storm
           "pop {r4-r11}\n\t"\
           "bx lr":::"memory", "r0");
     }
+#endif
     void irq_callback(uint32_t idx);
   }
   namespace tq
   {
+    namespace
+    {
+      Task slots[CAPACITY];
+      uint16_t head = 0;
+      //The tick the scheduler was last known busy at: while a task runs,
+      //when it started, and otherwise when the last one finished or the
+      //last wait returned. Fresh while it is also the time now, near enough,
+      //which saves most clock reads.
+      uint32_t stamp = 0;
+      bool fresh = false;
+      //Everything between tasks counts as idle. Tasks queued from outside
+      //a task, mostly by kernel callbacks, are stamped here rather than
+      //each reading the clock, so their latency is from when the scheduler
+      //woke to them.
+      void catch_up()
+      {
+        uint32_t now = sys::now();
+        stats.idle += now - stamp;
+        stamp = now;
+        fresh = true;
+        for (uint16_t i = 0; i < stats.depth; i++)
+        {
+          Task &t = slots[(head + i) % CAPACITY];
+          if (!t.stamped)
+          {
+            t.queued = now;
+            t.stamped = true;
+          }
+        }
+      }
+    }
+    Stats stats;
     void Task::fire()
     {
-      (*target)();
+      (*this)();
+      clear();
+    }
+    void clear_stats()
+    {
+      uint16_t depth = stats.depth;
+      stats = Stats();
+      stats.depth = depth;
+      stats.max_depth = depth;
+    }
+    void report()
+    {
+      printf("tq ran %u, busy %u.%u%%, max depth %u/%u, longest task %u ticks, overflows %u\n",
+        (unsigned)stats.ran, (unsigned)(stats.busy * 100 / (stats.busy + stats.idle + 1)),
+        (unsigned)(stats.busy * 1000 / (stats.busy + stats.idle + 1) % 10), stats.max_depth,
+        (unsigned)CAPACITY, (unsigned)stats.max_run, (unsigned)stats.overflows);
+      printf("tq latency ticks, max %u:", (unsigned)stats.max_latency);
+      for (int i = 0; i < LATENCY_BUCKETS; i++)
+      {
+        if (i == 0)
+        {
+          printf(" 0:%u", (unsigned)stats.latency[i]);
+        }
+        else if (i == LATENCY_BUCKETS - 1)
+        {
+          printf(" %u+:%u", 1U << (i - 1), (unsigned)stats.latency[i]);
+        }
+        else
+        {
+          printf(" %u-%u:%u", 1U << (i - 1), (2U << (i - 1)) - 1, (unsigned)stats.latency[i]);
+        }
+      }
+      printf("\n");
+    }
+    Task *reserve()
+    {
+      if (stats.depth == CAPACITY)
+      {
+        stats.overflows++;
+#ifndef TQ_OVERFLOW_DROP
+        printf("tq overflow\n");
+        while(1);
+#endif
+        return nullptr;
+      }
+      return &slots[(head + stats.depth) % CAPACITY];
+    }
+    void commit()
+    {
+      //From a task, when that task started
+      Task &t = slots[(head + stats.depth) % CAPACITY];
+      t.queued = stamp;
+      t.stamped = fresh;
+      stats.added++;
+      stats.depth++;
+      if (stats.depth > stats.max_depth)
+      {
+        stats.max_depth = stats.depth;
+      }
+      TRACE(trace::TQ_ADD, stats.depth, stats.added);
     }
-    std::queue<Task> dyn_tq;
     template <> bool add(std::shared_ptr<std::function<void(void)>> target)
     {
-      dyn_tq.push(Task(target));
-      return true;
+      return add([target]
+      {
+        (*target)();
+      });
     }
     bool run_one()
     {
-      if (dyn_tq.empty())
+      if (stats.depth == 0)
       {
+        fresh = false;
         return false;
       }
-      dyn_tq.front().fire();
-      dyn_tq.pop();
+      Task &task = slots[head];
+      if (!fresh)
+      {
+        catch_up();
+      }
+      uint32_t start = stamp;
+      uint32_t latency = start - task.queued;
+      //Queued by a callback after the stamp was taken
+      if ((int32_t)latency < 0)
+      {
+        latency = 0;
+      }
+      int bucket = latency ? 32 - __builtin_clz(latency) : 0;
+      stats.latency[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+      if (latency > stats.max_latency)
+      {
+        stats.max_latency = latency;
+      }
+      TRACE(trace::TQ_RUN, stats.depth, head);
+      //The task stays in its slot while it runs, anything it adds goes behind
+      task.fire();
+      head = (head + 1) % CAPACITY;
+      stats.depth--;
+      stamp = sys::now();
+      fresh = true;
+      uint32_t run = stamp - start;
+      stats.ran++;
+      stats.busy += run;
+      if (run > stats.max_run)
+      {
+        stats.max_run = run;
+      }
+      TRACE(trace::TQ_DONE, stats.depth, 0);
       return true;
     }
+    void wait()
+    {
+      fresh = false;
+      k_wait_callback();
+      catch_up();
+    }
     void __attribute__((noreturn)) scheduler()
     {
       while(1)
       {
         while(run_one());
-        k_wait_callback();
+        wait();
       }
     }
   }
   namespace util
   {
     Resource::Resource()
-      :active(false)
+      :overflows(0), active(false)
     {}
     void Resource::acquire(std::function<void()> cb)
     {
-      if (!active && queue.empty())
+      //Waiters left behind by a full task queue go first
+      if (!active && !queue.empty() && grant(queue.front()))
       {
-        active = true;
-        tq::add(cb);
+        queue.pop();
       }
-      else
+      if (active || !queue.empty() || !grant(cb))
       {
-        queue.push(cb);
+        queue.push(move(cb));
       }
     }
     void Resource::release()
     {
-      if (queue.empty())
+      active = false;
+      if (!queue.empty() && grant(queue.front()))
       {
-        active = false;
+        queue.pop();
       }
-      else
+    }
+    //Queue cb to run holding the resource. It is left alone if the task
+    //queue is full.
+    bool Resource::grant(std::function<void()> &cb)
+    {
+      tq::Task *slot = tq::reserve();
+      if (slot == nullptr)
       {
-        auto cb = queue.front();
-        queue.pop();
-        tq::add(cb);
+        overflows++;
+        return false;
       }
+      active = true;
+      slot->emplace(move(cb));
+      tq::commit();
+      return true;
     }
   }
   namespace gpio
@@ -148,9 +388,16 @@ namespace storm
   }
   namespace _priv
   {
+    //Routines blocked in wait_irq, by pin index
+    co::Routine *irq_waiters[20];
     void irq_callback(uint32_t idx)
     {
-      if (idx <= 20 && gpio::irq_ptrs[idx])
+      TRACE(trace::IRQ, idx, 0);
+      if (idx < 20 && irq_waiters[idx])
+      {
+        irq_waiters[idx]->_irq();
+      }
+      else if (idx < 20 && gpio::irq_ptrs[idx])
       {
         tq::add(gpio::irq_ptrs[idx]);
       }
@@ -162,60 +409,338 @@ namespace storm
     void tmr_callback(Timer *self);
   }
 
+  namespace
+  {
+    //Timer wheel geometry: LEVELS levels of SLOTS lists. A level L slot
+    //spans SLOTS^L ticks, so level 7 covers the whole 32 bit tick range.
+    constexpr int LVL_BITS = 4;
+    constexpr int SLOTS = 1 << LVL_BITS;
+    constexpr int LEVELS = 8;
+    Timer *wheel[LEVELS][SLOTS];
+    uint16_t occupied[LEVELS];
+    //Everything up to and including clk has been expired or cascaded
+    uint32_t clk;
+    Timer *free_timers;
+    bool kernel_armed;
+    uint32_t kernel_at;
+    uint16_t kernel_id;
 
-  void Timer::cancel()
+    uint16_t rotr16(uint16_t v, int n)
+    {
+      return n ? (uint16_t)((v >> n) | (v << (16 - n))) : v;
+    }
+  }
+  Timer Timer::pool[TIMER_POOL];
+  Timer::Stats Timer::stats;
+
+  Timer *Timer::alloc()
   {
-    //TODO: purge any queued callbacks from the task queue
-    if(self)
+    if (free_timers == nullptr && stats.high_water < TIMER_POOL)
     {
-      _priv::syscall_ex(0x205, id);
-      self.reset();
+      //Pool not fully handed out yet, take the next untouched node
+      free_timers = &pool[stats.high_water];
+      free_timers->next = nullptr;
+    }
+    Timer *t = free_timers;
+    if (t == nullptr)
+    {
+      printf("timer pool exhausted\n");
+      while(1);
+    }
+    free_timers = t->next;
+    t->next = nullptr;
+    if (++stats.active > stats.high_water)
+    {
+      stats.high_water = stats.active;
     }
+    return t;
   }
-  void Timer::fire()
+  void Timer::release()
   {
-    auto t = self;
-    tq::add([=](){
-      (*callback)(t);
+    callback.clear();
+    gen++;
+    running = false;
+    cancelled = false;
+    next = free_timers;
+    free_timers = this;
+    stats.active--;
+  }
+  void Timer::insert(Timer *t)
+  {
+    uint32_t delta = t->expires - clk;
+    int lvl = 0;
+    int idx;
+    if ((int32_t)delta <= 0)
+    {
+      //Already due, expire on the next pass
+      idx = clk & (SLOTS - 1);
+    }
+    else
+    {
+      while (lvl < LEVELS - 1 && (delta >> (LVL_BITS * (lvl + 1))) != 0)
+      {
+        lvl++;
+      }
+      idx = (t->expires >> (LVL_BITS * lvl)) & (SLOTS - 1);
+    }
+    Timer **head = &wheel[lvl][idx];
+    t->next = *head;
+    if (t->next)
+    {
+      t->next->pprev = &t->next;
+    }
+    t->pprev = head;
+    *head = t;
+    occupied[lvl] |= 1 << idx;
+  }
+  void Timer::unlink(Timer *t)
+  {
+    if (t->pprev == nullptr)
+    {
+      return;
+    }
+    *t->pprev = t->next;
+    if (t->next)
+    {
+      t->next->pprev = t->pprev;
+    }
+    //Clear the occupancy bit if that emptied the slot
+    for (int lvl = 0; lvl < LEVELS; lvl++)
+    {
+      if (t->pprev >= &wheel[lvl][0] && t->pprev < &wheel[lvl][SLOTS] && *t->pprev == nullptr)
+      {
+        occupied[lvl] &= ~(1 << (t->pprev - &wheel[lvl][0]));
+      }
+    }
+    t->next = nullptr;
+    t->pprev = nullptr;
+  }
+  void Timer::expire(Timer *t)
+  {
+    stats.fired++;
+    if (t->repeat)
+    {
+      t->expires += t->period;
+      insert(t);
+    }
+    uint16_t gen = t->gen;
+    tq::add([t, gen]
+    {
+      t->_run(gen);
     });
-    if (!is_periodic)
+  }
+  //Find the time of the next slot that needs expiring or cascading, or with
+  //exact set, the earliest deadline of any timer
+  bool Timer::next_event(uint32_t &at, bool exact)
+  {
+    bool found = false;
+    uint32_t best = 0;
+    for (int lvl = 0; lvl < LEVELS; lvl++)
     {
-      self.reset(); //undangle ourselves to be deconstructed
+      if (occupied[lvl] == 0)
+      {
+        continue;
+      }
+      int shift = LVL_BITS * lvl;
+      int cur = (clk >> shift) & (SLOTS - 1);
+      uint16_t r = rotr16(occupied[lvl], cur);
+      uint32_t k;
+      if (lvl == 0)
+      {
+        k = __builtin_ctz(r);
+      }
+      else
+      {
+        //The current slot of a higher level has already been cascaded, so
+        //a timer there is waiting for the slot to come round again
+        k = (r & ~1) ? __builtin_ctz(r & ~1) : SLOTS;
+      }
+      uint32_t t;
+      if (lvl == 0)
+      {
+        t = clk + k;
+      }
+      else if (exact)
+      {
+        //Every timer in the first occupied slot of a level expires before
+        //those in later slots, so its earliest is the level's earliest
+        Timer *n = wheel[lvl][(cur + k) & (SLOTS - 1)];
+        t = n->expires;
+        for (n = n->next; n != nullptr; n = n->next)
+        {
+          if (n->expires - clk < t - clk)
+          {
+            t = n->expires;
+          }
+        }
+      }
+      else
+      {
+        t = ((clk >> shift) + k) << shift;
+      }
+      if (!found || t - clk < best - clk)
+      {
+        best = t;
+        found = true;
+      }
+    }
+    at = best;
+    return found;
+  }
+  //Expire and cascade every slot that is due by now
+  void Timer::process(uint32_t now)
+  {
+    uint32_t at;
+    while (next_event(at) && (int32_t)(now - at) >= 0)
+    {
+      clk = at;
+      //Cascade from the top so timers land in lower slots due this pass
+      for (int lvl = LEVELS - 1; lvl >= 0; lvl--)
+      {
+        int shift = LVL_BITS * lvl;
+        if (lvl > 0 && (clk & ((1UL << shift) - 1)) != 0)
+        {
+          continue;
+        }
+        int idx = (clk >> shift) & (SLOTS - 1);
+        Timer *t = wheel[lvl][idx];
+        wheel[lvl][idx] = nullptr;
+        occupied[lvl] &= ~(1 << idx);
+        while (t != nullptr)
+        {
+          Timer *n = t->next;
+          t->next = nullptr;
+          t->pprev = nullptr;
+          if (lvl == 0)
+          {
+            expire(t);
+          }
+          else
+          {
+            insert(t);
+          }
+          t = n;
+        }
+      }
     }
+    clk = now;
   }
-  Timer::Timer(bool periodic, uint32_t ticks, std::shared_ptr<std::function<void(std::shared_ptr<Timer>)>> callback):
-    is_periodic(periodic), callback(callback)
+  //Make sure the kernel timer fires no later than the next event. A wakeup
+  //that turns out to be early (its timers were cancelled) is cheaper than
+  //reprogramming, so the kernel timer is only ever pulled in.
+  void Timer::rearm(uint32_t now)
   {
-    uint32_t rv = _priv::syscall_ex(0x201, ticks, periodic, static_cast<void(*)(Timer*)>(_priv::tmr_callback), this);
+    //Cascades happen on the way in process(), so there is no need to wake
+    //up for them separately
+    uint32_t at;
+    if (!next_event(at, true))
+    {
+      return;
+    }
+    if (kernel_armed && (int32_t)(kernel_at - at) <= 0)
+    {
+      return;
+    }
+    if (kernel_armed)
+    {
+      _priv::syscall_ex(0x205, kernel_id);
+    }
+    int32_t ticks = at - now;
+    if (ticks < 1)
+    {
+      ticks = 1;
+    }
+    uint32_t rv = _priv::syscall_ex(0x201, ticks, 0, static_cast<void(*)(Timer*)>(_priv::tmr_callback), nullptr);
     if (rv == (uint32_t)-1)
     {
       while(1);
     }
-    id = rv;
+    kernel_id = rv;
+    kernel_at = at;
+    kernel_armed = true;
+    stats.kernel_arms++;
+  }
+  void Timer::start(bool repeat, uint32_t ticks, uint32_t slack)
+  {
+    uint32_t now = sys::now();
+    if (occupied[0] == 0 && !kernel_armed)
+    {
+      bool empty = true;
+      for (int lvl = 1; lvl < LEVELS; lvl++)
+      {
+        empty = empty && occupied[lvl] == 0;
+      }
+      if (empty)
+      {
+        clk = now;
+      }
+    }
+    process(now);
+    this->repeat = repeat;
+    period = ticks ? ticks : 1;
+    expires = now + ticks;
+    if (slack != 0)
+    {
+      if (kernel_armed && kernel_at - expires <= slack)
+      {
+        //Ride along with the wakeup that is already programmed
+        expires = kernel_at;
+        stats.coalesced++;
+      }
+      else
+      {
+        //Round up to a power of two boundary so nearby deadlines coincide
+        uint32_t mask = (1UL << (31 - __builtin_clz(slack))) - 1;
+        expires = (expires + mask) & ~mask;
+      }
+    }
+    insert(this);
+    rearm(now);
+  }
+  void Timer::cancel()
+  {
+    if (running)
+    {
+      //Called from our own callback, _run frees us when it returns
+      cancelled = true;
+      unlink(this);
+      return;
+    }
+    unlink(this);
+    release();
+  }
+  void Timer::_run(uint16_t gen)
+  {
+    if (this->gen != gen)
+    {
+      //Cancelled after this callback was queued
+      return;
+    }
+    TRACE(trace::TIMER_RUN, repeat, (uintptr_t)this);
+    running = true;
+    callback(Handle(this));
+    running = false;
+    if (!repeat || cancelled)
+    {
+      release();
+    }
+  }
+  void Timer::_tick()
+  {
+    //The kernel timer can fire well after kernel_at, and timers that fell
+    //due in between should run on this wakeup rather than the next one
+    TRACE(trace::TIMER_TICK, 0, 0);
+    uint32_t now = sys::now();
+    kernel_armed = false;
+    process(now);
+    rearm(now);
   }
   namespace _priv
   {
-    /*
-     I expect this usage of a raw pointer to be safe under the following conditions:
-      - The timer will not be deleted until cancel() is called
-      - Cancel stops the kernel from creating more timer callbacks +
-        also purges any previously issued callbacks from the task queue
-     */
     void tmr_callback(Timer *self)
     {
-      self->fire();
+      Timer::_tick();
     }
-    struct udp_recv_params_t
-    {
-        uint32_t reserved1;
-        uint32_t reserved2;
-        uint8_t* buffer;
-        uint32_t buflen;
-        uint8_t src_address [16];
-        uint32_t port;
-        uint8_t lqi;
-        uint8_t rssi;
-    } __attribute__((__packed__));
   }
   namespace flash
   {
@@ -235,6 +760,17 @@ namespace storm
     {
       return _priv::syscall_ex(shift.code);
     }
+    uint64_t now48()
+    {
+      uint32_t hi = now(SHIFT_16);
+      uint32_t lo = now(SHIFT_0);
+      if ((uint16_t)(lo >> 16) != (uint16_t)hi)
+      {
+        //Bit 16 carried between the two reads
+        hi = now(SHIFT_16);
+      }
+      return (((uint64_t)hi) << 16) | (lo & 0xFFFF);
+    }
     void kick_wdt()
     {
       _priv::syscall_ex(0xb01);
@@ -247,6 +783,54 @@ namespace storm
     const Shift SHIFT_16 = {0x203};
     const Shift SHIFT_48 = {0x204};
   }
+#ifdef STORM_TRACE
+  namespace trace
+  {
+    static_assert((TRACE_RING & (TRACE_RING - 1)) == 0, "TRACE_RING must be a power of two");
+    namespace
+    {
+      Record ring[TRACE_RING];
+      uint32_t emitted = 0;
+    }
+    void emit(uint8_t id, uint8_t a, uint16_t b)
+    {
+      Record &r = ring[emitted & (TRACE_RING - 1)];
+      r.t = sys::now(sys::SHIFT_0);
+      r.id = id;
+      r.a = a;
+      r.b = b;
+      emitted++;
+    }
+    uint32_t count()
+    {
+      return emitted;
+    }
+    size_t read(uint32_t &from, Record *out, size_t n)
+    {
+      if (emitted - from > TRACE_RING)
+      {
+        from = emitted - TRACE_RING;
+      }
+      size_t i = 0;
+      for (; i < n && from != emitted; i++, from++)
+      {
+        out[i] = ring[from & (TRACE_RING - 1)];
+      }
+      return i;
+    }
+    void dump()
+    {
+      uint32_t from = 0;
+      Record r;
+      printf("trace %lu events, %lu lost\n", (unsigned long)emitted,
+        (unsigned long)(emitted > TRACE_RING ? emitted - TRACE_RING : 0));
+      while (read(from, &r, 1))
+      {
+        printf("@t %lu %u %u %u\n", (unsigned long)r.t, r.id, r.a, r.b);
+      }
+    }
+  }
+#endif
 
   template<> std::shared_ptr<UDPSocket> UDPSocket::open(uint16_t port, std::shared_ptr<std::function<void(std::shared_ptr<UDPSocket::Packet>)>> callback)
   {
@@ -269,6 +853,19 @@ namespace storm
   }
   void UDPSocket::_handle(_priv::udp_recv_params_t *recv, char *addrstr)
   {
+    if (view_callback)
+    {
+      PacketView v;
+      v.payload = recv->buffer;
+      v.length = recv->buflen;
+      v.src = recv->src_address;
+      v.strsrc = addrstr;
+      v.port = recv->port;
+      v.lqi = recv->lqi;
+      v.rssi = recv->rssi;
+      view_callback(v);
+      return;
+    }
     auto rv = std::make_shared<Packet>();
     rv->payload = std::string(reinterpret_cast<const char*>(recv->buffer), static_cast<size_t>(recv->buflen));
     rv->strsrc = std::string(addrstr);
@@ -278,8 +875,26 @@ namespace storm
     rv->rssi = recv->rssi;
     (*callback)(rv);
   }
+  buf_t UDPSocket::PacketView::copy() const
+  {
+    buf_t rv = mkbuf_pooled(length);
+    if (rv)
+    {
+      std::memcpy(rv->data(), payload, length);
+    }
+    return rv;
+  }
   UDPSocket::UDPSocket(uint16_t port, std::shared_ptr<std::function<void(std::shared_ptr<UDPSocket::Packet>)>> callback)
     :okay(false), callback(callback)
+  {
+    bind(port);
+  }
+  UDPSocket::UDPSocket(uint16_t port, std::function<void(PacketView const&)> view_callback)
+    :okay(false), view_callback(view_callback)
+  {
+    bind(port);
+  }
+  void UDPSocket::bind(uint16_t port)
   {
     //create
     id = (int32_t) _priv::syscall_ex(0x301);
@@ -321,6 +936,7 @@ namespace storm
   {
     void i2c_wcallback(i2c::I2CWOperation *op, int status)
     {
+      TRACE(trace::I2C_DONE, 0xFF, status);
       tq::add([op, status]
       {
         op->invoke(status);
@@ -328,11 +944,17 @@ namespace storm
     }
     void i2c_rcallback(i2c::I2CROperation *op, int status)
     {
+      TRACE(trace::I2C_DONE, 0xFF, status);
       tq::add([op, status]
       {
         op->invoke(status);
       });
     }
+    void i2c_tcallback(i2c::Transaction *txn, int status)
+    {
+      //Not bounced through tq, the next op should hit the bus right away
+      txn->_complete(status);
+    }
     void flash_wcallback(flash::FlashWOperation *op, int status)
     {
       storm::Timer::once(40*storm::Timer::MILLISECOND, [=](auto)
@@ -363,5 +985,370 @@ namespace storm
       if (code == ARBLST) return "ARBLST";
       return "UNK";
     }
+
+    Transaction::Transaction()
+      : count(0), current(0), failed(0), phase(0), busy(false), locked(false)
+    {
+    }
+    Transaction &Transaction::clear()
+    {
+      if (busy)
+      {
+        printf("i2c transaction cleared while busy\n");
+        while(1);
+      }
+      for (int i = 0; i < count; i++)
+      {
+        ops[i].buf = nullptr;
+      }
+      count = 0;
+      return *this;
+    }
+    Transaction::Op &Transaction::push(uint16_t address, Kind kind)
+    {
+      if (count == I2C_TXN_OPS)
+      {
+        printf("i2c transaction full\n");
+        while(1);
+      }
+      Op &op = ops[count++];
+      op.address = address;
+      op.kind = kind;
+      op.flags = (START | STOP).val;
+      op.wlen = 0;
+      op.length = 0;
+      op.status = NOT_RUN;
+      return op;
+    }
+    void Transaction::set_inline(Op &op, std::initializer_list<uint8_t> bytes)
+    {
+      if (bytes.size() > INLINE_BYTES)
+      {
+        printf("i2c transaction inline write too long\n");
+        while(1);
+      }
+      for (uint8_t b : bytes)
+      {
+        op.wbytes[op.wlen++] = b;
+      }
+    }
+    Transaction &Transaction::write(uint16_t address, buf_t payload, uint16_t length, I2CFlag const &flags)
+    {
+      Op &op = push(address, WRITE);
+      op.flags = flags.val;
+      op.buf = move(payload);
+      op.length = length;
+      return *this;
+    }
+    Transaction &Transaction::write(uint16_t address, std::initializer_list<uint8_t> bytes)
+    {
+      Op &op = push(address, WRITE);
+      set_inline(op, bytes);
+      op.buf = nullptr;
+      return *this;
+    }
+    Transaction &Transaction::read(uint16_t address, buf_t target, uint16_t length, I2CFlag const &flags)
+    {
+      Op &op = push(address, READ);
+      op.flags = flags.val;
+      op.buf = move(target);
+      op.length = length;
+      return *this;
+    }
+    Transaction &Transaction::write_read(uint16_t address, std::initializer_list<uint8_t> reg, buf_t target, uint16_t length)
+    {
+      Op &op = push(address, WRITE_READ);
+      set_inline(op, reg);
+      op.buf = move(target);
+      op.length = length;
+      return *this;
+    }
+    void Transaction::issue()
+    {
+      if (current == count)
+      {
+        failed = count;
+        finish();
+        return;
+      }
+      Op &op = ops[current];
+      TRACE(trace::I2C_ISSUE, current | (phase << 7), op.address);
+      uint32_t rv;
+      if (op.kind == WRITE_READ)
+      {
+        if (phase == 0)
+        {
+          rv = _priv::syscall_ex(0x502, op.address, START.val, &op.wbytes[0], op.wlen, _priv::i2c_tcallback, this);
+        }
+        else
+        {
+          rv = _priv::syscall_ex(0x501, op.address, (RSTART | STOP).val, &(*op.buf)[0], op.length, _priv::i2c_tcallback, this);
+        }
+      }
+      else if (op.kind == READ)
+      {
+        rv = _priv::syscall_ex(0x501, op.address, op.flags, &(*op.buf)[0], op.length, _priv::i2c_tcallback, this);
+      }
+      else if (op.buf)
+      {
+        rv = _priv::syscall_ex(0x502, op.address, op.flags, &(*op.buf)[0], op.length, _priv::i2c_tcallback, this);
+      }
+      else
+      {
+        rv = _priv::syscall_ex(0x502, op.address, op.flags, &op.wbytes[0], op.wlen, _priv::i2c_tcallback, this);
+      }
+      if (rv != 0)
+      {
+        op.status = SYSCALL_ERR;
+        failed = current;
+        finish();
+      }
+    }
+    void Transaction::_complete(int status)
+    {
+      Op &op = ops[current];
+      op.status = status;
+      TRACE(trace::I2C_DONE, current, status);
+      if (status != OK)
+      {
+        failed = current;
+        finish();
+        return;
+      }
+      if (op.kind == WRITE_READ && phase == 0)
+      {
+        phase = 1;
+        op.status = NOT_RUN;
+      }
+      else
+      {
+        phase = 0;
+        current++;
+      }
+      issue();
+    }
+    void Transaction::finish()
+    {
+      TRACE(trace::I2C_FINISH, failed, count);
+      if (locked)
+      {
+        locked = false;
+        lock.release();
+      }
+      tq::add([this]
+      {
+        ondone_fn(*this);
+        busy = false;
+      });
+    }
+  }
+  namespace _priv
+  {
+    void co_callback(co::Routine *r, int status)
+    {
+      r->_wake(status);
+    }
+    void co_i2c_callback(co::Routine *r, int status)
+    {
+      TRACE(trace::I2C_DONE, 0xFF, status);
+      r->_wake(status);
+    }
+    void co_flash_wcallback(co::Routine *r, int status)
+    {
+      //Same settling delay as flash_wcallback
+      storm::Timer::once(40*storm::Timer::MILLISECOND, [r, status](auto)
+      {
+        r->_wake(status);
+      });
+    }
+  }
+  namespace co
+  {
+    namespace
+    {
+      alignas(std::max_align_t) uint8_t frames[CO_POOL][CO_FRAME_SIZE];
+      uint32_t frames_used;
+      static_assert(CO_POOL <= 32, "frames_used is a 32 bit mask");
+    }
+    Stats stats;
+    void *_priv::alloc_frame()
+    {
+      for (int i = 0; i < CO_POOL; i++)
+      {
+        if (!(frames_used & (1UL << i)))
+        {
+          frames_used |= 1UL << i;
+          if (++stats.frames_in_use > stats.frames_high_water)
+          {
+            stats.frames_high_water = stats.frames_in_use;
+          }
+          return frames[i];
+        }
+      }
+      printf("coroutine frames exhausted\n");
+      while(1);
+    }
+
+    Routine::Routine()
+      : result(0), _pooled(false), status(0), _pc(0), parent(nullptr), irq_idx(0), irq_spec(0), active(false)
+    {
+    }
+    void Routine::start(Routine *parent)
+    {
+      if (active)
+      {
+        printf("coroutine started while running\n");
+        while(1);
+      }
+      active = true;
+      this->parent = parent;
+      _pc = 0;
+      status = 0;
+      result = 0;
+      tq::add([this]
+      {
+        _resume();
+      });
+    }
+    void Routine::_wake(int status)
+    {
+      this->status = status;
+      tq::add([this]
+      {
+        _resume();
+      });
+    }
+    void Routine::_resume()
+    {
+      stats.resumes++;
+      if (body())
+      {
+        finish();
+      }
+    }
+    void Routine::finish()
+    {
+      Routine *p = parent;
+      int rv = result;
+      active = false;
+      io = nullptr;
+      if (_pooled)
+      {
+        uint8_t *frame = reinterpret_cast<uint8_t*>(this);
+        this->~Routine();
+        frames_used &= ~(1UL << ((frame - &frames[0][0]) / CO_FRAME_SIZE));
+        stats.frames_in_use--;
+      }
+      if (p)
+      {
+        p->_wake(rv);
+      }
+    }
+    void Routine::sleep(uint32_t ticks)
+    {
+      Timer::once(ticks, [this](auto)
+      {
+        status = 0;
+        _resume();
+      });
+    }
+    void Routine::acquire(util::Resource &resource)
+    {
+      resource.acquire([this]
+      {
+        status = 0;
+        _resume();
+      });
+    }
+    void Routine::i2c_write(uint16_t address, i2c::I2CFlag const &flags, buf_t payload, uint16_t length)
+    {
+      io = move(payload);
+      TRACE(trace::I2C_ISSUE, 0xFF, address);
+      if (storm::_priv::syscall_ex(0x502, address, flags.val, &(*io)[0], length, storm::_priv::co_i2c_callback, this))
+      {
+        _wake(i2c::SYSCALL_ERR);
+      }
+    }
+    void Routine::i2c_write(uint16_t address, i2c::I2CFlag const &flags, std::initializer_list<uint8_t> bytes)
+    {
+      uint8_t n = 0;
+      for (uint8_t b : bytes)
+      {
+        if (n == sizeof(wbytes))
+        {
+          printf("coroutine inline write too long\n");
+          while(1);
+        }
+        wbytes[n++] = b;
+      }
+      TRACE(trace::I2C_ISSUE, 0xFF, address);
+      if (storm::_priv::syscall_ex(0x502, address, flags.val, &wbytes[0], n, storm::_priv::co_i2c_callback, this))
+      {
+        _wake(i2c::SYSCALL_ERR);
+      }
+    }
+    void Routine::i2c_read(uint16_t address, i2c::I2CFlag const &flags, buf_t target, uint16_t length)
+    {
+      io = move(target);
+      TRACE(trace::I2C_ISSUE, 0xFF, address);
+      if (storm::_priv::syscall_ex(0x501, address, flags.val, &(*io)[0], length, storm::_priv::co_i2c_callback, this))
+      {
+        _wake(i2c::SYSCALL_ERR);
+      }
+    }
+    void Routine::run(i2c::Transaction &txn)
+    {
+      txn.run([this](i2c::Transaction &t)
+      {
+        //Through the task queue, so the body may rerun the same transaction
+        _wake(t.ok() ? i2c::OK : t.status(t.first_error()));
+      });
+    }
+    void Routine::flash_write(uint32_t address, buf_t payload, uint8_t length)
+    {
+      io = move(payload);
+      if (storm::_priv::syscall_ex(0xA02, address, &(*io)[0], length, storm::_priv::co_flash_wcallback, this))
+      {
+        _wake(i2c::SYSCALL_ERR);
+      }
+    }
+    void Routine::flash_read(uint32_t address, buf_t target, uint8_t length)
+    {
+      io = move(target);
+      if (storm::_priv::syscall_ex(0xA01, address, &(*io)[0], length, storm::_priv::co_callback, this))
+      {
+        _wake(i2c::SYSCALL_ERR);
+      }
+    }
+    void Routine::wait_irq(gpio::Pin pin, gpio::Edge edge, uint32_t ticks)
+    {
+      gpio::disable_irq(pin);
+      irq_idx = pin.idx;
+      irq_spec = pin.spec;
+      storm::_priv::irq_waiters[irq_idx] = this;
+      storm::_priv::syscall_ex(0x106, pin.spec, edge.edge, static_cast<void(*)(uint32_t)>(storm::_priv::irq_callback), pin.idx);
+      if (ticks != 0)
+      {
+        timeout = Timer::once(ticks, [this](auto)
+        {
+          storm::_priv::irq_waiters[irq_idx] = nullptr;
+          storm::_priv::syscall_ex(0x108, irq_spec);
+          status = TIMEOUT;
+          _resume();
+        });
+      }
+    }
+    void Routine::_irq()
+    {
+      storm::_priv::irq_waiters[irq_idx] = nullptr;
+      storm::_priv::syscall_ex(0x108, irq_spec);
+      timeout.cancel();
+      _wake(0);
+    }
+    void Routine::call(Routine *child)
+    {
+      child->start(this);
+    }
   }
 }
+
@@ -1,34 +1,249 @@
 #ifndef __LIBSTORM_H__
 #define __LIBSTORM_H__
 #include <memory>
+#include <new>
+#include <cstddef>
 #include <functional>
 #include <queue>
+#include <vector>
+#include <string>
 #include <stdio.h>
 using std::move;
 namespace storm
 {
-  using buf_t = std::shared_ptr<std::vector<uint8_t>>;
-  std::shared_ptr<std::vector<uint8_t>> mkbuf(size_t size);
-  std::shared_ptr<std::vector<uint8_t>> mkbuf(std::initializer_list<uint8_t> contents);
+  /**
+   * A byte buffer with its header and payload in one block. Blocks come from
+   * fixed size-class pools (see bufpool) and fall back to the heap only when
+   * the request is larger than the biggest class or its pool is empty.
+   */
+  class Buffer
+  {
+  public:
+    Buffer(uint16_t length, uint8_t pool) : refs(1), length(length), pool(pool) {}
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+    uint8_t *data() { return reinterpret_cast<uint8_t*>(this + 1); }
+    const uint8_t *data() const { return reinterpret_cast<const uint8_t*>(this + 1); }
+    uint8_t &operator[](size_t i) { return data()[i]; }
+    const uint8_t &operator[](size_t i) const { return data()[i]; }
+    size_t size() const { return length; }
+    uint8_t *begin() { return data(); }
+    uint8_t *end() { return data() + length; }
+    uint16_t refs;
+    const uint16_t length;
+    const uint8_t pool;
+  private:
+    uint8_t _pad[3];
+  };
+  namespace _priv
+  {
+    void buf_free(Buffer *b);
+  }
+  //Intrusively reference counted handle to a Buffer
+  class BufPtr
+  {
+  public:
+    BufPtr() : b(nullptr) {}
+    BufPtr(std::nullptr_t) : b(nullptr) {}
+    explicit BufPtr(Buffer *b) : b(b) {}
+    BufPtr(BufPtr const &o) : b(o.b)
+    {
+      if (b) b->refs++;
+    }
+    BufPtr(BufPtr &&o) : b(o.b)
+    {
+      o.b = nullptr;
+    }
+    ~BufPtr()
+    {
+      reset();
+    }
+    BufPtr &operator=(BufPtr const &o)
+    {
+      if (o.b) o.b->refs++;
+      reset();
+      b = o.b;
+      return *this;
+    }
+    BufPtr &operator=(BufPtr &&o)
+    {
+      if (this != &o)
+      {
+        reset();
+        b = o.b;
+        o.b = nullptr;
+      }
+      return *this;
+    }
+    void reset()
+    {
+      if (b && --b->refs == 0)
+      {
+        _priv::buf_free(b);
+      }
+      b = nullptr;
+    }
+    Buffer &operator*() const { return *b; }
+    Buffer *operator->() const { return b; }
+    Buffer *get() const { return b; }
+    explicit operator bool() const { return b != nullptr; }
+    bool operator==(std::nullptr_t) const { return b == nullptr; }
+    bool operator!=(std::nullptr_t) const { return b != nullptr; }
+  private:
+    Buffer *b;
+  };
+  using buf_t = BufPtr;
+  buf_t mkbuf(size_t size);
+  buf_t mkbuf(std::initializer_list<uint8_t> contents);
+  //From the pools only, null rather than going to the heap
+  buf_t mkbuf_pooled(size_t size);
+
+  namespace bufpool
+  {
+    //Payload sizes: register access, short writes, the 70 byte sample read
+    //and the 128 byte firmware upload chunk
+    constexpr int CLASSES = 4;
+    struct Stats
+    {
+      uint16_t size;
+      uint16_t count;
+      uint16_t in_use;
+      uint16_t high_water;
+      //Requests that found this class, the smallest that fits them, empty.
+      //mkbuf then goes to the heap (see heap_allocs) and mkbuf_pooled
+      //returns null.
+      uint32_t exhausted;
+    };
+    Stats const &stats(int cls);
+    //Buffers that came from the heap, including ones too big for any class
+    extern uint32_t heap_allocs;
+    void report();
+  }
 
   namespace _priv
   {
+#ifdef STORM_SIM
+    //Provided by the simulated kernel in storm_sim.cc
+    uint32_t syscall_ex(uint32_t number, ...);
+#else
     uint32_t __attribute__((naked)) syscall_ex(...);
+#endif
+  }
+  namespace util
+  {
+    /**
+     * A type-erased callable held in N bytes of inline storage, for places
+     * that must not allocate. Anything that does not fit is a compile error.
+     */
+    template <size_t N, typename... Args> class InlineFn
+    {
+    public:
+      InlineFn() : invoke(nullptr), destroy(nullptr) {}
+      InlineFn(const InlineFn&) = delete;
+      InlineFn& operator=(const InlineFn&) = delete;
+      ~InlineFn()
+      {
+        clear();
+      }
+      template <typename T> void emplace(T &&target)
+      {
+        using F = typename std::decay<T>::type;
+        static_assert(sizeof(F) <= N, "Callable too large for its inline slot, capture less or by reference");
+        static_assert(alignof(F) <= alignof(std::max_align_t), "Callable over-aligned for its inline slot");
+        clear();
+        new (storage) F(std::forward<T>(target));
+        invoke = [](void *p, Args... args) { (*static_cast<F*>(p))(args...); };
+        destroy = [](void *p) { static_cast<F*>(p)->~F(); };
+      }
+      void operator()(Args... args)
+      {
+        invoke(storage, args...);
+      }
+      void clear()
+      {
+        if (destroy)
+        {
+          destroy(storage);
+          destroy = nullptr;
+          invoke = nullptr;
+        }
+      }
+      explicit operator bool() const
+      {
+        return invoke != nullptr;
+      }
+    private:
+      void (*invoke)(void*, Args...);
+      void (*destroy)(void*);
+      alignas(std::max_align_t) uint8_t storage[N];
+    };
   }
   namespace tq
   {
-    class Task
+    //Number of tasks that can be queued at once
+#ifndef TQ_CAPACITY
+#define TQ_CAPACITY 32
+#endif
+    //Define TQ_OVERFLOW_DROP to drop tasks that do not fit rather than halt
+    constexpr size_t CAPACITY = TQ_CAPACITY;
+    //Enough for a std::function plus a couple of pointers of capture
+    constexpr size_t SLOT_SIZE = sizeof(std::function<void(void)>) + 2*sizeof(void*);
+
+    //Dispatch latency histogram: 0 ticks, then [2^(i-1), 2^i) ticks in
+    //bucket i, the last open ended (2^10 ticks is 2.7 ms)
+    constexpr int LATENCY_BUCKETS = 12;
+
+    //A queued callable, stored inline so that queueing never touches the heap
+    class Task : public util::InlineFn<SLOT_SIZE>
     {
     public:
-      Task(std::shared_ptr<std::function<void(void)>> target) : target(target){}
       void fire();
-    private:
-      const std::shared_ptr<std::function<void(void)>> target;
+      //Tick it was queued at, once stamped (see Stats)
+      uint32_t queued;
+      bool stamped;
+    };
+    /**
+     * Counters kept as tasks are queued and run, always on. They cost one
+     * clock read per task run and one per wakeup: a task queued by another
+     * is stamped with the time that one started, and one queued by a kernel
+     * callback with the time the scheduler woke to it. Times are in ticks.
+     */
+    struct Stats
+    {
+      uint32_t added;
+      uint32_t overflows;
+      uint16_t depth;
+      uint16_t max_depth;
+      uint32_t ran;
+      //From being queued to starting to run
+      uint32_t latency[LATENCY_BUCKETS];
+      uint32_t max_latency;
+      //Longest a single task has run
+      uint32_t max_run;
+      //Running tasks, and blocked in wait(). Kernel callbacks delivered
+      //during the wait (IRQs, i2c completions) count as idle.
+      uint64_t busy;
+      uint64_t idle;
     };
-    extern std::queue<Task> dyn_tq;
+    extern Stats stats;
+    //Start the counters over, except depth
+    void clear_stats();
+    void report();
+    //Returns the slot at the tail of the queue, or nullptr if it is full
+    Task *reserve();
+    void commit();
+    bool run_one();
+    //Block in the kernel until it has callbacks to deliver
+    void wait();
     template <typename T> bool add(T target)
     {
-      dyn_tq.push(Task(std::make_shared<std::function<void(void)>>(target)));
+      Task *slot = reserve();
+      if (slot == nullptr)
+      {
+        return false;
+      }
+      slot->emplace(move(target));
+      commit();
       return true;
     }
     void __attribute__((noreturn)) scheduler();
@@ -41,7 +256,11 @@ namespace storm
       Resource();
       void acquire(std::function<void()>);
       void release();
+      //Waiters that did not fit in the task queue. They stay at the head of
+      //the queue, with the resource free, until the next acquire or release.
+      uint32_t overflows;
     private:
+      bool grant(std::function<void()> &cb);
       bool active;
       std::queue<std::function<void()>> queue;
     };
@@ -115,38 +334,110 @@ namespace storm
     void disable_irq(Pin pin);
   }
 
+  //Number of logical timers that can be armed at once
+#ifndef TIMER_POOL
+#define TIMER_POOL 16
+#endif
+  /**
+   * Logical timers, multiplexed onto a single kernel timer by a hierarchical
+   * timer wheel (8 levels of 16 slots, one tick resolution at level 0).
+   * Timers come from a fixed pool and arming or cancelling one is O(1).
+   * Intervals must be below 2^31 ticks.
+   *
+   * A timer with slack may fire up to that many ticks late, which lets its
+   * deadline be rounded onto one another timer already has so both share a
+   * kernel wakeup.
+   */
   class Timer
   {
   public:
-    Timer() = delete;
+    //A reference to an armed timer that goes stale once the timer is done
+    class Handle
+    {
+    public:
+      Handle() : t(nullptr), gen(0) {}
+      explicit Handle(Timer *t) : t(t), gen(t->gen) {}
+      bool active() const
+      {
+        return t != nullptr && t->gen == gen;
+      }
+      explicit operator bool() const
+      {
+        return active();
+      }
+      void cancel()
+      {
+        if (active())
+        {
+          t->cancel();
+        }
+        t = nullptr;
+      }
+    private:
+      Timer *t;
+      uint16_t gen;
+    };
     Timer(const Timer& that) = delete;
-    template<typename T> static std::shared_ptr<Timer> once(uint32_t ticks, T callback)
+    template<typename T> static Handle once(uint32_t ticks, T callback, uint32_t slack = 0)
     {
-      auto rv = std::shared_ptr<Timer>(new Timer(false, ticks, std::make_shared<std::function<void(std::shared_ptr<Timer>)>>(callback)));
-      rv->self = rv; //Circle reference, we cannot be deconstructed
-      return rv;
+      Timer *t = alloc();
+      t->callback.emplace(move(callback));
+      t->start(false, ticks, slack);
+      return Handle(t);
     }
-    template<typename T> static std::shared_ptr<Timer> periodic(uint32_t ticks, T callback)
+    template<typename T> static Handle periodic(uint32_t ticks, T callback, uint32_t slack = 0)
     {
-      auto rv = std::shared_ptr<Timer>(new Timer(true, ticks, std::make_shared<std::function<void(std::shared_ptr<Timer>)>>(callback)));
-      rv->self = rv; //Circle reference, we cannot be deconstructed
-      return rv;
+      Timer *t = alloc();
+      t->callback.emplace(move(callback));
+      t->start(true, ticks, slack);
+      return Handle(t);
     }
 
+    //Stops the timer and drops any of its callbacks that are already queued
     void cancel();
-    void fire();
+    //Run from the task queue when the timer expires
+    void _run(uint16_t gen);
+    //Called from the kernel timer
+    static void _tick();
     static constexpr uint32_t MILLISECOND = 375;
     static constexpr uint32_t SECOND = MILLISECOND*1000;
     static constexpr uint32_t MINUTE = SECOND*60;
     static constexpr uint32_t HOUR = MINUTE*60;
 
+    struct Stats
+    {
+      uint16_t active;
+      uint16_t high_water;
+      uint32_t fired;
+      //Times the kernel timer was (re)programmed
+      uint32_t kernel_arms;
+      //Timers whose deadline was moved onto an existing wakeup
+      uint32_t coalesced;
+    };
+    static Stats stats;
 
   private:
-    Timer(bool periodic, uint32_t ticks, std::shared_ptr<std::function<void(std::shared_ptr<Timer>)>> callback);
-    uint16_t id;
-    bool is_periodic;
-    const std::shared_ptr<std::function<void(std::shared_ptr<Timer>)>> callback;
-    std::shared_ptr<Timer> self;
+    Timer() : next(nullptr), pprev(nullptr), gen(0), repeat(false), running(false), cancelled(false) {}
+    static Timer *alloc();
+    void start(bool repeat, uint32_t ticks, uint32_t slack);
+    void release();
+    static void insert(Timer *t);
+    static void unlink(Timer *t);
+    static void expire(Timer *t);
+    static bool next_event(uint32_t &at, bool exact = false);
+    static void process(uint32_t now);
+    static void rearm(uint32_t now);
+    static Timer pool[TIMER_POOL];
+
+    util::InlineFn<tq::SLOT_SIZE, Handle> callback;
+    Timer *next;
+    Timer **pprev;
+    uint32_t expires;
+    uint32_t period;
+    uint16_t gen;
+    bool repeat;
+    bool running;
+    bool cancelled;
   };
   namespace sys
   {
@@ -155,16 +446,85 @@ namespace storm
     };
     uint32_t now();
     uint32_t now(Shift shift);
+    //The low 48 bits of the tick counter, consistent across a carry
+    uint64_t now48();
     void reset();
     void kick_wdt();
     extern const Shift SHIFT_0;
     extern const Shift SHIFT_16;
     extern const Shift SHIFT_48;
   }
+  /**
+   * A ring of timestamped events from the scheduler, timers, IRQs and i2c,
+   * for finding out where the time between them goes. Build with
+   * -DSTORM_TRACE to record, otherwise TRACE() compiles to nothing.
+   *
+   * Each event is 8 bytes: the tick it happened at, its id and two id
+   * specific arguments. The ring keeps the last TRACE_RING of them and
+   * events are numbered from boot, so a reader can pick up where it left off
+   * and tell how many it missed. tracetool renders them on the host.
+   */
+  namespace trace
+  {
+    //Event ids, with what a and b carry
+    enum : uint8_t
+    {
+      TQ_ADD = 1,       //queue depth after, tasks added (low 16 bits)
+      TQ_RUN = 2,       //queue depth before, slot
+      TQ_DONE = 3,      //queue depth after
+      TIMER_TICK = 4,   //kernel timer wakeup
+      TIMER_RUN = 5,    //repeating, timer (low bits of its address)
+      IRQ = 6,          //pin index
+      I2C_ISSUE = 7,    //op index | phase << 7 (0xFF outside a transaction), address
+      I2C_DONE = 8,     //op index (0xFF outside a transaction), status
+      I2C_FINISH = 9,   //first failed op (ops if none), ops
+      GANG = 10,        //path, trigger pulse in ticks
+      SHOT_IRQ = 11,    //path, ticks since the trigger
+      SHOT_TIMEOUT = 12,//path
+      SHOT_READOUT = 13,//path, ops in the readout transaction
+      SHOT_DONE = 14,   //path, status of the capture read
+      //Ids from here up are the application's own
+      USER = 0x80,
+    };
+    struct Record
+    {
+      uint32_t t;
+      uint8_t id;
+      uint8_t a;
+      uint16_t b;
+    };
+#ifdef STORM_TRACE
+    //Events kept, a power of two
+#ifndef TRACE_RING
+#define TRACE_RING 256
+#endif
+    void emit(uint8_t id, uint8_t a, uint16_t b);
+    //Events emitted since boot
+    uint32_t count();
+    //Copy out up to n events starting at number from, or at the oldest still
+    //held if that has been overwritten. from is moved past those copied.
+    size_t read(uint32_t &from, Record *out, size_t n);
+    //Print the events held, one line each, for tracetool
+    void dump();
+#define TRACE(id, a, b) storm::trace::emit((id), (uint8_t)(a), (uint16_t)(b))
+#else
+#define TRACE(id, a, b) do {} while (0)
+#endif
+  }
   class UDPSocket;
   namespace _priv
   {
-    struct udp_recv_params_t;
+    struct udp_recv_params_t
+    {
+        uint32_t reserved1;
+        uint32_t reserved2;
+        uint8_t* buffer;
+        uint32_t buflen;
+        uint8_t src_address [16];
+        uint32_t port;
+        uint8_t lqi;
+        uint8_t rssi;
+    } __attribute__((__packed__));
     void udp_callback(UDPSocket *sock, udp_recv_params_t *recv, char *addrstr);
   }
   class UDPSocket
@@ -180,6 +540,25 @@ namespace storm
       uint8_t lqi;
       uint8_t rssi;
     };
+    /**
+     * A received datagram where the kernel left it, for sockets opened with
+     * open_view(). It is only valid until the callback returns; copy() what
+     * must outlive it.
+     */
+    class PacketView
+    {
+    public:
+      const uint8_t *payload;
+      size_t length;
+      const uint8_t *src;
+      //The kernel's text form of src
+      const char *strsrc;
+      uint16_t port;
+      uint8_t lqi;
+      uint8_t rssi;
+      //The payload in a pooled buffer, or null if no pool can take it
+      buf_t copy() const;
+    };
     template<typename T> static std::shared_ptr<UDPSocket> open(uint16_t port, T callback)
     {
       auto rv = std::shared_ptr<UDPSocket>(new UDPSocket(port, std::make_shared<std::function<void(std::shared_ptr<Packet>)>>(callback)));
@@ -190,6 +569,18 @@ namespace storm
       rv->self = rv; //Circle reference, we cannot be deconstructed
       return rv;
     }
+    //The same, but the callback gets a PacketView of each datagram rather
+    //than a copy, so receiving allocates nothing
+    template<typename T> static std::shared_ptr<UDPSocket> open_view(uint16_t port, T callback)
+    {
+      auto rv = std::shared_ptr<UDPSocket>(new UDPSocket(port, std::function<void(PacketView const&)>(callback)));
+      if (!rv->okay)
+      {
+        return std::shared_ptr<UDPSocket>();
+      }
+      rv->self = rv; //Circle reference, we cannot be deconstructed
+      return rv;
+    }
     void close();
     void _handle(_priv::udp_recv_params_t *recv, char *addrstr);
     bool sendto(const std::string &addr, uint16_t port, const std::string &payload);
@@ -197,9 +588,12 @@ namespace storm
     bool sendto(const std::string &addr, uint16_t port, buf_t payload, size_t length);
   private:
     UDPSocket(uint16_t port, std::shared_ptr<std::function<void(std::shared_ptr<Packet>)>> callback);
+    UDPSocket(uint16_t port, std::function<void(PacketView const&)> view_callback);
+    void bind(uint16_t port);
     int32_t id;
     bool okay;
     const std::shared_ptr<std::function<void(std::shared_ptr<Packet>)>> callback;
+    const std::function<void(PacketView const&)> view_callback;
     std::shared_ptr<UDPSocket> self;
   };
   namespace flash
@@ -268,11 +662,13 @@ namespace storm
   {
     class I2CWOperation;
     class I2CROperation;
+    class Transaction;
   }
   namespace _priv
   {
     void i2c_wcallback(i2c::I2CWOperation *op, int status);
     void i2c_rcallback(i2c::I2CROperation *op, int status);
+    void i2c_tcallback(i2c::Transaction *txn, int status);
   }
   namespace i2c
   {
@@ -281,7 +677,7 @@ namespace storm
     class I2CFlag
     {
     public:
-      constexpr I2CFlag operator| (I2CFlag const& rhs)
+      constexpr I2CFlag operator| (I2CFlag const& rhs) const
       {
         return I2CFlag{val+rhs.val};
       }
@@ -322,6 +718,7 @@ namespace storm
     };
     template <typename T> std::shared_ptr<I2CWOperation> write(uint16_t address, I2CFlag const &flags, buf_t payload, uint16_t length, T callback)
     {
+      TRACE(trace::I2C_ISSUE, 0xFF, address);
       auto rv = std::make_shared<I2CWOperation>(move(payload), std::function<void(int, buf_t)>(callback));
       rv->self = rv; //circular reference to prevent dealloc.
       int sysrv = _priv::syscall_ex(0x502, address, flags.val, &((*rv->payload)[0]), length, _priv::i2c_wcallback, rv.get());
@@ -329,6 +726,7 @@ namespace storm
     }
     template <typename T> std::shared_ptr<I2CROperation> read(uint16_t address, I2CFlag const &flags, buf_t target, uint16_t length, T callback)
     {
+      TRACE(trace::I2C_ISSUE, 0xFF, address);
       auto rv = std::make_shared<I2CROperation>(move(target), length, std::function<void(int, buf_t)>(callback));
       rv->self = rv; //circular reference to prevent dealloc.
       int sysrv = _priv::syscall_ex(0x501, address, flags.val, &((*rv->payload)[0]), length, _priv::i2c_rcallback, rv.get());
@@ -355,7 +753,244 @@ namespace storm
     constexpr int ARBLST = 4;
     constexpr int SYSCALL_ERR = 5;
     const char* decode(int code);
+
+    //Operations one transaction can hold
+#ifndef I2C_TXN_OPS
+#define I2C_TXN_OPS 8
+#endif
+    /**
+     * A batch of bus operations run back to back under a single acquisition
+     * of the i2c lock, with one completion for the lot. Each operation is
+     * issued straight from the kernel completion of the one before it, so
+     * there is no task queue bounce or lock handoff in between.
+     *
+     * The first failing operation ends the batch and the ones after it are
+     * left at NOT_RUN.
+     *
+     * The transaction must stay alive until its completion has returned, and
+     * may not be run again before then. It is still busy while the
+     * completion runs, since that lives inside it, so a completion that wants
+     * to rerun it has to do so from a task it queues (tq::add).
+     */
+    class Transaction
+    {
+    public:
+      static constexpr int NOT_RUN = -1;
+      //Largest write that can be queued without a buffer
+      static constexpr size_t INLINE_BYTES = 4;
+      Transaction();
+      Transaction(const Transaction&) = delete;
+      //Forget the previous batch and start building a new one
+      Transaction &clear();
+      Transaction &write(uint16_t address, buf_t payload, uint16_t length, I2CFlag const &flags = START | STOP);
+      //A short write (register address plus value) held in the transaction
+      Transaction &write(uint16_t address, std::initializer_list<uint8_t> bytes);
+      Transaction &read(uint16_t address, buf_t target, uint16_t length, I2CFlag const &flags = START | STOP);
+      //Write the register address, then read into target after a repeated start
+      Transaction &write_read(uint16_t address, std::initializer_list<uint8_t> reg, buf_t target, uint16_t length);
+      template <typename T> void run(T ondone)
+      {
+        prepare(move(ondone));
+        lock.acquire([this]
+        {
+          locked = true;
+          issue();
+        });
+      }
+      //For callers that already hold the i2c lock, which is left held
+      template <typename T> void run_locked(T ondone)
+      {
+        prepare(move(ondone));
+        locked = false;
+        issue();
+      }
+      size_t size() const
+      {
+        return count;
+      }
+      int status(size_t i) const
+      {
+        return ops[i].status;
+      }
+      //The payload of a write, or the data of a read
+      buf_t const &result(size_t i) const
+      {
+        return ops[i].buf;
+      }
+      //Index of the operation that ended the batch, or size() if none failed
+      size_t first_error() const
+      {
+        return failed;
+      }
+      bool ok() const
+      {
+        return failed == count;
+      }
+      //Called from the kernel when an operation completes
+      void _complete(int status);
+    private:
+      enum Kind : uint8_t { WRITE, READ, WRITE_READ };
+      struct Op
+      {
+        uint16_t address;
+        uint16_t length;
+        uint8_t flags;
+        Kind kind;
+        uint8_t wlen;
+        uint8_t wbytes[INLINE_BYTES];
+        int status;
+        buf_t buf;
+      };
+      Op &push(uint16_t address, Kind kind);
+      static void set_inline(Op &op, std::initializer_list<uint8_t> bytes);
+      template <typename T> void prepare(T &&ondone)
+      {
+        if (busy)
+        {
+          printf("i2c transaction run while busy\n");
+          while(1);
+        }
+        busy = true;
+        ondone_fn.emplace(move(ondone));
+        current = 0;
+        phase = 0;
+      }
+      void issue();
+      void finish();
+
+      Op ops[I2C_TXN_OPS];
+      uint8_t count;
+      uint8_t current;
+      //Index of the first failed op, or count if none failed
+      uint8_t failed;
+      //0 for the write half of a WRITE_READ, 1 for the read half
+      uint8_t phase;
+      bool busy;
+      bool locked;
+      util::InlineFn<tq::SLOT_SIZE, Transaction&> ondone_fn;
+    };
+  }
+
+  //Coroutine frames available to co::spawn, and the size of each
+#ifndef CO_POOL
+#define CO_POOL 4
+#endif
+#ifndef CO_FRAME_SIZE
+#define CO_FRAME_SIZE 160
+#endif
+  /**
+   * Stackless coroutines for long async sequences, as an alternative to
+   * nesting lambdas. A routine is a class deriving from co::Routine whose
+   * body() is written between CO_BEGIN and CO_END, with CO_AWAIT around each
+   * asynchronous step:
+   *
+   *   bool body() override
+   *   {
+   *     CO_BEGIN
+   *     CO_AWAIT(sleep(100*Timer::MILLISECOND));
+   *     CO_AWAIT(i2c_write(address, i2c::START | i2c::STOP, {reg, 1, val}));
+   *     if (status != i2c::OK) CO_RETURN(status);
+   *     CO_END
+   *   }
+   *
+   * body() is re-entered from the top on every wakeup and jumps back to the
+   * await it left from, so anything that must survive an await has to be a
+   * member rather than a local, and there can be only one CO_AWAIT per line.
+   * Nothing is copied or allocated per step: wakeups go through the task
+   * queue holding just the routine pointer, and i2c, flash and IRQ waits call
+   * into the kernel directly rather than through the allocating wrappers.
+   */
+  namespace co
+  {
+    //status after a wait_irq that timed out
+    constexpr int TIMEOUT = -1;
+
+    class Routine
+    {
+    public:
+      Routine();
+      Routine(const Routine&) = delete;
+      virtual ~Routine() {}
+      //Run from the top, from the task queue. parent is woken when it ends.
+      void start(Routine *parent = nullptr);
+      bool running() const
+      {
+        return active;
+      }
+      //The value passed to CO_RETURN, 0 if it ran off the end
+      int result;
+      //For the kernel and wakeup callbacks
+      void _wake(int status);
+      void _resume();
+      void _irq();
+      bool _pooled;
+    protected:
+      //The body, returns true once finished
+      virtual bool body() = 0;
+
+      //Awaitables. Each arranges for the body to be resumed later, with the
+      //outcome in status.
+      void sleep(uint32_t ticks);
+      void acquire(util::Resource &resource);
+      //The payload or target stays referenced by io until the next await
+      void i2c_write(uint16_t address, i2c::I2CFlag const &flags, buf_t payload, uint16_t length);
+      //A short write held in the routine
+      void i2c_write(uint16_t address, i2c::I2CFlag const &flags, std::initializer_list<uint8_t> bytes);
+      void i2c_read(uint16_t address, i2c::I2CFlag const &flags, buf_t target, uint16_t length);
+      //status is OK or the status of the first failed op
+      void run(i2c::Transaction &txn);
+      void flash_write(uint32_t address, buf_t payload, uint8_t length);
+      void flash_read(uint32_t address, buf_t target, uint8_t length);
+      //One edge on pin, or TIMEOUT after timeout ticks if that is nonzero
+      void wait_irq(gpio::Pin pin, gpio::Edge edge, uint32_t timeout = 0);
+      //Run another routine to completion, status is its result
+      void call(Routine *child);
+
+      //Outcome of the last await
+      int status;
+      //The buffer of the last i2c or flash await, the data after a read
+      buf_t io;
+      uint16_t _pc;
+    private:
+      void finish();
+      Routine *parent;
+      Timer::Handle timeout;
+      uint8_t irq_idx;
+      uint16_t irq_spec;
+      bool active;
+      uint8_t wbytes[i2c::Transaction::INLINE_BYTES];
+    };
+
+    namespace _priv
+    {
+      void *alloc_frame();
+    }
+    //Construct a routine in a pooled frame, it is freed when it finishes
+    template <typename T, typename... Args> T *make(Args&&... args)
+    {
+      static_assert(sizeof(T) <= CO_FRAME_SIZE, "Routine too large for a pooled frame, raise CO_FRAME_SIZE");
+      T *r = new (_priv::alloc_frame()) T(std::forward<Args>(args)...);
+      r->_pooled = true;
+      return r;
+    }
+    //Construct and start a pooled routine with nothing waiting on it
+    template <typename T, typename... Args> void spawn(Args&&... args)
+    {
+      make<T>(std::forward<Args>(args)...)->start();
+    }
+    struct Stats
+    {
+      uint16_t frames_in_use;
+      uint16_t frames_high_water;
+      uint32_t resumes;
+    };
+    extern Stats stats;
   }
 }
 
+#define CO_BEGIN switch (_pc) { case 0:
+#define CO_AWAIT(op) do { _pc = __LINE__; op; return false; case __LINE__:; } while (0)
+#define CO_RETURN(v) do { result = (v); _pc = 0; return true; } while (0)
+#define CO_END } result = 0; _pc = 0; return true;
+
 #endif
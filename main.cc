@@ -3,149 +3,201 @@
 #include "libstorm.h"
 #include "selfcheck.h"
 #include "asic.h"
-#include "math.h"
+#include "tof.h"
+#include "frame.h"
+#include "array.h"
+#include "measure.h"
+#include "boot.h"
+#include "calibration.h"
+#include "wind.h"
+#include "telemetry.h"
+#include "tuning.h"
+#include "interface.h"
 
-#define COUNT_TX (-4)
+//By default a binary statistics record is written for each axis as each of
+//its windows closes. Define to also write every pair as a wind record
+//#define PAIR_OUTPUT
+//Define to publish the statistics and wind records over UDP, packed several
+//to a packet, rather than writing them to stdout
+//#define TELEMETRY_ADDR "ff02::1"
+#define TELEMETRY_PORT 4410
+#define TELEMETRY_SRC_PORT 4411
+//Port for the live tuning protocol in tuning.h, undefine to turn it off
+#define TUNING_PORT 4412
+//Define to print each capture and pair as text instead
+//#define TEXT_OUTPUT
+//...or to write the raw capture records, for the decoder
+//#define RAW_OUTPUT
+//Define with the head shrouded to measure the zero wind offset and TOF delay
+//of every axis once measuring starts. They are kept with the calibration.
+//#define ZERO_WIND
+//Air temperature while zeroing, in 1/1000 degree C
+#define ZERO_TEMP_MC 20000
+//Shots per second per axis, both directions
+#define SAMPLE_RATE 20
+//Statistics window lengths in seconds, 0 for off, and the gust average
+#define STATS_WINDOWS_S {1, 10, 60}
+#define GUST_S 3
+//Face to face distance of the A-B axis in mm
+#define AXIS_MM 150
+//Acoustic path length of the A-B axis in mm, if it differs from AXIS_MM
+//#define AXIS_PATH_MM 150
+//Define to read each capture out a fixed READOUT_DELAY after the trigger
+//rather than on the receiving ASIC's IRQ
+//#define FIXED_READOUT
+//With make CPPFLAGS+=-DSTORM_TRACE, print the event trace this long after
+//boot, for tracetool. It can be read over the tuning port at any time too.
+#define TRACE_DUMP_S 30
+//Print heap, stack and task queue use this often, undefine to turn it off.
+//The task queue counters can also be read over the tuning port.
+#define REPORT_S 60
 
 using namespace storm;
 
 extern void undeffunc();
 
-int ACAL;
-int BCAL;
-int CAL_PULSELEN;
 ChirpASIC asicA = ChirpASIC(gpio::A2, gpio::A0, gpio::D6);
 ChirpASIC asicB = ChirpASIC(gpio::A3, gpio::A1, gpio::D7);
+TransducerArray array;
+MeasurementEngine engine(&array);
+Calibration cal(&array, &engine);
+WindOutput output(&array, &cal);
+WindStats stats[MAX_AXES];
+#ifdef TELEMETRY_ADDR
+Telemetry telemetry;
+#endif
+#ifdef TUNING_PORT
+Tuning tuning(&engine);
+#endif
 
-void do_sample(ChirpASIC *tx, ChirpASIC *rx, std::function<void(buf_t)> ondone)
+//Window lengths follow the pairs per second on each axis, from the shot rate
+void configure_stats(uint32_t shots_per_sec)
 {
-  tx->irq_idle();
-  rx->irq_idle();
-  tx->irq_output();
-  rx->irq_output();
-  tx->set_opmode(MODE_TXRX, [=] () mutable
+  const uint16_t windows[STATS_WINDOWS] = STATS_WINDOWS_S;
+  uint32_t pairs = shots_per_sec / array.npaths();
+  if (pairs == 0)
   {
-    rx->set_opmode(MODE_RX, [=] () mutable
-    {
-      Timer::once(15*Timer::MILLISECOND, [=](auto)
-      {
-        rx->read_sample_data([=](buf_t rx_dat) mutable
-        {
-          ondone(rx_dat);
-        });
-      });
-      tx->gang_irq_active();
-      volatile int i;
-      for (i = 0; i < 100; i++);
-      tx->gang_irq_idle();
-
-
-      //rx->irq_input();
-      //tx->irq_input();
-    });
-  });
-}
-void get_tof(buf_t p, uint32_t calres)
-{
-  auto b = *p;
-  int16_t iz[16];
-  int16_t qz[16];
-  uint64_t magsqr[16];
-  uint64_t magmax = 0;
-  uint16_t tof_sf;
-
-  tof_sf = b[0] + (((uint16_t)b[1]) << 8);
-  for (int i = 0; i < 16; i++)
-  {
-    qz[i] = (int16_t) (b[6+i*4] + (((uint16_t)b[6+ i*4 + 1]) << 8));
-    iz[i] = (int16_t) (b[6+i*4 + 2] + (((uint16_t)b[6+ i*4 + 3]) << 8));
-    magsqr[i] = (uint64_t)(((int64_t)qz[i])*((int64_t)qz[i]) + ((int64_t)iz[i])*((int64_t)iz[i]));
-    if (magsqr[i] > magmax)
-    {
-      magmax = magsqr[i];
-    }
+    pairs = 1;
   }
-  //Now we know the max, find the first index to be greater than half max
-  uint64_t quarter = magmax >> 2;
-  int ei = 0;
-  int si = 0;
-  for (int i = 0; i < 16; i++)
+  for (int k = 0; k < array.naxes(); k++)
   {
-    if (magsqr[i] < quarter)
-    {
-      si = i;
-    }
-    if (magsqr[i] > quarter)
-    {
-      ei = i;
-      break;
-    }
+    stats[k].configure(pairs, windows, GUST_S * pairs);
   }
-  double s = sqrt((double)magsqr[si]);
-  double e = sqrt((double)magsqr[ei]);
-  double h = sqrt((double)quarter);
-  double freq = tof_sf/2048.0*calres/CAL_PULSELEN;
-  double count = si + (h - s)/(e - s);
-  double tof = (count + COUNT_TX) / freq * 8;
+}
 
-  //Now "linearly" interpolate
-  printf("count %d /1000\n", (int)(count*1000));
-  printf("tof_sf %d\n", tof_sf);
-  printf("freq %d uHz\n", (int)(freq*1000));
-  printf("tof %d uS\n", (int)(tof*1000));
-  printf("tof 50us estimate %duS\n", (int)(count*50));
-  for (int i = 0; i < 16; i++)
+//Transducers and axes of this head. For 2D and 3D heads add more ASICs
+//here, all with their IRQ line on PORTB.
+void setup_array()
+{
+  array.add(&asicA, 0x30, 0, 0, 0);
+  array.add(&asicB, 0x40, AXIS_MM, 0, 0);
+  array.add_axis(0, 1);
+  if (!array.finalize())
   {
-    printf("data %d = %d + %di\n", i, qz[i], iz[i]);
+    while(1);
   }
-  printf(".\n");
+#ifdef AXIS_PATH_MM
+  array.set_length(0, AXIS_PATH_MM);
+#endif
 }
-void dopair()
+
+#ifdef TEXT_OUTPUT
+//Wind along each axis this round, and which axes are in
+int32_t along[MAX_AXES];
+uint32_t axes_in;
+#endif
+
+void onpair(Shot const &a2b, Shot const &b2a)
 {
-  do_sample(&asicA, &asicB, [=](buf_t a2b)
+  cal.observe(a2b);
+  cal.observe(b2a);
+#ifdef TEXT_OUTPUT
+  uint16_t pulselen = cal.get_pulselen();
+  TOFResult fwd = get_tof(a2b.data, cal.calres(a2b), pulselen);
+  TOFResult rev = get_tof(b2a.data, cal.calres(b2a), pulselen);
+  print_tof(fwd);
+  print_tof(rev);
+  print_xcorr_tof(get_xcorr_tof(fwd, rev));
+  WindSample w = output.process(a2b.axis, fwd, rev);
+  WindOutput::print(w);
+  along[a2b.axis] = w.wind_mm_s;
+  axes_in |= 1 << a2b.axis;
+  if (axes_in == (1U << array.naxes()) - 1)
+  {
+    int32_t wind[3];
+    array.solve(along, wind);
+    printf("wind %d %d %d mm/s\n", (int)wind[0], (int)wind[1], (int)wind[2]);
+    axes_in = 0;
+  }
+#elif defined(RAW_OUTPUT)
+  uint16_t pulselen = cal.get_pulselen();
+  frame::emit_capture(a2b.triggered, a2b.id(), a2b.data, cal.calres(a2b), pulselen);
+  frame::emit_capture(b2a.triggered, b2a.id(), b2a.data, cal.calres(b2a), pulselen);
+#else
+  WindSample w = output.process(a2b, b2a);
+  if (!w.valid)
+  {
+    return;
+  }
+#ifdef PAIR_OUTPUT
+#ifdef TELEMETRY_ADDR
+  telemetry.publish_wind(a2b.triggered, w.axis, w.wind_mm_s, w.temp_mc);
+#else
+  frame::emit_wind(a2b.triggered, w.axis, w.wind_mm_s, w.temp_mc);
+#endif
+#endif
+  WindStats::Summary sums[STATS_WINDOWS];
+  uint32_t closed = stats[w.axis].add(w.wind_mm_s, w.temp_mc, sums);
+  for (int i = 0; i < STATS_WINDOWS; i++)
   {
-    do_sample(&asicB, &asicA, [=](buf_t b2a)
+    if (closed & (1 << i))
     {
-      get_tof(a2b, BCAL);
-      get_tof(b2a, ACAL);
-    });
-  });
+#ifdef TELEMETRY_ADDR
+      telemetry.publish_stats(a2b.triggered, w.axis, sums[i]);
+#else
+      frame::emit_stats(a2b.triggered, w.axis, sums[i]);
+#endif
+    }
+  }
+#endif
 }
-void calibrate(std::function<void()> ondone)
+//Brings up both ASICs, calibrates them and starts measuring
+class Boot : public co::Routine
 {
-  asicA.irq_idle();
-  asicA.irq_output();
-  asicB.irq_idle();
-  asicB.irq_output();
-  asicA.prime_calibrate([=]
+protected:
+  bool body() override
   {
-    asicB.prime_calibrate([=]
+    CO_BEGIN
+    CO_AWAIT(call(&asics));
+    if (status != i2c::OK)
     {
-        asicA.gang_irq_active();
-        Timer::once(160*Timer::MILLISECOND, [=](auto)
-        {
-          asicA.gang_irq_idle();
-          asicA.read_cal_result([=](int result)
-          {
-            ACAL = result;
-            asicB.read_cal_result([=](int result)
-            {
-              BCAL = result;
-              CAL_PULSELEN = 160; //TODO switch to accurate pulse length
-              asicA.set_maxrange(0x10, [=]
-              {
-                asicB.set_maxrange(0x10, [=]
-                {
-                  printf("both calibrate's finished: A=%d B=%d\n", ACAL, BCAL);
-                  tq::add(ondone);
-                });
-              });
-            });
-          });
-        });
-    });
-  });
-}
+      printf("ASIC bring up failed: %s\n", i2c::decode(status));
+      while(1);
+    }
+    printf("ASICs up:");
+    for (int i = 0; i < array.size(); i++)
+    {
+      printf(" %c %s", 'A' + i, asics.was_warm(i) ? "warm" : "programmed");
+    }
+    printf("\n");
+    CO_AWAIT(call(cal.startup()));
+    printf("Calibrate complete\n");
+#ifndef FIXED_READOUT
+    engine.set_completion(MeasurementEngine::IRQ);
+#endif
+    engine.start(SAMPLE_RATE * array.naxes(), onpair);
+    cal.start_monitor();
+#ifdef ZERO_WIND
+    output.zero(ZERO_TEMP_MC);
+#endif
+    printf("measuring %u ms after boot\n", (unsigned)(sys::now() / Timer::MILLISECOND));
+    CO_END
+  }
+private:
+  AsicBoot asics{&array};
+};
+Boot boot;
+
 int main()
 {
   printf("Anemometer booted\n");
@@ -153,30 +205,54 @@ int main()
   gpio::set_mode(gpio::A5, gpio::OUT);
   gpio::set(gpio::A5, 1);
 
-  asicA.program(0x30, [&](int status)
+#ifdef TOF_CYCLE_BENCH
   {
-    printf("program ASIC A: %s\n", i2c::decode(status));
-    asicA.wait_and_check_ready([&]
+    //make CPPFLAGS+=-DTOF_CYCLE_BENCH, on a capture shaped like a real one
+    static uint8_t raw[70] = {0x00, 0x40};
+    for (int i = 0; i < TOF_BINS; i++)
     {
-      asicB.program(0x40, [&](int status)
-      {
-        printf("program ASIC B: %s\n", i2c::decode(status));
-        asicB.wait_and_check_ready([&]
-        {
-          calibrate([&]
-          {
-            printf("Calibrate complete\n");
-            dopair();
-          });
-        });
-      });
-    });
+      int16_t q = (i - 4) * (i - 4) * 900 - 20000;
+      int16_t in = 12000 - i * 1500;
+      memcpy(&raw[6 + 4*i], &q, 2);
+      memcpy(&raw[8 + 4*i], &in, 2);
+    }
+    tof_cycle_bench(raw);
+  }
+#endif
+  setup_array();
+#ifdef TELEMETRY_ADDR
+  telemetry.open(TELEMETRY_SRC_PORT, TELEMETRY_ADDR, TELEMETRY_PORT);
+#endif
+  configure_stats(SAMPLE_RATE * array.naxes());
+#ifdef TUNING_PORT
+  tuning.open(TUNING_PORT);
+  tuning.on_rate(configure_stats);
+#endif
+  boot.start();
+#ifdef STORM_TRACE
+  Timer::once(TRACE_DUMP_S*Timer::SECOND, [](auto)
+  {
+    trace::dump();
   });
-
+#endif
 
   Timer::periodic(1*Timer::SECOND, [](auto)
   {
     sys::kick_wdt();
   });
+#ifdef REPORT_S
+  Timer::periodic(REPORT_S*Timer::SECOND, [](auto)
+  {
+    static uint32_t last_allocs = 0;
+    mem_stats m;
+    mem_get_stats(&m);
+    printf("mem heap %u/%u live %u peak %u, %u allocs/s, %u sbrk refused, stack %u/%u\n",
+      (unsigned)m.arena, (unsigned)m.arena_limit, (unsigned)m.live, (unsigned)m.peak,
+      (unsigned)((m.allocs - last_allocs) / REPORT_S), (unsigned)m.sbrk_failures,
+      (unsigned)m.stack_used, (unsigned)m.stack_size);
+    last_allocs = m.allocs;
+    tq::report();
+  });
+#endif
   tq::scheduler();
 }
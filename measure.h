@@ -0,0 +1,443 @@
+#ifndef __MEASURE_H__
+#define __MEASURE_H__
+
+#include "libstorm.h"
+#include "asic.h"
+#include "array.h"
+#include "frame.h"
+
+using namespace storm;
+
+//Time from the trigger to reading the capture out of the receiving ASIC, in
+//FIXED_DELAY mode, and the longest wait for its IRQ in IRQ mode. This is the
+//default, see set_readout_delay().
+#define READOUT_DELAY (15*Timer::MILLISECOND)
+#define MIN_READOUT_DELAY (1*Timer::MILLISECOND)
+#define MAX_READOUT_DELAY (100*Timer::MILLISECOND)
+//Longest trigger pulse set_trigger_pulse() takes, as it is spun for
+#define MAX_TRIGGER_PULSE (1*Timer::MILLISECOND)
+//Shot rate limits, in shots per second. Shots alternate A->B and B->A.
+#define MIN_RATE 1
+#define MAX_RATE 100
+//A trigger this far behind its slot counts as late
+#define LATE_TICKS (1*Timer::MILLISECOND)
+
+struct Shot
+{
+  buf_t data;
+  //Timestamp of the trigger, from sys::now48()
+  uint64_t triggered;
+  //frame::PATH_A2B or frame::PATH_B2A, the direction along the axis
+  uint8_t path;
+  uint8_t axis;
+  //Unique over both directions of every axis, below MAX_PATHS
+  uint8_t id() const
+  {
+    return frame::path_id(axis, path);
+  }
+};
+
+/**
+ * Runs shots continuously on a fixed grid of slots, working through the
+ * array's schedule over both directions of every axis. A pair is handed to
+ * the callback once both directions of an axis are in.
+ *
+ * The slot timer only pulses the gang trigger. Everything that touches the
+ * bus happens between slots, as a single i2c::Transaction per shot: the
+ * capture is read out and the opmodes for the next shot are written behind
+ * it, so the next shot is armed well before its slot. The pair callback is
+ * queued behind that so processing overlaps with the wait for the next slot.
+ * If a slot comes round while the previous shot is still in progress the
+ * slot is skipped (an overrun) rather than sliding the grid, so shot phase
+ * stays fixed.
+ *
+ * In IRQ completion mode the receiving ASIC's IRQ line is turned round to an
+ * input after the trigger and its rising edge, which the ASIC raises once
+ * the capture is ready, starts the readout. The readout delay then only
+ * applies as a timeout. In FIXED_DELAY mode the readout always waits for it.
+ *
+ * The readout delay, trigger pulse length and MAX_RANGE can be changed while
+ * running. The first two take effect from the next trigger; a new range is
+ * written to each ASIC behind the opmode when it is next armed, so it is in
+ * everywhere within one pass of the schedule.
+ */
+class MeasurementEngine
+{
+public:
+  struct Stats
+  {
+    uint32_t shots;
+    uint32_t pairs;
+    //Slots skipped because the previous shot had not finished
+    uint32_t overruns;
+    //Triggers more than LATE_TICKS after their slot
+    uint32_t late;
+    uint32_t max_late;
+    //Longest trigger pulse, in ticks, against TRIGGER_PULSE
+    uint32_t max_pulse;
+    //Readout or arming transactions that were not fully acked
+    uint32_t bus_errors;
+    //IRQ mode: completions by IRQ and by timeout, and the trigger to IRQ
+    //latency in ticks
+    uint32_t irqs;
+    uint32_t irq_timeouts;
+    uint32_t last_latency;
+    uint32_t min_latency;
+    uint32_t max_latency;
+    uint64_t total_latency;
+  };
+  enum Completion { FIXED_DELAY, IRQ };
+  MeasurementEngine(TransducerArray *array)
+    : array(array), running(false), state(IDLE), step(0), rate(0), pending_rate(0), stats{},
+      completion(FIXED_DELAY), readout_delay(READOUT_DELAY), trigger_pulse(TRIGGER_PULSE),
+      range(DEFAULT_RANGE), range_dirty(0), range_queued(0), waiting(false)
+  {
+    stats.min_latency = UINT32_MAX;
+    //Made once so that enabling it for every shot does not allocate
+    irq_handler = std::make_shared<std::function<void()>>([this]
+    {
+      this->on_irq();
+    });
+  }
+  //How a shot is known to be complete, takes effect from the next shot
+  void set_completion(Completion mode)
+  {
+    completion = mode;
+  }
+  void start(uint32_t shots_per_sec, std::function<void(Shot const &, Shot const &)> onpair)
+  {
+    this->onpair = onpair;
+    running = true;
+    pending_rate = clamp(shots_per_sec);
+    restart_ticker();
+    //Otherwise a shot from before a stop() is still finishing and arms on
+    //its way out
+    if (state == IDLE)
+    {
+      step = 0;
+      arm();
+    }
+  }
+  void stop()
+  {
+    running = false;
+    ticker.cancel();
+    if (state == ARMED)
+    {
+      state = IDLE;
+    }
+  }
+  //Start again after stop() with the same rate and callback
+  void resume()
+  {
+    start(pending_rate, onpair);
+  }
+  //Stopped, with no shot still finishing, so the ASICs are free
+  bool idle() const
+  {
+    return state == IDLE;
+  }
+  //Takes effect at the next slot boundary
+  void set_rate(uint32_t shots_per_sec)
+  {
+    pending_rate = clamp(shots_per_sec);
+  }
+  //As last set, the ticker picks it up at the next slot
+  uint32_t get_rate() const
+  {
+    return pending_rate;
+  }
+  //In ticks, clamped to MIN_READOUT_DELAY..MAX_READOUT_DELAY
+  void set_readout_delay(uint32_t ticks)
+  {
+    readout_delay = ticks < MIN_READOUT_DELAY ? MIN_READOUT_DELAY :
+                    ticks > MAX_READOUT_DELAY ? MAX_READOUT_DELAY : ticks;
+  }
+  uint32_t get_readout_delay() const
+  {
+    return readout_delay;
+  }
+  //In ticks, clamped to 1..MAX_TRIGGER_PULSE
+  void set_trigger_pulse(uint32_t ticks)
+  {
+    trigger_pulse = ticks < 1 ? 1 : ticks > MAX_TRIGGER_PULSE ? MAX_TRIGGER_PULSE : ticks;
+  }
+  uint32_t get_trigger_pulse() const
+  {
+    return trigger_pulse;
+  }
+  //MAX_RANGE for every ASIC
+  void set_range(uint8_t r)
+  {
+    range = r;
+    range_dirty = (1U << array->size()) - 1;
+  }
+  uint8_t get_range() const
+  {
+    return range;
+  }
+  Stats const &get_stats() const
+  {
+    return stats;
+  }
+private:
+  enum State { IDLE, ARMING, ARMED, IN_FLIGHT };
+
+  static uint32_t clamp(uint32_t r)
+  {
+    if (r < MIN_RATE) return MIN_RATE;
+    if (r > MAX_RATE) return MAX_RATE;
+    return r;
+  }
+  TransducerArray::Path const &path() const
+  {
+    return array->path(step);
+  }
+  //The path in flight as in the frame records, for trace events
+  uint8_t trace_path() const
+  {
+    return (path().axis << 1) | path().dir;
+  }
+  ChirpASIC *tx()
+  {
+    return array->asic(array->tx(path().axis, path().dir));
+  }
+  ChirpASIC *rx()
+  {
+    return array->asic(array->rx(path().axis, path().dir));
+  }
+  void restart_ticker()
+  {
+    ticker.cancel();
+    rate = pending_rate;
+    period = Timer::SECOND / rate;
+    next_slot = sys::now() + period;
+    ticker = Timer::periodic(period, [this](auto)
+    {
+      this->slot();
+    });
+  }
+  //Queue the opmode writes that set up the two ASICs of the next shot
+  void queue_arm()
+  {
+    tx()->irq_idle();
+    rx()->irq_idle();
+    tx()->irq_output();
+    rx()->irq_output();
+    tx()->queue_w_reg(txn, OPMODE, MODE_TXRX);
+    rx()->queue_w_reg(txn, OPMODE, MODE_RX);
+    range_queued = 0;
+    for (int end = 0; end < 2; end++)
+    {
+      uint32_t bit = 1U << array->axis(path().axis).ends[end];
+      if (range_dirty & bit)
+      {
+        array->asic(array->axis(path().axis).ends[end])->queue_w_reg(txn, MAX_RANGE, range);
+        range_dirty &= ~bit;
+        range_queued |= bit;
+      }
+    }
+  }
+  void arm()
+  {
+    state = ARMING;
+    txn.clear();
+    queue_arm();
+    txn.run([this](i2c::Transaction &t)
+    {
+      if (!t.ok())
+      {
+        stats.bus_errors++;
+        range_dirty |= range_queued;
+      }
+      state = running ? ARMED : IDLE;
+    });
+  }
+  void slot()
+  {
+    if (!running)
+    {
+      return;
+    }
+    int32_t late = (int32_t)(sys::now() - next_slot);
+    next_slot += period;
+    //Ahead of the overrun check, so that a lower rate asked for to relieve
+    //an overload is applied while it lasts
+    if (pending_rate != rate)
+    {
+      restart_ticker();
+    }
+    if (state != ARMED)
+    {
+      stats.overruns++;
+      return;
+    }
+    if (late > (int32_t)LATE_TICKS)
+    {
+      stats.late++;
+    }
+    if (late > (int32_t)stats.max_late)
+    {
+      stats.max_late = late;
+    }
+    state = IN_FLIGHT;
+    triggered = sys::now48();
+    uint32_t mask = tx()->gang_bit() | rx()->gang_bit();
+    trigger_ticks = ChirpASIC::gang_pulse_begin(mask);
+    uint32_t pulse = ChirpASIC::gang_pulse_end(mask, trigger_ticks, trigger_pulse);
+    if (pulse > stats.max_pulse)
+    {
+      stats.max_pulse = pulse;
+    }
+    TRACE(trace::GANG, trace_path(), pulse);
+    stats.shots++;
+    if (completion == IRQ)
+    {
+      rx()->irq_input();
+      rx()->enable_irq(irq_handler);
+      waiting = true;
+      timeout = Timer::once(readout_delay, [this](auto)
+      {
+        this->on_timeout();
+      });
+    }
+    else
+    {
+      Timer::once(readout_delay, [this](auto)
+      {
+        this->readout(triggered);
+      });
+    }
+  }
+  void on_irq()
+  {
+    if (!waiting)
+    {
+      return;
+    }
+    waiting = false;
+    timeout.cancel();
+    rx()->disable_irq();
+    uint32_t latency = sys::now() - trigger_ticks;
+    TRACE(trace::SHOT_IRQ, trace_path(), latency);
+    stats.irqs++;
+    stats.last_latency = latency;
+    stats.total_latency += latency;
+    if (latency < stats.min_latency)
+    {
+      stats.min_latency = latency;
+    }
+    if (latency > stats.max_latency)
+    {
+      stats.max_latency = latency;
+    }
+    readout(triggered);
+  }
+  void on_timeout()
+  {
+    if (!waiting)
+    {
+      return;
+    }
+    waiting = false;
+    rx()->disable_irq();
+    stats.irq_timeouts++;
+    TRACE(trace::SHOT_TIMEOUT, trace_path(), 0);
+    readout(triggered);
+  }
+  //Read the capture out and arm for the next shot in the same transaction
+  void readout(uint64_t triggered)
+  {
+    TransducerArray::Path shotpath = path();
+    txn.clear();
+    rx()->queue_r_reg(txn, TOF_SF, 70);
+    step = (step + 1) % array->npaths();
+    bool rearm = running;
+    if (rearm)
+    {
+      queue_arm();
+    }
+    TRACE(trace::SHOT_READOUT, (shotpath.axis << 1) | shotpath.dir, txn.size());
+    txn.run([this, triggered, shotpath, rearm](i2c::Transaction &t)
+    {
+      TRACE(trace::SHOT_DONE, (shotpath.axis << 1) | shotpath.dir, t.status(0));
+      if (!t.ok())
+      {
+        stats.bus_errors++;
+        range_dirty |= range_queued;
+      }
+      if (rearm && t.ok())
+      {
+        state = running ? ARMED : IDLE;
+      }
+      else if (running)
+      {
+        //Restarted meanwhile, or the arming writes failed. txn cannot be
+        //rerun from its own completion so arm from a fresh task.
+        state = ARMING;
+        tq::add([this]{ arm(); });
+      }
+      else
+      {
+        state = IDLE;
+      }
+      if (t.status(0) != i2c::OK)
+      {
+        return;
+      }
+      Shot s{t.result(0), triggered, shotpath.dir, shotpath.axis};
+      Shot *pair = pairs[s.axis];
+      pair[s.path] = s;
+      if (!pair[s.path ^ 1].data)
+      {
+        //Waiting on the other direction, or it was lost to a stop/start or
+        //a bus error and this one waits for the next
+        return;
+      }
+      stats.pairs++;
+      //The next pair on this axis is at least two slots away, so it is
+      //stable until this runs
+      uint8_t axis = s.axis;
+      tq::add([this, axis]
+      {
+        Shot *pair = pairs[axis];
+        onpair(pair[frame::PATH_A2B], pair[frame::PATH_B2A]);
+        pair[0].data = nullptr;
+        pair[1].data = nullptr;
+      });
+    });
+  }
+
+  TransducerArray *array;
+  bool running;
+  State state;
+  //Position in the array's schedule
+  uint8_t step;
+  uint32_t rate;
+  uint32_t pending_rate;
+  uint32_t period;
+  uint32_t next_slot;
+  Stats stats;
+  Completion completion;
+  uint32_t readout_delay;
+  uint32_t trigger_pulse;
+  uint8_t range;
+  //Transducers that still need the new range, and those in txn
+  uint32_t range_dirty;
+  uint32_t range_queued;
+  //Trigger time of the shot in flight, as a timestamp and in ticks
+  uint64_t triggered;
+  uint32_t trigger_ticks;
+  //Waiting on the IRQ or its timeout
+  bool waiting;
+  Timer::Handle timeout;
+  std::shared_ptr<std::function<void()>> irq_handler;
+  //Both directions of each axis, indexed by Shot::path
+  Shot pairs[MAX_AXES][2];
+  //Bus traffic for the current shot, one lock acquisition per shot
+  i2c::Transaction txn;
+  Timer::Handle ticker;
+  std::function<void(Shot const &, Shot const &)> onpair;
+};
+
+#endif
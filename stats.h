@@ -0,0 +1,154 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+
+//Windows summarised side by side on each axis
+#define STATS_WINDOWS 3
+//Longest gust averaging, in samples. Longer gusts are cut to this.
+#define GUST_RING 64
+
+/**
+ * Windowed statistics of the wind along one axis, fed one sample per pair.
+ *
+ * Each of the STATS_WINDOWS windows keeps a fixed point Welford mean and
+ * sum of squares, and closes after its length in samples, handing back a
+ * Summary and starting over. The gust is the largest (by magnitude) running
+ * mean over the gust length, taken from a ring of the last samples with a
+ * running sum. Every update is O(1) whatever the window lengths.
+ */
+class WindStats
+{
+public:
+  struct Summary
+  {
+    //Window length in seconds, and samples in it
+    uint16_t window_s;
+    uint16_t n;
+    int32_t mean_mm_s;
+    uint32_t std_mm_s;
+    int32_t gust_mm_s;
+    //Standard deviation over the magnitude of the mean, parts per thousand
+    uint32_t ti_permil;
+    int32_t temp_mc;
+  };
+  WindStats() : rate(0), gust_len(0), ring{}, head(0), filled(0), ring_sum(0), win{} {}
+  //Samples per second, the length of each window in seconds and of the gust
+  //average in samples. A zero length window is off.
+  void configure(uint16_t rate, const uint16_t window_s[STATS_WINDOWS], uint16_t gust)
+  {
+    this->rate = rate;
+    gust_len = gust > GUST_RING ? GUST_RING : gust < 1 ? 1 : gust;
+    head = filled = 0;
+    ring_sum = 0;
+    for (int i = 0; i < STATS_WINDOWS; i++)
+    {
+      win[i].length = window_s[i] * rate;
+      win[i].window_s = window_s[i];
+      reset(win[i]);
+    }
+  }
+  //Returns a mask of the windows this sample closed, with their summaries in
+  //out
+  uint32_t add(int32_t wind_mm_s, int32_t temp_mc, Summary out[STATS_WINDOWS])
+  {
+    ring_sum += wind_mm_s - ring[head];
+    ring[head] = wind_mm_s;
+    head = head + 1 == gust_len ? 0 : head + 1;
+    if (filled < gust_len)
+    {
+      filled++;
+    }
+    int32_t gust = (int32_t)(ring_sum / filled);
+    uint32_t closed = 0;
+    for (int i = 0; i < STATS_WINDOWS; i++)
+    {
+      Window &w = win[i];
+      if (w.length == 0)
+      {
+        continue;
+      }
+      //Welford, with the mean in Q8 mm/s and the sum of squares in Q16
+      int32_t x = wind_mm_s * 256;
+      w.n++;
+      int32_t delta = x - w.mean_q8;
+      w.mean_q8 += delta / (int32_t)w.n;
+      w.m2_q16 += (int64_t)delta * (x - w.mean_q8);
+      w.temp_sum += temp_mc;
+      if (w.n == 1 || (gust < 0 ? -gust : gust) > (w.gust < 0 ? -w.gust : w.gust))
+      {
+        w.gust = gust;
+      }
+      if (w.n == w.length)
+      {
+        summarise(w, out[i]);
+        reset(w);
+        closed |= 1 << i;
+      }
+    }
+    return closed;
+  }
+private:
+  struct Window
+  {
+    uint16_t length;
+    uint16_t window_s;
+    uint16_t n;
+    int32_t mean_q8;
+    int64_t m2_q16;
+    int64_t temp_sum;
+    int32_t gust;
+  };
+  static void reset(Window &w)
+  {
+    w.n = 0;
+    w.mean_q8 = 0;
+    w.m2_q16 = 0;
+    w.temp_sum = 0;
+    w.gust = 0;
+  }
+  static void summarise(Window const &w, Summary &s)
+  {
+    s.window_s = w.window_s;
+    s.n = w.n;
+    s.mean_mm_s = w.mean_q8 / 256;
+    s.std_mm_s = w.n > 1 ? isqrt64((uint64_t)(w.m2_q16 / (w.n - 1))) / 256 : 0;
+    s.gust_mm_s = w.gust;
+    int32_t mag = s.mean_mm_s < 0 ? -s.mean_mm_s : s.mean_mm_s;
+    s.ti_permil = mag ? (uint32_t)((uint64_t)s.std_mm_s * 1000 / mag) : UINT32_MAX;
+    s.temp_mc = (int32_t)(w.temp_sum / w.n);
+  }
+  static uint32_t isqrt64(uint64_t v)
+  {
+    uint64_t res = 0;
+    uint64_t one = 1ULL << 62;
+    while (one > v)
+    {
+      one >>= 2;
+    }
+    while (one != 0)
+    {
+      if (v >= res + one)
+      {
+        v -= res + one;
+        res = (res >> 1) + one;
+      }
+      else
+      {
+        res >>= 1;
+      }
+      one >>= 2;
+    }
+    return (uint32_t)res;
+  }
+
+  uint16_t rate;
+  uint16_t gust_len;
+  int32_t ring[GUST_RING];
+  uint16_t head;
+  uint16_t filled;
+  int64_t ring_sum;
+  Window win[STATS_WINDOWS];
+};
+
+#endif
@@ -0,0 +1,701 @@
+#include "interface.h"
+#include "libstorm.h"
+#include "storm_sim.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <new>
+
+//Count every heap allocation the payload makes. The simulated kernel itself
+//only allocates at startup, so deltas over a run belong to libstorm.
+void* operator new(size_t size)
+{
+  storm::sim::stats.allocs++;
+  storm::sim::stats.alloc_bytes += size;
+  void *rv = malloc(size ? size : 1);
+  if (rv == nullptr)
+  {
+    abort();
+  }
+  return rv;
+}
+void operator delete(void *ptr) noexcept
+{
+  if (ptr != nullptr)
+  {
+    storm::sim::stats.frees++;
+  }
+  free(ptr);
+}
+void operator delete(void *ptr, size_t) noexcept
+{
+  operator delete(ptr);
+}
+
+namespace storm
+{
+  namespace sim
+  {
+    Stats stats;
+
+    namespace
+    {
+      //The firestorm clocks the external bus at 400kHz. 9 bit times per byte
+      //at 375 ticks per ms is 8.4375 ticks per byte.
+      constexpr uint64_t I2C_TICKS_PER_BYTE_Q4 = 135;
+      constexpr uint64_t FLASH_TICKS = 1 * Timer::MILLISECOND;
+      constexpr int MAX_TIMERS = 64;
+      constexpr int MAX_PINS = 32;
+      constexpr int MAX_SOCKETS = 8;
+      constexpr int MAX_I2C_DEVICES = 16;
+      constexpr size_t MAX_EVENTS = 1024;
+
+      enum EventKind
+      {
+        EV_TIMER,
+        EV_I2C_WRITE,
+        EV_I2C_READ,
+        EV_FLASH_WRITE,
+        EV_FLASH_READ,
+        EV_IRQ,
+        EV_PIN,
+      };
+      //Plain old data so that queueing an event never touches the heap
+      struct Event
+      {
+        uint64_t at;
+        uint64_t seq;
+        EventKind kind;
+        void *cb;
+        void *arg;
+        uint32_t id;
+        uint32_t gen;
+        uint32_t address;
+        uint32_t flags;
+        uint8_t *buf;
+        uint32_t length;
+      };
+      struct KTimer
+      {
+        bool used;
+        bool periodic;
+        uint32_t period;
+        uint32_t gen;
+        void *cb;
+        void *arg;
+      };
+      struct KPin
+      {
+        uint16_t spec;
+        uint8_t dir;
+        uint8_t value;
+        bool irq;
+        uint8_t edge;
+        void *cb;
+        uint32_t arg;
+      };
+      struct KSocket
+      {
+        bool used;
+        uint16_t port;
+        void *cb;
+        void *arg;
+      };
+      struct KDevice
+      {
+        uint16_t address;
+        I2CDevice *dev;
+      };
+
+      uint64_t ticks;
+      uint64_t seq;
+      uint64_t i2c_free_at;
+      Event events[MAX_EVENTS];
+      size_t nevents;
+      KTimer timers[MAX_TIMERS];
+      KPin pins[MAX_PINS];
+      KSocket sockets[MAX_SOCKETS];
+      KDevice devices[MAX_I2C_DEVICES];
+      uint8_t flash[FLASH_SIZE];
+      bool flash_init;
+      std::function<void(const char*, uint16_t, const uint8_t*, size_t)> udp_sink;
+      std::function<void(uint32_t)> gang_hook;
+      //Number of the previous syscall, 0 after a wait
+      uint32_t last_syscall;
+
+      //events[] is a binary min heap on (at, seq)
+      bool before(Event const &a, Event const &b)
+      {
+        return a.at < b.at || (a.at == b.at && a.seq < b.seq);
+      }
+      void push(Event ev)
+      {
+        if (nevents == MAX_EVENTS)
+        {
+          printf("sim: event queue overflow\n");
+          abort();
+        }
+        ev.seq = seq++;
+        size_t i = nevents++;
+        while (i > 0 && before(ev, events[(i-1)/2]))
+        {
+          events[i] = events[(i-1)/2];
+          i = (i-1)/2;
+        }
+        events[i] = ev;
+      }
+      Event pop()
+      {
+        Event rv = events[0];
+        Event last = events[--nevents];
+        size_t i = 0;
+        while (true)
+        {
+          size_t c = 2*i + 1;
+          if (c >= nevents) break;
+          if (c + 1 < nevents && before(events[c+1], events[c])) c++;
+          if (!before(events[c], last)) break;
+          events[i] = events[c];
+          i = c;
+        }
+        if (nevents > 0)
+        {
+          events[i] = last;
+        }
+        return rv;
+      }
+
+      KPin *pin(uint16_t spec)
+      {
+        for (int i = 0; i < MAX_PINS; i++)
+        {
+          if (pins[i].spec == spec)
+          {
+            return &pins[i];
+          }
+        }
+        for (int i = 0; i < MAX_PINS; i++)
+        {
+          if (pins[i].spec == 0)
+          {
+            pins[i].spec = spec;
+            return &pins[i];
+          }
+        }
+        abort();
+      }
+      I2CDevice *device(uint32_t address)
+      {
+        for (int i = 0; i < MAX_I2C_DEVICES; i++)
+        {
+          if (devices[i].dev != nullptr && devices[i].address == address)
+          {
+            return devices[i].dev;
+          }
+        }
+        return nullptr;
+      }
+      uint8_t *flash_ptr()
+      {
+        if (!flash_init)
+        {
+          memset(flash, 0xFF, FLASH_SIZE);
+          flash_init = true;
+        }
+        return flash;
+      }
+
+      uint32_t timer_start(uint32_t period, bool periodic, void *cb, void *arg)
+      {
+        for (int i = 0; i < MAX_TIMERS; i++)
+        {
+          if (!timers[i].used)
+          {
+            KTimer &t = timers[i];
+            t.used = true;
+            t.periodic = periodic;
+            t.period = period;
+            t.gen++;
+            t.cb = cb;
+            t.arg = arg;
+            Event ev = {};
+            ev.at = ticks + period;
+            ev.kind = EV_TIMER;
+            ev.id = i;
+            ev.gen = t.gen;
+            push(ev);
+            return i;
+          }
+        }
+        return (uint32_t)-1;
+      }
+      void timer_cancel(uint32_t id)
+      {
+        if (id < MAX_TIMERS && timers[id].used)
+        {
+          timers[id].used = false;
+          timers[id].gen++;
+        }
+      }
+      uint32_t i2c_start(EventKind kind, uint32_t address, uint32_t flags, uint8_t *buf, uint32_t length, void *cb, void *arg)
+      {
+        //Transfers are serialised on the bus, one address byte plus the payload
+        uint64_t start = i2c_free_at > ticks ? i2c_free_at : ticks;
+        i2c_free_at = start + (((length + 1) * I2C_TICKS_PER_BYTE_Q4) >> 4);
+        Event ev = {};
+        ev.at = i2c_free_at;
+        ev.kind = kind;
+        ev.cb = cb;
+        ev.arg = arg;
+        ev.address = address;
+        ev.flags = flags;
+        ev.buf = buf;
+        ev.length = length;
+        push(ev);
+        return 0;
+      }
+      uint32_t flash_start(EventKind kind, uint32_t address, uint8_t *buf, uint32_t length, void *cb, void *arg)
+      {
+        if (address + length > FLASH_SIZE)
+        {
+          return 1;
+        }
+        Event ev = {};
+        ev.at = ticks + FLASH_TICKS;
+        ev.kind = kind;
+        ev.cb = cb;
+        ev.arg = arg;
+        ev.address = address;
+        ev.buf = buf;
+        ev.length = length;
+        push(ev);
+        return 0;
+      }
+      void dispatch(Event const &ev)
+      {
+        stats.callbacks++;
+        switch (ev.kind)
+        {
+          case EV_TIMER:
+          {
+            KTimer &t = timers[ev.id];
+            if (!t.used || t.gen != ev.gen)
+            {
+              //Cancelled after it was queued
+              stats.callbacks--;
+              return;
+            }
+            stats.timer_fires++;
+            void *cb = t.cb;
+            void *arg = t.arg;
+            if (t.periodic)
+            {
+              Event next = ev;
+              next.at = ticks + t.period;
+              push(next);
+            }
+            else
+            {
+              t.used = false;
+            }
+            reinterpret_cast<void(*)(void*)>(cb)(arg);
+            break;
+          }
+          case EV_I2C_WRITE:
+          case EV_I2C_READ:
+          {
+            stats.i2c_ops++;
+            stats.i2c_bytes += ev.length;
+            I2CDevice *d = device(ev.address);
+            int status = i2c::ANAK;
+            if (d != nullptr)
+            {
+              status = (ev.kind == EV_I2C_WRITE) ?
+                d->write(ev.flags, ev.buf, ev.length) :
+                d->read(ev.flags, ev.buf, ev.length);
+            }
+            reinterpret_cast<void(*)(void*, int)>(ev.cb)(ev.arg, status);
+            break;
+          }
+          case EV_FLASH_WRITE:
+          case EV_FLASH_READ:
+          {
+            stats.flash_ops++;
+            if (ev.kind == EV_FLASH_WRITE)
+            {
+              memcpy(flash_ptr() + ev.address, ev.buf, ev.length);
+            }
+            else
+            {
+              memcpy(ev.buf, flash_ptr() + ev.address, ev.length);
+            }
+            reinterpret_cast<void(*)(void*, int)>(ev.cb)(ev.arg, 0);
+            break;
+          }
+          case EV_IRQ:
+          {
+            reinterpret_cast<void(*)(uint32_t)>(ev.cb)(ev.id);
+            break;
+          }
+          case EV_PIN:
+          {
+            //Outside stimulus rather than a payload callback
+            stats.callbacks--;
+            drive_pin(gpio::Pin{(uint16_t)ev.id, (uint16_t)ev.address}, ev.flags);
+            break;
+          }
+        }
+      }
+    }
+
+    uint64_t now()
+    {
+      return ticks;
+    }
+    bool run(uint64_t duration)
+    {
+      uint64_t until = ticks + duration;
+      while (true)
+      {
+        while(tq::run_one());
+        if (nevents == 0)
+        {
+          return false;
+        }
+        if (events[0].at > until)
+        {
+          ticks = until;
+          return true;
+        }
+        tq::wait();
+      }
+    }
+
+    RegisterDevice::RegisterDevice()
+      : ptr(0)
+    {
+      memset(regs, 0, sizeof(regs));
+    }
+    int RegisterDevice::write(uint32_t flags, const uint8_t *data, uint16_t length)
+    {
+      if (length == 0)
+      {
+        return i2c::OK;
+      }
+      ptr = data[0];
+      for (uint16_t i = 1; i < length; i++)
+      {
+        regs[(uint8_t)(ptr + i - 1)] = data[i];
+      }
+      return i2c::OK;
+    }
+    int RegisterDevice::read(uint32_t flags, uint8_t *data, uint16_t length)
+    {
+      for (uint16_t i = 0; i < length; i++)
+      {
+        data[i] = regs[(uint8_t)(ptr + i)];
+      }
+      return i2c::OK;
+    }
+    void attach_i2c(uint16_t address, I2CDevice *dev)
+    {
+      for (int i = 0; i < MAX_I2C_DEVICES; i++)
+      {
+        if (devices[i].dev == nullptr || devices[i].address == address)
+        {
+          devices[i].address = address;
+          devices[i].dev = dev;
+          return;
+        }
+      }
+      abort();
+    }
+
+    void drive_pin(gpio::Pin p, uint8_t value)
+    {
+      KPin *kp = pin(p.spec);
+      uint8_t old = kp->value;
+      kp->value = value;
+      if (!kp->irq || old == value)
+      {
+        return;
+      }
+      bool rising = value && !old;
+      if (kp->edge == gpio::CHANGE.edge ||
+          (kp->edge == gpio::RISING.edge && rising) ||
+          (kp->edge == gpio::FALLING.edge && !rising))
+      {
+        Event ev = {};
+        ev.at = ticks;
+        ev.kind = EV_IRQ;
+        ev.cb = kp->cb;
+        ev.id = kp->arg;
+        push(ev);
+      }
+    }
+    void drive_pin_after(gpio::Pin p, uint8_t value, uint32_t delay)
+    {
+      Event ev = {};
+      ev.at = ticks + delay;
+      ev.kind = EV_PIN;
+      ev.id = p.idx;
+      ev.address = p.spec;
+      ev.flags = value;
+      push(ev);
+    }
+    void on_gang_trigger(std::function<void(uint32_t)> hook)
+    {
+      gang_hook = hook;
+    }
+    void gang_trigger(uint32_t mask)
+    {
+      if (gang_hook)
+      {
+        gang_hook(mask);
+      }
+    }
+    uint8_t pin_value(gpio::Pin p)
+    {
+      return pin(p.spec)->value;
+    }
+
+    uint8_t *flash_mem()
+    {
+      return flash_ptr();
+    }
+
+    void on_udp_send(std::function<void(const char*, uint16_t, const uint8_t*, size_t)> sink)
+    {
+      udp_sink = sink;
+    }
+    bool deliver_udp(uint16_t port, const uint8_t *payload, size_t length, const uint8_t src[16], uint16_t srcport)
+    {
+      for (int i = 0; i < MAX_SOCKETS; i++)
+      {
+        KSocket &s = sockets[i];
+        if (s.used && s.port == port && s.cb != nullptr)
+        {
+          _priv::udp_recv_params_t recv = {};
+          recv.buffer = const_cast<uint8_t*>(payload);
+          recv.buflen = length;
+          memcpy(recv.src_address, src, 16);
+          recv.port = srcport;
+          char addrstr[40];
+          int o = 0;
+          for (int j = 0; j < 16; j += 2)
+          {
+            o += snprintf(addrstr + o, sizeof(addrstr) - o, j ? ":%x" : "%x", (src[j] << 8) | src[j+1]);
+          }
+          stats.callbacks++;
+          reinterpret_cast<void(*)(void*, _priv::udp_recv_params_t*, char*)>(s.cb)(s.arg, &recv, addrstr);
+          return true;
+        }
+      }
+      return false;
+    }
+  }
+
+  namespace _priv
+  {
+    uint32_t syscall_ex(uint32_t number, ...)
+    {
+      using namespace sim;
+      stats.syscalls++;
+      va_list ap;
+      va_start(ap, number);
+      uint32_t rv = 0;
+      switch (number)
+      {
+        case 0x101: //gpio set_mode
+        {
+          uint32_t dir = va_arg(ap, uint32_t);
+          pin(va_arg(ap, uint32_t))->dir = dir;
+          break;
+        }
+        case 0x102: //gpio set
+        {
+          uint32_t value = va_arg(ap, uint32_t);
+          KPin *kp = pin(va_arg(ap, uint32_t));
+          kp->value = (value == gpio::TOGGLE) ? !kp->value : value;
+          break;
+        }
+        case 0x103: //gpio get
+          rv = pin(va_arg(ap, uint32_t))->value;
+          break;
+        case 0x104: //gpio set_pull
+          break;
+        case 0x106: //gpio enable_irq
+        {
+          KPin *kp = pin(va_arg(ap, uint32_t));
+          kp->edge = va_arg(ap, uint32_t);
+          kp->cb = va_arg(ap, void*);
+          kp->arg = va_arg(ap, uint32_t);
+          kp->irq = true;
+          break;
+        }
+        case 0x108: //gpio disable_irq
+          pin(va_arg(ap, uint32_t))->irq = false;
+          break;
+        case 0x201: //timer start
+        {
+          uint32_t period = va_arg(ap, uint32_t);
+          bool periodic = va_arg(ap, uint32_t) != 0;
+          void *cb = va_arg(ap, void*);
+          void *arg = va_arg(ap, void*);
+          rv = timer_start(period, periodic, cb, arg);
+          break;
+        }
+        case 0x205: //timer cancel
+          timer_cancel(va_arg(ap, uint32_t));
+          break;
+        case 0x202: //now, SHIFT_0
+          if (last_syscall == 0x202)
+          {
+            //Reading the clock back to back is the payload spinning on it
+            ticks++;
+          }
+          rv = (uint32_t) ticks;
+          break;
+        case 0x203: //now, SHIFT_16
+          rv = (uint32_t) (ticks >> 16);
+          break;
+        case 0x204: //now, SHIFT_48
+          rv = (uint32_t) (ticks >> 48);
+          break;
+        case 0x301: //udp socket
+        {
+          rv = (uint32_t)-1;
+          for (int i = 0; i < MAX_SOCKETS; i++)
+          {
+            if (!sockets[i].used)
+            {
+              sockets[i] = KSocket{true, 0, nullptr, nullptr};
+              rv = i;
+              break;
+            }
+          }
+          break;
+        }
+        case 0x302: //udp bind
+        {
+          uint32_t id = va_arg(ap, uint32_t);
+          uint32_t port = va_arg(ap, uint32_t);
+          for (int i = 0; i < MAX_SOCKETS; i++)
+          {
+            if (sockets[i].used && sockets[i].port == port)
+            {
+              rv = (uint32_t)-1;
+            }
+          }
+          if (rv == 0)
+          {
+            sockets[id].port = port;
+          }
+          break;
+        }
+        case 0x303: //udp close
+          sockets[va_arg(ap, uint32_t)].used = false;
+          break;
+        case 0x304: //udp sendto
+        {
+          va_arg(ap, uint32_t);
+          const uint8_t *payload = va_arg(ap, const uint8_t*);
+          size_t length = va_arg(ap, size_t);
+          const char *addr = va_arg(ap, const char*);
+          uint32_t port = va_arg(ap, uint32_t);
+          stats.udp_sent++;
+          if (udp_sink)
+          {
+            udp_sink(addr, port, payload, length);
+          }
+          break;
+        }
+        case 0x305: //udp set callback
+        {
+          uint32_t id = va_arg(ap, uint32_t);
+          sockets[id].cb = va_arg(ap, void*);
+          sockets[id].arg = va_arg(ap, void*);
+          break;
+        }
+        case 0x501: //i2c read
+        case 0x502: //i2c write
+        {
+          uint32_t address = va_arg(ap, uint32_t);
+          uint32_t flags = va_arg(ap, uint32_t);
+          uint8_t *buf = va_arg(ap, uint8_t*);
+          uint32_t length = va_arg(ap, uint32_t);
+          void *cb = va_arg(ap, void*);
+          void *arg = va_arg(ap, void*);
+          rv = i2c_start(number == 0x502 ? EV_I2C_WRITE : EV_I2C_READ, address, flags, buf, length, cb, arg);
+          break;
+        }
+        case 0xA01: //flash read
+        case 0xA02: //flash write
+        {
+          uint32_t address = va_arg(ap, uint32_t);
+          uint8_t *buf = va_arg(ap, uint8_t*);
+          uint32_t length = va_arg(ap, uint32_t);
+          void *cb = va_arg(ap, void*);
+          void *arg = va_arg(ap, void*);
+          rv = flash_start(number == 0xA02 ? EV_FLASH_WRITE : EV_FLASH_READ, address, buf, length, cb, arg);
+          break;
+        }
+        case 0xA03: //flash erase
+          memset(flash_ptr(), 0xFF, FLASH_SIZE);
+          break;
+        case 0xb01: //kick watchdog
+          stats.wdt_kicks++;
+          break;
+        case 0x404: //reset
+          printf("sim: payload requested reset\n");
+          exit(0);
+        default:
+          printf("sim: unknown syscall 0x%x\n", number);
+          abort();
+      }
+      va_end(ap);
+      last_syscall = number;
+      return rv;
+    }
+  }
+}
+
+extern "C" {
+
+void k_wait_callback()
+{
+  using namespace storm::sim;
+  last_syscall = 0;
+  if (nevents == 0)
+  {
+    return;
+  }
+  if (events[0].at > ticks)
+  {
+    ticks = events[0].at;
+  }
+  while (nevents > 0 && events[0].at <= ticks)
+  {
+    dispatch(pop());
+  }
+}
+int32_t k_write(uint32_t fd, uint8_t const *src, uint32_t size)
+{
+  return fwrite(src, 1, size, stdout);
+}
+void k_yield()
+{
+}
+uint8_t k_run_callback()
+{
+  using namespace storm::sim;
+  if (nevents > 0 && events[0].at <= ticks)
+  {
+    dispatch(pop());
+    return 1;
+  }
+  return 0;
+}
+
+}
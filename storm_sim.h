@@ -0,0 +1,103 @@
+#ifndef __STORM_SIM_H__
+#define __STORM_SIM_H__
+
+/**
+ * A deterministic stand-in for the storm kernel so that libstorm can be built
+ * and exercised on a Linux host. Build libstorm.cc with -DSTORM_SIM and link
+ * storm_sim.cc: every syscall_ex lands here instead of in an svc.
+ *
+ * Time is virtual. It only advances when the payload waits for a callback
+ * (k_wait_callback) and it jumps straight to the next pending kernel event,
+ * so a run is reproducible and takes no wall clock time to sleep. The one
+ * exception is a busy wait: each sys::now() that directly follows another
+ * advances the clock by a tick, so spinning on it terminates.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include "libstorm.h"
+
+namespace storm
+{
+  namespace sim
+  {
+    //Kernel ticks, same rate as the firestorm (Timer::MILLISECOND = 375)
+    uint64_t now();
+
+    /**
+     * Run the payload's task queue and the simulated kernel for the given
+     * number of ticks of virtual time. Returns false, leaving the clock at the
+     * last event, if everything went idle (no tasks and no pending kernel
+     * events) before the deadline.
+     */
+    bool run(uint64_t ticks);
+
+    struct Stats
+    {
+      uint64_t syscalls;
+      uint64_t callbacks;
+      uint64_t allocs;
+      uint64_t frees;
+      uint64_t alloc_bytes;
+      uint64_t timer_fires;
+      uint64_t i2c_ops;
+      uint64_t i2c_bytes;
+      uint64_t flash_ops;
+      uint64_t udp_sent;
+      uint64_t wdt_kicks;
+    };
+    extern Stats stats;
+
+    //Models the bytes that go over the bus for one address on the I2C bus
+    class I2CDevice
+    {
+    public:
+      virtual ~I2CDevice() {}
+      virtual int write(uint32_t flags, const uint8_t *data, uint16_t length) = 0;
+      virtual int read(uint32_t flags, uint8_t *data, uint16_t length) = 0;
+    };
+
+    /**
+     * A register file: the first byte of a write sets the register pointer,
+     * the remaining bytes are stored from there. Reads return bytes from the
+     * register pointer onwards.
+     */
+    class RegisterDevice : public I2CDevice
+    {
+    public:
+      RegisterDevice();
+      int write(uint32_t flags, const uint8_t *data, uint16_t length) override;
+      int read(uint32_t flags, uint8_t *data, uint16_t length) override;
+      uint8_t regs[256];
+    private:
+      uint8_t ptr;
+    };
+
+    //Addresses with no device attached answer ANAK
+    void attach_i2c(uint16_t address, I2CDevice *dev);
+
+    //Drive an input pin from outside. Edges fire any enabled GPIO IRQ.
+    void drive_pin(gpio::Pin pin, uint8_t value);
+    //The same, delay ticks from now
+    void drive_pin_after(gpio::Pin pin, uint8_t value, uint32_t delay);
+    //Called when the payload pulses the ASIC gang trigger, which has no
+    //pins of its own in the simulator, so a bench can model the ASICs. The
+    //mask has the PORTB bits of the IRQ lines pulsed.
+    void on_gang_trigger(std::function<void(uint32_t mask)> hook);
+    void gang_trigger(uint32_t mask);
+    //The last value the payload set on a pin
+    uint8_t pin_value(gpio::Pin pin);
+
+    //Raw access to the simulated flash chip
+    uint8_t *flash_mem();
+    constexpr uint32_t FLASH_SIZE = 1 << 20;
+
+    //Called for every datagram the payload sends
+    void on_udp_send(std::function<void(const char *addr, uint16_t port, const uint8_t *payload, size_t length)> sink);
+    //Deliver a datagram to the socket bound to port. Returns false if none is.
+    bool deliver_udp(uint16_t port, const uint8_t *payload, size_t length, const uint8_t src[16], uint16_t srcport);
+  }
+}
+
+#endif
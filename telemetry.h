@@ -0,0 +1,129 @@
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <stdio.h>
+#include <string>
+#include "libstorm.h"
+#include "frame.h"
+#include "stats.h"
+
+using namespace storm;
+
+//UDP payload that fits a single 802.15.4 frame after the MAC and compressed
+//IPv6/UDP headers, so nothing is fragmented across the mesh
+#define TELEMETRY_PAYLOAD 80
+//Longest a record waits in a part filled packet
+#define TELEMETRY_DEADLINE (1*Timer::SECOND)
+#define TELEMETRY_SLACK (50*Timer::MILLISECOND)
+
+/**
+ * Publishes measurement records over UDP, packed several to a datagram.
+ *
+ * A packet is just the frames of frame.h back to back, so anything that
+ * decodes the stdout stream decodes a packet too. Records are encoded
+ * straight into the one preallocated packet buffer: reserve() hands back
+ * room for a record, flushing first if the packet cannot take it, and
+ * commit() adds it. The packet goes out when the next record would not fit
+ * or TELEMETRY_DEADLINE after its first record, whichever is sooner.
+ */
+class Telemetry
+{
+public:
+  struct Stats
+  {
+    uint32_t packets;
+    uint32_t failed;
+    uint32_t records;
+    //Packets sent on the deadline rather than full
+    uint32_t deadline_flushes;
+    uint16_t max_records;
+  };
+  Telemetry() : port(0), len(0), nrec(0), stats{} {}
+  //Bind local_port and send to addr:port from now on
+  bool open(uint16_t local_port, const char *addr, uint16_t port)
+  {
+    sock = UDPSocket::open_view(local_port, [](UDPSocket::PacketView const &) {});
+    if (!sock)
+    {
+      printf("ERR: telemetry socket %u\n", local_port);
+      return false;
+    }
+    dest = addr;
+    this->port = port;
+    return true;
+  }
+  //Room for a record of up to n bytes
+  uint8_t *reserve(size_t n)
+  {
+    if (len + n > TELEMETRY_PAYLOAD)
+    {
+      flush();
+    }
+    return &packet[len];
+  }
+  //Add the n bytes just encoded at reserve()
+  void commit(size_t n)
+  {
+    if (len == 0)
+    {
+      deadline = Timer::once(TELEMETRY_DEADLINE, [this](auto)
+      {
+        if (len)
+        {
+          stats.deadline_flushes++;
+          flush();
+        }
+      }, TELEMETRY_SLACK);
+    }
+    len += n;
+    nrec++;
+  }
+  void flush()
+  {
+    deadline.cancel();
+    if (len == 0)
+    {
+      return;
+    }
+    if (sock && sock->sendto(dest, port, packet, len))
+    {
+      stats.packets++;
+      stats.records += nrec;
+      if (nrec > stats.max_records)
+      {
+        stats.max_records = nrec;
+      }
+    }
+    else
+    {
+      stats.failed++;
+    }
+    len = 0;
+    nrec = 0;
+  }
+  void publish_wind(uint64_t timestamp, uint8_t axis, int32_t wind_mm_s, int32_t temp_mc)
+  {
+    commit(frame::encode_wind(reserve(frame::WIND_LEN), frame::take_seq(), timestamp, axis,
+                              wind_mm_s, temp_mc));
+  }
+  void publish_stats(uint64_t timestamp, uint8_t axis, WindStats::Summary const &s)
+  {
+    commit(frame::encode_stats(reserve(frame::STATS_LEN), frame::take_seq(), timestamp, axis, s));
+  }
+  Stats const &get_stats() const
+  {
+    return stats;
+  }
+private:
+  std::shared_ptr<UDPSocket> sock;
+  //Kept as a string so sendto() does not build one per packet
+  std::string dest;
+  uint16_t port;
+  uint8_t packet[TELEMETRY_PAYLOAD];
+  size_t len;
+  uint16_t nrec;
+  Timer::Handle deadline;
+  Stats stats;
+};
+
+#endif
@@ -0,0 +1,436 @@
+#include "tof.h"
+#include <stdio.h>
+#include <string.h>
+#ifdef TOF_REFERENCE
+#include <math.h>
+#endif
+
+//sqrt(v) in Q12. The operand is below 2^56 so the result fits in 28 bits.
+static uint32_t isqrt_q12(uint32_t v)
+{
+  uint64_t op = ((uint64_t)v) << 24;
+  uint64_t res = 0;
+  uint64_t one = 1ULL << 54;
+  while (one > op)
+  {
+    one >>= 2;
+  }
+  while (one != 0)
+  {
+    if (op >= res + one)
+    {
+      op -= res + one;
+      res = (res >> 1) + one;
+    }
+    else
+    {
+      res >>= 1;
+    }
+    one >>= 2;
+  }
+  return (uint32_t) res;
+}
+
+#ifdef __ARM_FEATURE_DSP
+//Q*Q + I*I of a packed (Q int16, I int16) word in one dual multiply-add.
+//The sum is at most 2^31 which SMUAD flags as a signed overflow but still
+//gets right as an unsigned value.
+static inline uint32_t smuad_sq(uint32_t w)
+{
+  uint32_t r;
+  asm ("smuad %0, %1, %1" : "=r" (r) : "r" (w));
+  return r;
+}
+#endif
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "iq_magsqr loads the packed pairs as words");
+
+//Q*Q + I*I of one packed pair
+static inline uint32_t magsqr_word(uint32_t w)
+{
+#ifdef __ARM_FEATURE_DSP
+  return smuad_sq(w);
+#else
+  int32_t q = (int16_t)w;
+  int32_t in = (int16_t)(w >> 16);
+  return (uint32_t)(q*q) + (uint32_t)(in*in);
+#endif
+}
+
+uint32_t iq_magsqr(const uint8_t *iq, uint32_t *magsqr, int n)
+{
+  uint32_t max = 0;
+  for (int i = 0; i < n; i++)
+  {
+    //The pairs are only halfword aligned, the M4 loads them unaligned
+    uint32_t w;
+    memcpy(&w, &iq[4*i], 4);
+    uint32_t m = magsqr_word(w);
+    magsqr[i] = m;
+    if (m > max)
+    {
+      max = m;
+    }
+  }
+  return max;
+}
+
+uint32_t iq_magsqr_bytes(const uint8_t *iq, uint32_t *magsqr, int n)
+{
+  uint32_t max = 0;
+  for (int i = 0; i < n; i++)
+  {
+    int16_t q = (int16_t) (iq[i*4] + (((uint16_t)iq[i*4 + 1]) << 8));
+    int16_t in = (int16_t) (iq[i*4 + 2] + (((uint16_t)iq[i*4 + 3]) << 8));
+    //Cannot overflow: at most 2*(2^15)^2 = 2^31
+    magsqr[i] = (uint32_t)(((int32_t)q)*q) + (uint32_t)(((int32_t)in)*in);
+    if (magsqr[i] > max)
+    {
+      max = magsqr[i];
+    }
+  }
+  return max;
+}
+
+//Unpack the capture and find the bins either side of the quarter-max crossing
+static void unpack(const uint8_t *b, TOFResult &r)
+{
+  r.tof_sf = b[0] + (((uint16_t)b[1]) << 8);
+  //As iq_magsqr, splitting each word into Q and I on the way
+  r.magmax = 0;
+  for (int i = 0; i < TOF_BINS; i++)
+  {
+    uint32_t w;
+    memcpy(&w, &b[6 + 4*i], 4);
+    r.qz[i] = (int16_t)w;
+    r.iz[i] = (int16_t)(w >> 16);
+    uint32_t m = magsqr_word(w);
+    r.magsqr[i] = m;
+    if (m > r.magmax)
+    {
+      r.magmax = m;
+    }
+  }
+  //Now we know the max, find the first index to be greater than quarter max
+  uint32_t quarter = r.magmax >> 2;
+  r.ei = 0;
+  r.si = 0;
+  for (int i = 0; i < TOF_BINS; i++)
+  {
+    if (r.magsqr[i] < quarter)
+    {
+      r.si = i;
+    }
+    if (r.magsqr[i] > quarter)
+    {
+      r.ei = i;
+      break;
+    }
+  }
+  r.valid = r.magsqr[r.ei] > r.magsqr[r.si];
+}
+
+static int8_t count_tx = COUNT_TX;
+
+void set_count_tx(int8_t bins)
+{
+  count_tx = bins;
+}
+
+int8_t get_count_tx()
+{
+  return count_tx;
+}
+
+TOFResult get_tof(const uint8_t *raw, uint32_t calres, uint32_t pulselen)
+{
+  TOFResult r;
+  unpack(raw, r);
+  //Magnitudes in Q12
+  uint32_t s = isqrt_q12(r.magsqr[r.si]);
+  uint32_t e = isqrt_q12(r.magsqr[r.ei]);
+  uint32_t h = isqrt_q12(r.magmax >> 2);
+
+  //Linearly interpolate the crossing between si and ei. 0 <= h-s <= e-s, so
+  //normalise the divisor to 16 bits and the quotient fits in a 32 bit divide
+  uint32_t frac = 0;
+  if (r.valid && h > s)
+  {
+    uint32_t num = h - s;
+    uint32_t den = e - s;
+    while (den >= (1 << 16))
+    {
+      num >>= 1;
+      den >>= 1;
+    }
+    frac = (num << 16) / den;
+  }
+  r.count_q16 = (((int32_t)r.si) << 16) + (int32_t)frac;
+
+  //freq = tof_sf/2048*calres/(pulselen/TICKS_PER_MS) and
+  //tof = (count + count_tx)/freq*8, folded into one scale factor:
+  //8*2048*1000/65536 = 250
+  uint64_t sfcal = ((uint64_t)r.tof_sf) * calres;
+  if (sfcal == 0 || pulselen == 0)
+  {
+    r.valid = false;
+    r.freq_milli = 0;
+    r.tof_ns = 0;
+    r.period_ps = 0;
+    return r;
+  }
+  r.freq_milli = (uint32_t)((sfcal * 1000 * TICKS_PER_MS) / (2048 * (uint64_t)pulselen));
+  //1/freq = 2048*pulselen/(sfcal*TICKS_PER_MS) us, rounded to the nearest ps
+  uint64_t den = sfcal * TICKS_PER_MS;
+  r.period_ps = (uint32_t)((2048 * (uint64_t)pulselen * 1000000 + den/2) / den);
+  int64_t tofnum = ((int64_t)r.count_q16 + (int64_t)count_tx * 65536) * pulselen * 250;
+  r.tof_ns = (int32_t)(tofnum / ((int64_t)sfcal * TICKS_PER_MS));
+  return r;
+}
+
+XcorrTOF get_xcorr_tof(TOFResult const &fwd, TOFResult const &rev)
+{
+  XcorrTOF x = {};
+  if (!fwd.valid || !rev.valid || fwd.period_ps == 0)
+  {
+    return x;
+  }
+  //Power rather than magnitude, which has a sharper correlation peak that
+  //the parabola fits better. Scaled to at most 2^19 so a product is below
+  //2^38 and a correlation sum below 2^42.
+  uint32_t mf[TOF_BINS];
+  uint32_t mr[TOF_BINS];
+  for (int i = 0; i < TOF_BINS; i++)
+  {
+    mf[i] = fwd.magsqr[i] >> 12;
+    mr[i] = rev.magsqr[i] >> 12;
+  }
+  int64_t corr[2*XCORR_LAGS + 1];
+  int best = 0;
+  for (int k = -XCORR_LAGS; k <= XCORR_LAGS; k++)
+  {
+    int64_t sum = 0;
+    for (int i = 0; i < TOF_BINS; i++)
+    {
+      if (i + k >= 0 && i + k < TOF_BINS)
+      {
+        sum += (int64_t)mf[i] * mr[i + k];
+      }
+    }
+    corr[k + XCORR_LAGS] = sum;
+    if (sum > corr[best])
+    {
+      best = k + XCORR_LAGS;
+    }
+  }
+  if (best == 0 || best == 2*XCORR_LAGS)
+  {
+    return x;
+  }
+  //Vertex of the parabola through the peak and its neighbours
+  int64_t l = corr[best - 1];
+  int64_t c = corr[best];
+  int64_t r = corr[best + 1];
+  int64_t den = l - 2*c + r;
+  int32_t frac = den == 0 ? 0 : (int32_t)(((l - r) * 32768) / den);
+  x.lag_q16 = (best - XCORR_LAGS) * 65536 + frac;
+  //A bin is 8 carrier cycles
+  int64_t bin_ps = 8 * (int64_t)fwd.period_ps;
+  x.dt_ps = (int32_t)(((int64_t)x.lag_q16 * bin_ps) >> 16);
+  x.valid = true;
+  return x;
+}
+
+//atan(2^-i) in 1/2^32 turn
+static const int32_t cordic_table[16] = {
+  0x20000000, 0x12E4051E, 0x09FB385B, 0x051111D4, 0x028B0D43, 0x0145D7E1, 0x00A2F61E, 0x00517C55,
+  0x0028BE53, 0x00145F2F, 0x000A2F98, 0x000517CC, 0x00028BE6, 0x000145F3, 0x0000A2FA, 0x0000517D,
+};
+
+int32_t cordic_atan2(int32_t y, int32_t x)
+{
+  uint32_t angle = 0;
+  //Into the right half plane, where the rotations converge
+  if (x < 0)
+  {
+    x = -x;
+    y = -y;
+    angle = 0x80000000;
+  }
+  //int16 inputs, scaled so the shifted terms keep their precision. The
+  //gain of 1.65 still leaves them well inside 32 bits.
+  x *= 1 << 14;
+  y *= 1 << 14;
+  for (int i = 0; i < 16; i++)
+  {
+    int32_t xs = x >> i;
+    int32_t ys = y >> i;
+    if (y > 0)
+    {
+      x += ys;
+      y -= xs;
+      angle += cordic_table[i];
+    }
+    else
+    {
+      x -= ys;
+      y += xs;
+      angle -= cordic_table[i];
+    }
+  }
+  return (int32_t)angle;
+}
+
+PhaseTOF get_phase_tof(TOFResult const &fwd, TOFResult const &rev)
+{
+  return get_phase_tof(fwd, rev, (rev.tof_ns - fwd.tof_ns) * 1000);
+}
+
+PhaseTOF get_phase_tof(TOFResult const &fwd, TOFResult const &rev, int32_t ref_ps)
+{
+  PhaseTOF p = {};
+  if (!fwd.valid || !rev.valid || fwd.period_ps == 0)
+  {
+    return p;
+  }
+  //The bin near the crossing where the weaker capture is strongest
+  uint8_t first = fwd.ei < rev.ei ? fwd.ei : rev.ei;
+  uint32_t best = 0;
+  for (int i = first; i < first + PHASE_SPAN && i < TOF_BINS; i++)
+  {
+    uint32_t m = fwd.magsqr[i] < rev.magsqr[i] ? fwd.magsqr[i] : rev.magsqr[i];
+    if (m > best)
+    {
+      best = m;
+      p.bin = i;
+    }
+  }
+  if (best == 0)
+  {
+    return p;
+  }
+  p.phase_fwd = cordic_atan2(fwd.qz[p.bin], fwd.iz[p.bin]);
+  p.phase_rev = cordic_atan2(rev.qz[p.bin], rev.iz[p.bin]);
+  //One carrier period, then the difference within it
+  int64_t period_ps = fwd.period_ps;
+  int32_t dphase = (int32_t)((uint32_t)p.phase_rev - (uint32_t)p.phase_fwd);
+  int64_t wrapped = (PHASE_SIGN * (int64_t)dphase * period_ps) >> 32;
+  p.dt_env_ps = (rev.tof_ns - fwd.tof_ns) * 1000;
+  //Unwrap to the period closest to the reference
+  int64_t off = ref_ps - wrapped;
+  int64_t k = (off >= 0 ? off + period_ps/2 : off - period_ps/2) / period_ps;
+  p.dt_ps = (int32_t)(wrapped + k * period_ps);
+  int64_t sum_ps = ((int64_t)fwd.tof_ns + rev.tof_ns) * 1000;
+  p.tof_fwd_ns = (int32_t)((sum_ps - p.dt_ps) / 2000);
+  p.tof_rev_ns = (int32_t)((sum_ps + p.dt_ps) / 2000);
+  p.valid = true;
+  return p;
+}
+
+PhaseTOF PhaseTracker::update(TOFResult const &fwd, TOFResult const &rev)
+{
+  if (!fwd.valid || !rev.valid)
+  {
+    return PhaseTOF{};
+  }
+  int64_t env_ps = ((int64_t)rev.tof_ns - fwd.tof_ns) * 1000;
+  if (!primed)
+  {
+    avg_ps = env_ps * 16;
+    primed = true;
+  }
+  //1/16 weight
+  avg_ps += (env_ps * 16 - avg_ps) / 16;
+  return get_phase_tof(fwd, rev, (int32_t)(avg_ps >> 4));
+}
+
+void print_xcorr_tof(XcorrTOF const &x)
+{
+  if (!x.valid)
+  {
+    printf("xcorr invalid\n");
+    return;
+  }
+  printf("xcorr dt %d ps\n", (int)x.dt_ps);
+}
+
+void print_phase_tof(PhaseTOF const &p)
+{
+  if (!p.valid)
+  {
+    printf("phase invalid\n");
+    return;
+  }
+  printf("phase bin %d dt %d ps (envelope %d ps)\n", p.bin, (int)p.dt_ps, (int)p.dt_env_ps);
+  printf("phase tof %d %d ns\n", (int)p.tof_fwd_ns, (int)p.tof_rev_ns);
+}
+
+void print_tof(TOFResult const &r)
+{
+  printf("count %d /1000\n", (int)(((int64_t)r.count_q16 * 1000) >> 16));
+  printf("tof_sf %d\n", r.tof_sf);
+  printf("freq %d uHz\n", (int)r.freq_milli);
+  printf("tof %d uS\n", (int)r.tof_ns);
+  printf("tof 50us estimate %duS\n", (int)(((int64_t)r.count_q16 * 50) >> 16));
+  for (int i = 0; i < TOF_BINS; i++)
+  {
+    printf("data %d = %d + %di\n", i, r.qz[i], r.iz[i]);
+  }
+  printf(".\n");
+}
+
+#ifdef TOF_REFERENCE
+TOFResult get_tof_reference(const uint8_t *raw, uint32_t calres, uint32_t pulselen)
+{
+  TOFResult r;
+  unpack(raw, r);
+  double s = sqrt((double)r.magsqr[r.si]);
+  double e = sqrt((double)r.magsqr[r.ei]);
+  double h = sqrt((double)(r.magmax >> 2));
+  double freq = r.tof_sf/2048.0*calres/((double)pulselen/TICKS_PER_MS);
+  double count = r.si + (h - s)/(e - s);
+  double tof = (count + get_count_tx()) / freq * 8;
+  r.count_q16 = (int32_t)(count*65536);
+  r.freq_milli = (uint32_t)(freq*1000);
+  r.tof_ns = (int32_t)(tof*1000);
+  r.period_ps = (uint32_t)lrint(1e6/freq);
+  return r;
+}
+#endif
+
+#ifdef TOF_CYCLE_BENCH
+void tof_cycle_bench(const uint8_t *raw)
+{
+  uint32_t magsqr[TOF_BINS];
+  uint32_t sink = 0;
+  uint32_t t0 = sys::now();
+  for (int i = 0; i < TOF_BENCH_REPS; i++)
+  {
+    sink += iq_magsqr_bytes(&raw[6], magsqr, TOF_BINS);
+  }
+  uint32_t t1 = sys::now();
+  for (int i = 0; i < TOF_BENCH_REPS; i++)
+  {
+    sink += iq_magsqr(&raw[6], magsqr, TOF_BINS);
+  }
+  uint32_t t2 = sys::now();
+  for (int i = 0; i < TOF_BENCH_REPS; i++)
+  {
+    sink += get_tof(raw, 1, 1).magmax;
+  }
+  uint32_t t3 = sys::now();
+  TOFResult r = get_tof(raw, 1, 1);
+  for (int i = 0; i < TOF_BENCH_REPS; i++)
+  {
+    sink += get_xcorr_tof(r, r).dt_ps;
+  }
+  uint32_t t4 = sys::now();
+  //The tick is too coarse to time one call, so this is cycles per call
+  //averaged over the reps
+  uint32_t cpt = CPU_HZ / 1000 / Timer::MILLISECOND;
+  printf("magsqr bytes %u cycles, packed %u cycles, get_tof %u cycles, xcorr %u cycles (%u)\n",
+    (unsigned)((t1 - t0) * cpt / TOF_BENCH_REPS), (unsigned)((t2 - t1) * cpt / TOF_BENCH_REPS),
+    (unsigned)((t3 - t2) * cpt / TOF_BENCH_REPS), (unsigned)((t4 - t3) * cpt / TOF_BENCH_REPS),
+    (unsigned)(sink & 1));
+}
+#endif
@@ -0,0 +1,172 @@
+#ifndef __TOF_H__
+#define __TOF_H__
+
+#include <stdint.h>
+#include "libstorm.h"
+
+using namespace storm;
+
+//Number of sample bins between the start of the capture and the TX burst,
+//the default for set_count_tx()
+#define COUNT_TX (-4)
+#define TOF_BINS 16
+//The calibration pulse length is measured in kernel ticks
+#define TICKS_PER_MS Timer::MILLISECOND
+
+/**
+ * The decoded result of one sample capture. All the derived quantities are
+ * fixed point so that get_tof() never touches the (soft) floating point
+ * library. The scaled fields carry the same values the text output has
+ * always printed, i.e. freq_milli is (int)(freq*1000) and tof_ns is
+ * (int)(tof*1000) of the old double precision code.
+ */
+struct TOFResult
+{
+  uint16_t tof_sf;
+  int16_t qz[TOF_BINS];
+  int16_t iz[TOF_BINS];
+  uint32_t magsqr[TOF_BINS];
+  uint32_t magmax;
+  uint8_t si;
+  uint8_t ei;
+  //False if there was no threshold crossing to interpolate
+  bool valid;
+  //Interpolated bin index of the quarter-max crossing, Q16.16
+  int32_t count_q16;
+  uint32_t freq_milli;
+  int32_t tof_ns;
+  //One carrier period in ps, from the same terms as tof_ns rather than the
+  //whole kHz of freq_milli
+  uint32_t period_ps;
+};
+
+/**
+ * Compute the time of flight of a 70 byte sample capture using integer
+ * arithmetic only. calres is the CAL_RESULT of the receiving ASIC and
+ * pulselen is the measured calibration pulse length in kernel ticks.
+ *
+ * Against the double precision reference (get_tof_reference) count_q16 is
+ * within 16 LSB (1/4096 of a bin) over the full int16 I/Q range, freq_milli
+ * is within 1, and tof_ns is within 1 plus that count error, and the 1 LSB
+ * the reference's count_q16 is truncated by, scaled by 8/freq. The bench
+ * build checks this.
+ */
+TOFResult get_tof(const uint8_t *raw, uint32_t calres, uint32_t pulselen);
+inline TOFResult get_tof(buf_t const &p, uint32_t calres, uint32_t pulselen)
+{
+  return get_tof(&(*p)[0], calres, pulselen);
+}
+void print_tof(TOFResult const &r);
+
+//The carrier phase a capture reports falls as the arrival is delayed, so
+//t_rev - t_fwd = PHASE_SIGN * (phase_rev - phase_fwd) / (2 pi f)
+#define PHASE_SIGN (-1)
+//Bins from the quarter-max crossing that the phase is taken from
+#define PHASE_SPAN 3
+
+/**
+ * Phase refined time of flight of a reciprocal pair. Angles are in 1/2^32
+ * of a turn, so they wrap as int32s do.
+ */
+struct PhaseTOF
+{
+  //False if either capture had no crossing or there is no carrier frequency
+  bool valid;
+  //The bin both phases were taken at
+  uint8_t bin;
+  int32_t phase_fwd;
+  int32_t phase_rev;
+  //t_rev - t_fwd in ps, from the envelopes and refined by phase
+  int32_t dt_env_ps;
+  int32_t dt_ps;
+  //Both times of flight in ns, about the envelope mean but dt_ps apart
+  int32_t tof_fwd_ns;
+  int32_t tof_rev_ns;
+};
+
+//Envelope cross-correlation searches this many bins of lag either way
+#define XCORR_LAGS 3
+
+struct XcorrTOF
+{
+  //False if either capture had no crossing, or the peak is at the edge of
+  //the lags searched
+  bool valid;
+  //Lag of the B->A envelope behind the A->B one, bins in Q16.16
+  int32_t lag_q16;
+  //t_rev - t_fwd in ps
+  int32_t dt_ps;
+};
+
+/**
+ * t_rev - t_fwd of a pair from the lag that best lines up the two power
+ * envelopes. The correlation is taken at whole bins and the peak refined by
+ * a parabola through it and its neighbours, all in integers. Unlike the
+ * envelope TOFs this uses the whole pulse rather than one threshold
+ * crossing, so the crossing error of each shot does not go into it.
+ */
+XcorrTOF get_xcorr_tof(TOFResult const &fwd, TOFResult const &rev);
+void print_xcorr_tof(XcorrTOF const &x);
+
+//atan2(y, x) by CORDIC, in 1/2^32 turn
+int32_t cordic_atan2(int32_t y, int32_t x);
+
+/**
+ * Refine the envelope TOFs of a pair from the carrier phase. Both phases
+ * are taken at the same bin, the one near the crossing where the weaker of
+ * the two captures is strongest. Their difference gives t_rev - t_fwd
+ * modulo one carrier period, which is unwrapped to the period nearest the
+ * envelope difference. Any fixed phase offset between the two receive
+ * chains shows up as a constant in dt_ps, like a zero wind offset.
+ */
+PhaseTOF get_phase_tof(TOFResult const &fwd, TOFResult const &rev);
+//The same, unwrapped to the period nearest ref_ps rather than the envelope
+PhaseTOF get_phase_tof(TOFResult const &fwd, TOFResult const &rev, int32_t ref_ps);
+void print_phase_tof(PhaseTOF const &p);
+
+/**
+ * Unwraps the pairs of one axis against the average of their envelope
+ * differences rather than each pair's own. The envelope is only good to
+ * about a tenth of a bin, and one that is out by half a carrier period
+ * (2.9 us at 175 kHz) slips the phase result by a whole one, so averaging
+ * it first makes the slips rare once the wind is steadier than that.
+ */
+class PhaseTracker
+{
+public:
+  PhaseTracker() : avg_ps(0), primed(false) {}
+  PhaseTOF update(TOFResult const &fwd, TOFResult const &rev);
+private:
+  //Envelope t_rev - t_fwd in ps, exponential average in Q4
+  int64_t avg_ps;
+  bool primed;
+};
+
+//What get_tof() takes COUNT_TX to be from now on
+void set_count_tx(int8_t bins);
+int8_t get_count_tx();
+
+/**
+ * Squared magnitudes of n packed (Q int16, I int16) pairs, read in place.
+ * Returns the largest. On a core with the DSP extension each pair is one
+ * word load and one SMUAD, elsewhere it is the portable equivalent.
+ */
+uint32_t iq_magsqr(const uint8_t *iq, uint32_t *magsqr, int n);
+//The same a byte at a time, as get_tof() used to, for comparison
+uint32_t iq_magsqr_bytes(const uint8_t *iq, uint32_t *magsqr, int n);
+
+#ifdef TOF_CYCLE_BENCH
+//Core clock, for turning ticks into cycles
+#define CPU_HZ 48000000
+#define TOF_BENCH_REPS 1000
+//Print the cycles per call of both magnitude loops, get_tof() and
+//get_xcorr_tof() on raw
+void tof_cycle_bench(const uint8_t *raw);
+#endif
+
+#ifdef TOF_REFERENCE
+//The original double precision implementation, kept for host comparisons
+TOFResult get_tof_reference(const uint8_t *raw, uint32_t calres, uint32_t pulselen);
+#endif
+
+#endif
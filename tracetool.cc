@@ -0,0 +1,358 @@
+/**
+ * Host side viewer for the event trace of a firmware built with STORM_TRACE
+ * (see storm::trace in libstorm.h).
+ *
+ * sload tail | ./tracetool        reads the '@t' lines of trace::dump()
+ * ./tracetool -u <addr> [port]    fetches the ring over the tuning port
+ *
+ * Prints the events after each gang trigger as a timeline relative to it,
+ * then a summary: trigger to IRQ and readout times, i2c bus occupancy per
+ * device and task run times. -s prints only the summary, -a every event.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <map>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "tuning.h"
+
+namespace
+{
+  struct Event
+  {
+    //Ticks from the first event, unwrapped
+    uint64_t t;
+    uint8_t id;
+    uint8_t a;
+    uint16_t b;
+  };
+  std::vector<Event> events;
+  uint32_t last_tick;
+  uint64_t lost;
+
+  void add(uint32_t tick, uint8_t id, uint8_t a, uint16_t b)
+  {
+    uint64_t t = events.empty() ? 0 : events.back().t + (uint32_t)(tick - last_tick);
+    last_tick = tick;
+    events.push_back(Event{t, id, a, b});
+  }
+
+  double us(uint64_t ticks)
+  {
+    return ticks * 1000.0 / Timer::MILLISECOND;
+  }
+
+  const char *name(uint8_t id)
+  {
+    static const char *names[] = {"?", "tq add", "tq run", "tq done", "timer tick", "timer run", "irq",
+      "i2c issue", "i2c done", "i2c finish", "gang", "shot irq", "shot timeout", "shot readout", "shot done"};
+    if (id < sizeof(names)/sizeof(names[0]))
+    {
+      return names[id];
+    }
+    return id >= trace::USER ? "user" : "?";
+  }
+
+  void print_event(Event const &e, uint64_t origin)
+  {
+    printf("  %+10.1f us  %-13s", us(e.t - origin), name(e.id));
+    switch (e.id)
+    {
+      case trace::TQ_ADD:
+      case trace::TQ_RUN:
+      case trace::TQ_DONE:
+        printf(" depth %u", e.a);
+        break;
+      case trace::TIMER_RUN:
+        printf(" %04x%s", e.b, e.a ? " periodic" : "");
+        break;
+      case trace::IRQ:
+        printf(" pin %u", e.a);
+        break;
+      case trace::I2C_ISSUE:
+        printf(" addr 0x%03x", e.b);
+        if (e.a != 0xFF)
+        {
+          printf(" op %u%s", e.a & 0x7F, e.a & 0x80 ? " read" : "");
+        }
+        break;
+      case trace::I2C_DONE:
+      {
+        static const char *status[] = {"OK", "DNAK", "ANAK", "ERR", "ARBLST"};
+        int16_t st = (int16_t)e.b;
+        printf(" %s", st >= 0 && st <= i2c::ARBLST ? status[st] : "SYSCALL_ERR");
+        break;
+      }
+      case trace::I2C_FINISH:
+        printf(" %u of %u ops ok", e.a, e.b);
+        break;
+      case trace::GANG:
+        printf(" path %u pulse %u ticks", e.a, e.b);
+        break;
+      case trace::SHOT_IRQ:
+      case trace::SHOT_TIMEOUT:
+      case trace::SHOT_READOUT:
+      case trace::SHOT_DONE:
+        printf(" path %u", e.a);
+        break;
+      default:
+        if (e.id >= trace::USER)
+        {
+          printf(" id 0x%02x %u %u", e.id, e.a, e.b);
+        }
+        break;
+    }
+    printf("\n");
+  }
+
+  void read_text(FILE *in)
+  {
+    char line[256];
+    while (fgets(line, sizeof(line), in))
+    {
+      //Binary records may share the line with it
+      char *p = strstr(line, "@t ");
+      unsigned long t;
+      unsigned id, a, b;
+      if (p && sscanf(p, "@t %lu %u %u %u", &t, &id, &a, &b) == 4)
+      {
+        add(t, id, a, b);
+      }
+      else if (p == nullptr && (p = strstr(line, "trace ")) != nullptr)
+      {
+        unsigned long total, missed;
+        if (sscanf(p, "trace %lu events, %lu lost", &total, &missed) == 2)
+        {
+          lost += missed;
+        }
+      }
+    }
+  }
+
+  bool read_udp(const char *addr, const char *port)
+  {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *ai;
+    if (getaddrinfo(addr, port, &hints, &ai) != 0)
+    {
+      fprintf(stderr, "tracetool: cannot resolve %s\n", addr);
+      return false;
+    }
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    timeval tv = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    uint32_t from = 0;
+    int retries = 0;
+    while (retries < 3)
+    {
+      uint8_t req[5] = {TUNE_TRACE, (uint8_t)from, (uint8_t)(from >> 8), (uint8_t)(from >> 16), (uint8_t)(from >> 24)};
+      uint8_t reply[TUNE_MAX_REPLY];
+      sendto(fd, req, sizeof(req), 0, ai->ai_addr, ai->ai_addrlen);
+      ssize_t n = recv(fd, reply, sizeof(reply), 0);
+      if (n < 7 || reply[0] != (TUNE_TRACE | TUNE_REPLY))
+      {
+        retries++;
+        continue;
+      }
+      retries = 0;
+      uint32_t first = reply[2] | (reply[3] << 8) | (reply[4] << 16) | ((uint32_t)reply[5] << 24);
+      uint8_t count = reply[6];
+      if (count == 0 || n < 7 + 8*count)
+      {
+        break;
+      }
+      lost += first - from;
+      for (int i = 0; i < count; i++)
+      {
+        const uint8_t *p = &reply[7 + 8*i];
+        add(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24), p[4], p[5], p[6] | (p[7] << 8));
+      }
+      from = first + count;
+    }
+    close(fd);
+    freeaddrinfo(ai);
+    if (retries)
+    {
+      fprintf(stderr, "tracetool: no reply from %s, is the firmware built with STORM_TRACE?\n", addr);
+    }
+    return !events.empty();
+  }
+
+  struct MinMax
+  {
+    uint32_t n = 0;
+    uint64_t sum = 0, min = UINT64_MAX, max = 0;
+    void add(uint64_t v)
+    {
+      n++;
+      sum += v;
+      min = v < min ? v : min;
+      max = v > max ? v : max;
+    }
+    void print(const char *what) const
+    {
+      if (n)
+      {
+        printf("%-22s %6u  %9.1f %9.1f %9.1f us min/mean/max\n", what, n, us(min), us(sum) / n, us(max));
+      }
+    }
+  };
+
+  void summarise()
+  {
+    MinMax to_irq, to_done, task, i2c_op;
+    struct Device
+    {
+      uint32_t ops;
+      uint64_t busy;
+    };
+    std::map<uint16_t, Device> devices;
+    uint64_t busy = 0;
+    uint64_t trigger = 0;
+    bool shot = false;
+    bool issued = false, running = false;
+    uint64_t issue_t = 0, run_t = 0;
+    uint16_t addr = 0;
+    for (Event const &e : events)
+    {
+      switch (e.id)
+      {
+        case trace::GANG:
+          trigger = e.t;
+          shot = true;
+          break;
+        case trace::SHOT_IRQ:
+          if (shot)
+          {
+            to_irq.add(e.t - trigger);
+          }
+          break;
+        case trace::SHOT_DONE:
+          if (shot)
+          {
+            to_done.add(e.t - trigger);
+          }
+          shot = false;
+          break;
+        case trace::TQ_RUN:
+          running = true;
+          run_t = e.t;
+          break;
+        case trace::TQ_DONE:
+          if (running)
+          {
+            task.add(e.t - run_t);
+          }
+          running = false;
+          break;
+        case trace::I2C_ISSUE:
+          issued = true;
+          issue_t = e.t;
+          addr = e.b;
+          break;
+        case trace::I2C_DONE:
+        case trace::I2C_FINISH:
+          if (issued)
+          {
+            Device &d = devices[addr];
+            d.ops++;
+            d.busy += e.t - issue_t;
+            busy += e.t - issue_t;
+            i2c_op.add(e.t - issue_t);
+          }
+          issued = false;
+          break;
+      }
+    }
+    uint64_t span = events.back().t;
+    printf("%u events over %.1f ms, %llu lost before them\n", (unsigned)events.size(), us(span) / 1000,
+      (unsigned long long)lost);
+    to_irq.print("trigger to irq");
+    to_done.print("trigger to readout");
+    task.print("task run");
+    i2c_op.print("i2c op");
+    printf("i2c busy %.1f%% of the time\n", span ? 100.0 * busy / span : 0.0);
+    for (auto const &d : devices)
+    {
+      printf("  addr 0x%03x %6u ops %9.1f us  %5.1f%%\n", d.first, d.second.ops, us(d.second.busy),
+        span ? 100.0 * d.second.busy / span : 0.0);
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  bool summary = false;
+  bool all = false;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++)
+  {
+    if (strcmp(argv[i], "-s") == 0)
+    {
+      summary = true;
+    }
+    else if (strcmp(argv[i], "-a") == 0)
+    {
+      all = true;
+    }
+    else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc)
+    {
+      char port[8];
+      snprintf(port, sizeof(port), "%u", (unsigned)(i + 2 < argc ? atoi(argv[i + 2]) : 4412));
+      if (!read_udp(argv[i + 1], port))
+      {
+        return 1;
+      }
+      i = argc;
+      break;
+    }
+    else
+    {
+      fprintf(stderr, "usage: tracetool [-s|-a] [-u addr [port]]\n");
+      return 2;
+    }
+  }
+  if (i == argc && events.empty())
+  {
+    read_text(stdin);
+  }
+  if (events.empty())
+  {
+    fprintf(stderr, "tracetool: no trace events\n");
+    return 1;
+  }
+  if (all)
+  {
+    for (Event const &e : events)
+    {
+      print_event(e, 0);
+    }
+  }
+  else if (!summary)
+  {
+    //Everything from each trigger up to the next
+    bool in_shot = false;
+    uint64_t origin = 0;
+    for (Event const &e : events)
+    {
+      if (e.id == trace::GANG)
+      {
+        in_shot = true;
+        origin = e.t;
+        printf("shot path %u at %.1f ms\n", e.a, us(e.t) / 1000);
+      }
+      if (in_shot)
+      {
+        print_event(e, origin);
+      }
+    }
+  }
+  summarise();
+  return 0;
+}
@@ -0,0 +1,292 @@
+#ifndef __TUNING_H__
+#define __TUNING_H__
+
+#include <stdio.h>
+#include <functional>
+#include "libstorm.h"
+#include "asic.h"
+#include "measure.h"
+#include "tof.h"
+
+using namespace storm;
+
+#define TUNE_GET 0x01
+#define TUNE_SET 0x02
+//Only with STORM_TRACE
+#define TUNE_TRACE 0x03
+#define TUNE_SCHED 0x04
+#define TUNE_REPLY 0x80
+
+#define TUNE_OK 0
+#define TUNE_BAD_PARAM 1
+#define TUNE_BAD_VALUE 2
+#define TUNE_MALFORMED 3
+
+//Parameter ids
+#define TUNE_RATE 1
+#define TUNE_RANGE 2
+#define TUNE_READOUT_US 3
+#define TUNE_COUNT_TX 4
+#define TUNE_PULSE_TICKS 5
+#define TUNE_PARAMS 5
+
+#define TUNE_REPLY_LEN (2 + 5*TUNE_PARAMS)
+//Trace events per reply, which with the header fits TELEMETRY_PAYLOAD
+#define TUNE_TRACE_CHUNK 8
+#define TUNE_TRACE_LEN (7 + 8*TUNE_TRACE_CHUNK)
+//Scheduler counters, then the latency histogram
+#define TUNE_SCHED_COUNTERS 7
+#define TUNE_SCHED_LEN (2 + 4*(TUNE_SCHED_COUNTERS + tq::LATENCY_BUCKETS))
+#define TUNE_MAX_REPLY TUNE_SCHED_LEN
+static_assert(TUNE_MAX_REPLY >= TUNE_REPLY_LEN && TUNE_MAX_REPLY >= TUNE_TRACE_LEN, "TUNE_MAX_REPLY too short");
+
+/**
+ * Live tuning of the measurement over UDP, so a site can be tuned without
+ * reflashing. All values are little endian int32.
+ *
+ * Request:
+ *    0   1  TUNE_GET, or TUNE_SET followed by any number of
+ *    n   5  parameter id, value
+ *
+ * Reply, to the sender:
+ *    0   1  request op | TUNE_REPLY
+ *    1   1  TUNE_OK, or why nothing was set
+ *    2  25  parameter id, value, for every parameter
+ *
+ * A SET is checked in full before anything is applied. The engine picks the
+ * new values up at its next shot (see MeasurementEngine) and COUNT_TX at the
+ * next pair, so measuring never stops.
+ *
+ * Parameters:
+ *   TUNE_RATE          shots per second, MIN_RATE..MAX_RATE
+ *   TUNE_RANGE         MAX_RANGE register value, 1..255
+ *   TUNE_READOUT_US    readout delay (IRQ timeout in IRQ mode), us
+ *   TUNE_COUNT_TX      bins from the start of the capture to the burst
+ *   TUNE_PULSE_TICKS   gang trigger pulse length, ticks
+ *
+ * With STORM_TRACE, TUNE_TRACE fetches the trace ring (see storm::trace):
+ *
+ * Request:
+ *    0   1  TUNE_TRACE
+ *    1   4  number of the first event wanted
+ *
+ * Reply:
+ *    0   1  TUNE_TRACE | TUNE_REPLY
+ *    1   1  TUNE_OK
+ *    2   4  number of the first event sent, later than asked if the ring
+ *           had moved past it
+ *    6   1  events, up to TUNE_TRACE_CHUNK, none once caught up
+ *    7  8n  tick u32, id, a, b u16
+ *
+ * TUNE_SCHED reads the task queue counters (see tq::Stats), to tell
+ * scheduler backlog from bus contention when shots jitter:
+ *
+ * Request:
+ *    0   1  TUNE_SCHED
+ *    1   1  optional, 1 to start the counters over once read
+ *
+ * Reply:
+ *    0   1  TUNE_SCHED | TUNE_REPLY
+ *    1   1  TUNE_OK
+ *    2   4  tasks run
+ *    6   4  queue overflows
+ *   10   4  deepest the queue has been
+ *   14   4  longest dispatch latency, us
+ *   18   4  longest task, us
+ *   22   4  time busy running tasks, parts per thousand
+ *   26   4  time the counters cover, ms
+ *   30  48  dispatch latency histogram, tq::LATENCY_BUCKETS counts
+ */
+class Tuning
+{
+public:
+  Tuning(MeasurementEngine *engine) : engine(engine) {}
+  bool open(uint16_t port)
+  {
+    sock = UDPSocket::open_view(port, [this](UDPSocket::PacketView const &v)
+    {
+      this->handle(v);
+    });
+    if (!sock)
+    {
+      printf("ERR: tuning socket %u\n", port);
+      return false;
+    }
+    return true;
+  }
+  //Called after the rate has been changed, with the new rate
+  void on_rate(std::function<void(uint32_t)> cb)
+  {
+    onrate = cb;
+  }
+  //Apply a request and build the reply, returning its length
+  size_t apply(const uint8_t *req, size_t len, uint8_t reply[TUNE_MAX_REPLY])
+  {
+    uint8_t status = TUNE_OK;
+    uint8_t op = len ? req[0] : 0;
+#ifdef STORM_TRACE
+    if (op == TUNE_TRACE && len == 5)
+    {
+      return read_trace((uint32_t)get32(&req[1]), reply);
+    }
+#endif
+    if (op == TUNE_SCHED && (len == 1 || (len == 2 && req[1] <= 1)))
+    {
+      return read_sched(len == 2 && req[1], reply);
+    }
+    if (len == 0 || (op != TUNE_GET && op != TUNE_SET) || (op == TUNE_GET && len != 1) ||
+        (op == TUNE_SET && (len - 1) % 5 != 0))
+    {
+      status = TUNE_MALFORMED;
+    }
+    for (size_t i = 1; status == TUNE_OK && op == TUNE_SET && i < len; i += 5)
+    {
+      status = check(req[i], get32(&req[i+1]));
+    }
+    for (size_t i = 1; status == TUNE_OK && op == TUNE_SET && i < len; i += 5)
+    {
+      set(req[i], get32(&req[i+1]));
+    }
+    reply[0] = op | TUNE_REPLY;
+    reply[1] = status;
+    for (int p = 0; p < TUNE_PARAMS; p++)
+    {
+      reply[2 + 5*p] = p + 1;
+      put32(&reply[3 + 5*p], get(p + 1));
+    }
+    return TUNE_REPLY_LEN;
+  }
+private:
+#ifdef STORM_TRACE
+  static size_t read_trace(uint32_t from, uint8_t *reply)
+  {
+    trace::Record r[TUNE_TRACE_CHUNK];
+    size_t n = trace::read(from, r, TUNE_TRACE_CHUNK);
+    reply[0] = TUNE_TRACE | TUNE_REPLY;
+    reply[1] = TUNE_OK;
+    put32(&reply[2], from - n);
+    reply[6] = n;
+    for (size_t i = 0; i < n; i++)
+    {
+      uint8_t *p = &reply[7 + 8*i];
+      put32(p, r[i].t);
+      p[4] = r[i].id;
+      p[5] = r[i].a;
+      p[6] = r[i].b & 0xFF;
+      p[7] = r[i].b >> 8;
+    }
+    return 7 + 8*n;
+  }
+#endif
+  static size_t read_sched(bool clear, uint8_t *reply)
+  {
+    tq::Stats const &st = tq::stats;
+    uint64_t total = st.busy + st.idle;
+    int32_t counters[TUNE_SCHED_COUNTERS] = {
+      (int32_t)st.ran,
+      (int32_t)st.overflows,
+      st.max_depth,
+      (int32_t)((uint64_t)st.max_latency * 1000 / Timer::MILLISECOND),
+      (int32_t)((uint64_t)st.max_run * 1000 / Timer::MILLISECOND),
+      total ? (int32_t)(st.busy * 1000 / total) : 0,
+      (int32_t)(total / Timer::MILLISECOND)};
+    reply[0] = TUNE_SCHED | TUNE_REPLY;
+    reply[1] = TUNE_OK;
+    for (int i = 0; i < TUNE_SCHED_COUNTERS; i++)
+    {
+      put32(&reply[2 + 4*i], counters[i]);
+    }
+    for (int i = 0; i < tq::LATENCY_BUCKETS; i++)
+    {
+      put32(&reply[2 + 4*(TUNE_SCHED_COUNTERS + i)], st.latency[i]);
+    }
+    if (clear)
+    {
+      tq::clear_stats();
+    }
+    return TUNE_SCHED_LEN;
+  }
+  void handle(UDPSocket::PacketView const &v)
+  {
+    size_t n = apply(v.payload, v.length, reply);
+    sock->sendto(v.strsrc, v.port, reply, n);
+  }
+  static uint8_t check(uint8_t param, int32_t v)
+  {
+    switch (param)
+    {
+      case TUNE_RATE:
+        return v >= MIN_RATE && v <= MAX_RATE ? TUNE_OK : TUNE_BAD_VALUE;
+      case TUNE_RANGE:
+        return v >= 1 && v <= 255 ? TUNE_OK : TUNE_BAD_VALUE;
+      case TUNE_READOUT_US:
+        return v >= (int32_t)(MIN_READOUT_DELAY * 1000 / Timer::MILLISECOND) &&
+               v <= (int32_t)(MAX_READOUT_DELAY * 1000 / Timer::MILLISECOND) ? TUNE_OK : TUNE_BAD_VALUE;
+      case TUNE_COUNT_TX:
+        return v >= -TOF_BINS && v <= TOF_BINS ? TUNE_OK : TUNE_BAD_VALUE;
+      case TUNE_PULSE_TICKS:
+        return v >= 1 && v <= (int32_t)MAX_TRIGGER_PULSE ? TUNE_OK : TUNE_BAD_VALUE;
+    }
+    return TUNE_BAD_PARAM;
+  }
+  void set(uint8_t param, int32_t v)
+  {
+    switch (param)
+    {
+      case TUNE_RATE:
+        engine->set_rate(v);
+        if (onrate)
+        {
+          onrate(v);
+        }
+        break;
+      case TUNE_RANGE:
+        engine->set_range(v);
+        break;
+      case TUNE_READOUT_US:
+        engine->set_readout_delay(v * Timer::MILLISECOND / 1000);
+        break;
+      case TUNE_COUNT_TX:
+        set_count_tx(v);
+        break;
+      case TUNE_PULSE_TICKS:
+        engine->set_trigger_pulse(v);
+        break;
+    }
+  }
+  int32_t get(uint8_t param) const
+  {
+    switch (param)
+    {
+      case TUNE_RATE:
+        return engine->get_rate();
+      case TUNE_RANGE:
+        return engine->get_range();
+      case TUNE_READOUT_US:
+        return engine->get_readout_delay() * 1000 / Timer::MILLISECOND;
+      case TUNE_COUNT_TX:
+        return get_count_tx();
+      case TUNE_PULSE_TICKS:
+        return engine->get_trigger_pulse();
+    }
+    return 0;
+  }
+  static int32_t get32(const uint8_t *p)
+  {
+    return (int32_t)(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+  }
+  static void put32(uint8_t *p, int32_t v)
+  {
+    for (int i = 0; i < 4; i++)
+    {
+      p[i] = ((uint32_t)v >> (8*i)) & 0xFF;
+    }
+  }
+
+  MeasurementEngine *engine;
+  std::shared_ptr<UDPSocket> sock;
+  std::function<void(uint32_t)> onrate;
+  uint8_t reply[TUNE_MAX_REPLY];
+};
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef __WIND_H__
+#define __WIND_H__
+
+#include <stdio.h>
+#include "libstorm.h"
+#include "array.h"
+#include "measure.h"
+#include "calibration.h"
+#include "frame.h"
+#include "tof.h"
+
+using namespace storm;
+
+//Pairs averaged per axis for the zero wind offset
+#define ZERO_PAIRS 200
+//gamma*R/M for dry air, in (m/s)^2 per K, so Ts = c^2/SONIC_K
+#define SONIC_K 403
+#define KELVIN_MC 273150
+
+struct WindSample
+{
+  //False if either TOF was invalid
+  bool valid;
+  uint8_t axis;
+  //Whether dt came from the carrier phase, rather than the envelopes
+  bool phase;
+  //t_rev - t_fwd in ps, less the zero wind offset
+  int32_t dt_ps;
+  //Along the axis from its first end to its second
+  int32_t wind_mm_s;
+  int32_t sos_mm_s;
+  //Sonic temperature in 1/1000 degree C
+  int32_t temp_mc;
+};
+
+/**
+ * The per pair output stage: turns the two captures of an axis into the wind
+ * along it, from the difference of the reciprocal TOFs, and the speed of
+ * sound and sonic temperature, from their sum.
+ *
+ * The TOFs are refined by the carrier phase (see PhaseTracker) where that
+ * works. Two corrections kept by the Calibration are applied: the zero wind
+ * offset is taken out of their difference, and the fixed delay, from the
+ * transducers and from the threshold crossing coming after the true
+ * arrival, out of each TOF. zero() measures both: with the head shrouded at
+ * a known air temperature it averages the next ZERO_PAIRS pairs of each
+ * axis and hands the result to the Calibration, which writes it to flash.
+ */
+class WindOutput
+{
+public:
+  WindOutput(TransducerArray *array, Calibration *cal)
+    : array(array), cal(cal), zero_temp_mc(0), zero_left{}, zero_sum{}, zero_tof{}
+  {
+  }
+  //Start measuring the zero wind offset and delay of every axis, with the
+  //air at temp_mc, in 1/1000 degree C
+  void zero(int32_t temp_mc)
+  {
+    zero_temp_mc = temp_mc;
+    for (int k = 0; k < array->naxes(); k++)
+    {
+      zero_left[k] = ZERO_PAIRS;
+      zero_sum[k] = 0;
+      zero_tof[k] = 0;
+    }
+  }
+  bool zeroing() const
+  {
+    for (int k = 0; k < array->naxes(); k++)
+    {
+      if (zero_left[k])
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+  WindSample process(uint8_t axis, TOFResult const &fwd, TOFResult const &rev)
+  {
+    WindSample w = {};
+    w.axis = axis;
+    if (!fwd.valid || !rev.valid)
+    {
+      return w;
+    }
+    PhaseTOF p = phase[axis].update(fwd, rev);
+    int32_t fwd_ns = fwd.tof_ns;
+    int32_t rev_ns = rev.tof_ns;
+    int32_t dt_ps = (rev_ns - fwd_ns) * 1000;
+    if (p.valid)
+    {
+      fwd_ns = p.tof_fwd_ns;
+      rev_ns = p.tof_rev_ns;
+      dt_ps = p.dt_ps;
+      w.phase = true;
+    }
+    uint16_t length = array->axis(axis).length;
+    if (zero_left[axis])
+    {
+      zero_sum[axis] += dt_ps;
+      zero_tof[axis] += fwd_ns + rev_ns;
+      if (--zero_left[axis] == 0)
+      {
+        //Against the TOF still air at zero_temp_mc would give
+        int32_t c = sound_speed_at(zero_temp_mc);
+        int32_t tof = (int32_t)(zero_tof[axis] / (2*ZERO_PAIRS));
+        cal->set_zero(axis, (int32_t)(zero_sum[axis] / ZERO_PAIRS),
+                      c ? tof - (int32_t)((int64_t)length * 1000000000LL / c) : 0);
+        printf("zero wind axis %d: %d ps, delay %d ns\n", axis, (int)cal->zero_ps(axis),
+          (int)cal->delay_ns(axis));
+      }
+    }
+    fwd_ns -= cal->delay_ns(axis);
+    rev_ns -= cal->delay_ns(axis);
+    w.dt_ps = dt_ps - cal->zero_ps(axis);
+    w.wind_mm_s = TransducerArray::along(length, fwd_ns, rev_ns, w.dt_ps);
+    w.sos_mm_s = TransducerArray::sound_speed(length, fwd_ns, rev_ns);
+    w.temp_mc = sonic_temp_mc(w.sos_mm_s);
+    w.valid = true;
+    return w;
+  }
+  //The same for a pair from the engine
+  WindSample process(Shot const &a2b, Shot const &b2a)
+  {
+    uint16_t pulselen = cal->get_pulselen();
+    return process(a2b.axis, get_tof(a2b.data, cal->calres(a2b), pulselen),
+                   get_tof(b2a.data, cal->calres(b2a), pulselen));
+  }
+  static int32_t sonic_temp_mc(int32_t sos_mm_s)
+  {
+    return (int32_t)((int64_t)sos_mm_s * sos_mm_s / (SONIC_K * 1000) - KELVIN_MC);
+  }
+  //The inverse, in mm/s
+  static int32_t sound_speed_at(int32_t temp_mc)
+  {
+    if (temp_mc <= -KELVIN_MC)
+    {
+      return 0;
+    }
+    uint64_t sq = (uint64_t)(temp_mc + KELVIN_MC) * SONIC_K * 1000;
+    uint64_t res = 0;
+    uint64_t one = 1ULL << 62;
+    while (one > sq)
+    {
+      one >>= 2;
+    }
+    while (one != 0)
+    {
+      if (sq >= res + one)
+      {
+        sq -= res + one;
+        res = (res >> 1) + one;
+      }
+      else
+      {
+        res >>= 1;
+      }
+      one >>= 2;
+    }
+    return (int32_t)res;
+  }
+  static void print(WindSample const &w)
+  {
+    if (!w.valid)
+    {
+      printf("axis %d wind invalid\n", w.axis);
+      return;
+    }
+    printf("axis %d wind %d mm/s c %d mm/s T %d mC dt %d ps%s\n", w.axis, (int)w.wind_mm_s, (int)w.sos_mm_s,
+      (int)w.temp_mc, (int)w.dt_ps, w.phase ? "" : " (envelope)");
+  }
+private:
+  TransducerArray *array;
+  Calibration *cal;
+  PhaseTracker phase[MAX_AXES];
+  int32_t zero_temp_mc;
+  uint16_t zero_left[MAX_AXES];
+  //Sums of t_rev - t_fwd in ps and of t_fwd + t_rev in ns
+  int64_t zero_sum[MAX_AXES];
+  int64_t zero_tof[MAX_AXES];
+};
+
+#endif